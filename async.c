@@ -0,0 +1,444 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <scsi/sg.h>
+#include <sys/resource.h>
+#include "async.h"
+#include "budget.h"
+#include "cache.h"
+#include "health.h"
+#include "metrics.h"
+#include "scsi.h"
+#include "sysfs.h"
+#include "trace.h"
+#include "transport.h"
+
+
+// The chain of commands sent to each device
+enum step {
+    STEP_POWER, // REQUEST SENSE, to check the disk isn't asleep
+    STEP_INQUIRY,
+    STEP_SENSE, // MODE SENSE of the page control in slot->pc
+    STEP_SELECT,
+    STEP_DONE,
+};
+
+// A device in progress
+struct slot {
+    size_t index;
+    const struct transport* transport;
+    int fd; // -1 when the slot is free
+    enum step step;
+    int pc;
+    uint64_t started;   // trace_now_us() when the device was started
+    uint64_t submitted; // and when the command in flight was submitted
+    enum phase phase;   // of the command in flight
+    struct plan plan;
+    struct cache_key key;
+    struct budget_key budget;
+    struct health_key health;
+    struct sg_io_hdr hdr;
+    uint8_t cdb[10];
+    uint8_t sense[SENSE_LEN];
+    union {
+        uint8_t data[64];
+        struct select_packet packet;
+    };
+    struct result result;
+};
+
+struct engine {
+    const char* const* paths;
+    const struct request* requests;
+    size_t count;
+    size_t next;
+    struct sched* sched;
+    async_done_fn done;
+    void* ctx;
+    size_t failed;
+};
+
+// The phase a step is timed as
+static enum phase step_phase(const struct slot* slot) {
+    switch (slot->step) {
+    case STEP_POWER:   return PHASE_REQUEST_SENSE;
+    case STEP_INQUIRY: return PHASE_INQUIRY;
+    case STEP_SENSE:   return PHASE_MODE_SENSE + slot->pc;
+    default:           return PHASE_MODE_SELECT;
+    }
+}
+
+// Submit the command for the slot's current step, returns 0, -ETIME if the deadline has passed, or -errno
+static int submit(struct slot* slot, const struct request* request) {
+    struct sg_io_hdr* const hdr = &slot->hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->interface_id = 'S';
+    hdr->cmdp = slot->cdb;
+    hdr->sbp = slot->sense;
+    hdr->mx_sb_len = sizeof(slot->sense);
+    hdr->dxferp = slot->data;
+    hdr->timeout = transport_timeout(request, &slot->plan, step_phase(slot));
+    hdr->pack_id = slot->step;
+
+    switch (slot->step) {
+    case STEP_POWER:
+        memset(slot->data, 0, sizeof(slot->data));
+        hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+        hdr->dxfer_len = SENSE_LEN;
+        hdr->cmd_len = scsi_request_sense_cdb(slot->cdb, SENSE_LEN);
+        break;
+    case STEP_INQUIRY:
+        memset(slot->data, 0, sizeof(slot->data));
+        hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+        hdr->dxfer_len = INQUIRY_LEN;
+        hdr->cmd_len = scsi_inquiry_cdb(slot->cdb, INQUIRY_LEN);
+        break;
+    case STEP_SENSE:
+        memset(slot->data, 0, sizeof(slot->data));
+        hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+        hdr->dxfer_len = MODE_SENSE10_LEN;
+        hdr->cmd_len = scsi_mode_sense10_cdb(slot->cdb, slot->pc, PAGE_CODE, MODE_SENSE10_LEN);
+        break;
+    case STEP_SELECT:
+        hdr->dxfer_direction = SG_DXFER_TO_DEV;
+        hdr->dxfer_len = device_select_packet(&slot->packet, &slot->result.current, request->new);
+        hdr->cmd_len = scsi_mode_select10_cdb(slot->cdb, slot->result.nv_write, hdr->dxfer_len);
+        break;
+    case STEP_DONE:
+        return 0;
+    }
+
+    slot->phase = step_phase(slot);
+    if (!hdr->timeout) {
+        return -ETIME;
+    }
+    TRACE_COMMAND_START(slot->fd, slot->phase);
+    slot->submitted = trace_now_us();
+    return slot->transport->async_submit(slot->fd, hdr);
+}
+
+// The device error reported if a step fails
+static enum device_err step_err(enum step step) {
+    switch (step) {
+    case STEP_POWER:
+    case STEP_INQUIRY: return DEVICE_ERR_INQUIRY;
+    case STEP_SELECT:  return DEVICE_ERR_MODE_SELECT;
+    default:           return DEVICE_ERR_MODE_SENSE;
+    }
+}
+
+// Fail the current step, because a command couldn't be submitted (err from submit()) or was abandoned (-ETIME)
+static void fail(struct slot* slot, int err) {
+    if (err == -ETIME) {
+        slot->result.err = DEVICE_ERR_DEADLINE;
+        slot->result.detail = slot->phase;
+    } else {
+        slot->result.err = step_err(slot->step);
+        slot->result.detail = SCSI_CAT_OTHER;
+    }
+    slot->step = STEP_DONE;
+}
+
+// Work out the step after reading the page control `pc` (or -1 if none have been read)
+static enum step next_sense(struct slot* slot, const struct request* request, const struct plan* plan, int pc) {
+    slot->pc = device_next_pc(plan, pc);
+    if (slot->pc >= 0) {
+        return STEP_SENSE;
+    }
+    struct result* const result = &slot->result;
+    result->err = device_check_pages(result);
+    if (result->err != DEVICE_OK) {
+        return STEP_DONE;
+    }
+    result->pages_valid = true;
+    if (plan->select) {
+        device_plan_save(request, plan, result);
+    }
+    if (plan->select && device_unchanged(request, plan, result)) {
+        result->unchanged = true;
+        return STEP_DONE;
+    }
+    return plan->select ? STEP_SELECT : STEP_DONE;
+}
+
+// Work out the step after the power check
+static enum step next_inquiry(struct slot* slot, const struct request* request, const struct plan* plan) {
+    return plan->inquiry ? STEP_INQUIRY : next_sense(slot, request, plan, -1);
+}
+
+// Process a completed command and work out the next step
+static enum step complete(struct slot* slot, const struct request* request, const struct plan* plan) {
+    struct sg_io_hdr* const hdr = &slot->hdr;
+    struct result* const result = &slot->result;
+    const int cat = scsi_categorize(hdr->status, hdr->host_status, hdr->driver_status, slot->sense, hdr->sb_len_wr);
+    const uint64_t us = trace_now_us() - slot->submitted;
+    TRACE_COMMAND_DONE(slot->fd, slot->phase, cat, us);
+    metrics_command(slot->phase, cat, us);
+    device_time_phase(result, slot->phase, us);
+
+    // A failed power check only means we can't tell, so carry on
+    if (slot->step == STEP_POWER) {
+        const bool clean = !hdr->status && !hdr->host_status && !(hdr->driver_status & 0x0f);
+        if (clean && scsi_sense_low_power(slot->data, hdr->dxfer_len - hdr->resid)) {
+            result->asleep = true;
+            return STEP_DONE;
+        }
+        return next_inquiry(slot, request, plan);
+    }
+
+    if (transport_deadline_passed(plan, cat)) {
+        result->err = DEVICE_ERR_DEADLINE;
+        result->detail = slot->phase;
+        return STEP_DONE;
+    }
+    if (cat != SCSI_CAT_CLEAN) {
+        result->err = step_err(slot->step);
+        result->detail = cat;
+        return STEP_DONE;
+    }
+    const size_t len = hdr->dxfer_len - hdr->resid;
+
+    switch (slot->step) {
+    case STEP_INQUIRY:
+        scsi_parse_inquiry(slot->data, len, &result->identity);
+        result->identified = true;
+        result->support = device_check_identity(&result->identity);
+        if (result->support != DEVICE_OK && !request->force) {
+            result->err = result->support;
+            return STEP_DONE;
+        }
+        return next_sense(slot, request, plan, -1);
+    case STEP_SENSE:
+        if (!scsi_parse_mode_sense10(slot->data, len, device_result_page(result, slot->pc))) {
+            result->err = DEVICE_ERR_MODE_SENSE;
+            result->detail = SCSI_CAT_OTHER;
+            return STEP_DONE;
+        }
+        result->pages |= PC_MASK(slot->pc);
+        return next_sense(slot, request, plan, slot->pc);
+    default:
+        return STEP_DONE;
+    }
+}
+
+static void finish(struct engine* engine, struct slot* slot) {
+    if (slot->fd >= 0) {
+        const uint64_t start = trace_now_us();
+        slot->transport->async_close(slot->fd);
+        device_time_phase(&slot->result, PHASE_CLOSE, trace_now_us() - start);
+        slot->fd = -1;
+    }
+    slot->result.elapsed_us = trace_now_us() - slot->started;
+    TRACE_DEVICE_DONE(engine->paths[slot->index], slot->result.err, slot->result.elapsed_us);
+    if (slot->result.asleep) {
+        cache_recall(&slot->key, &engine->requests[slot->index], &slot->plan, &slot->result);
+    }
+    cache_update(&slot->key, &engine->requests[slot->index], &slot->result);
+    budget_update(&slot->budget, &slot->result);
+    health_update(&slot->health, &slot->result);
+    if (engine->sched) {
+        sched_done(engine->sched, slot->index);
+    }
+    if (engine->done(engine->ctx, slot->index, &slot->result) != 0) {
+        engine->failed++;
+    }
+}
+
+// Pick the next device to start, returns false if there are none left (or the scheduler is holding them back)
+static bool engine_next(struct engine* engine, size_t* index) {
+    if (engine->sched) {
+        return sched_next(engine->sched, index);
+    }
+    if (engine->next >= engine->count) {
+        return false;
+    }
+    *index = engine->next++;
+    return true;
+}
+
+// Start the next device in a free slot, returns false if there are no more devices to start yet
+static bool start(struct engine* engine, struct slot* slot) {
+    size_t index;
+    while (engine_next(engine, &index)) {
+        memset(slot, 0, sizeof(*slot));
+        slot->index = index;
+        slot->fd = -1;
+        slot->started = trace_now_us();
+        TRACE_DEVICE_START(engine->paths[slot->index]);
+        slot->plan = device_plan(&engine->requests[slot->index]);
+        transport_start(&engine->requests[slot->index], &slot->plan);
+        cache_prepare(engine->paths[slot->index], &engine->requests[slot->index], &slot->plan, &slot->result, &slot->key);
+        budget_prepare(engine->paths[slot->index], &engine->requests[slot->index], &slot->plan, &slot->budget);
+        health_prepare(engine->paths[slot->index], &engine->requests[slot->index], &slot->plan, &slot->health);
+
+        if (cache_answer(&slot->key, &engine->requests[slot->index], &slot->plan, &slot->result)) {
+            finish(engine, slot);
+            continue;
+        }
+        if (slot->plan.power_check && sysfs_runtime_suspended(engine->paths[slot->index])) {
+            slot->result.asleep = true;
+            finish(engine, slot);
+            continue;
+        }
+
+        slot->transport = transport_for(engine->paths[slot->index]);
+        const uint64_t opening = trace_now_us();
+        slot->fd = slot->transport->async_open(engine->paths[slot->index]);
+        device_time_phase(&slot->result, PHASE_OPEN, trace_now_us() - opening);
+        int err = slot->fd < 0 ? slot->fd : 0;
+        if (err == 0) {
+            const struct request* const request = &engine->requests[slot->index];
+            slot->step = slot->plan.power_check ? STEP_POWER : next_inquiry(slot, request, &slot->plan);
+            err = submit(slot, request);
+            if (err == 0) {
+                return true;
+            }
+            fail(slot, err);
+        } else {
+            slot->result.err = DEVICE_ERR_OPEN;
+            slot->result.detail = err;
+        }
+        finish(engine, slot);
+    }
+    return false;
+}
+
+// Make sure we can have enough devices open at once
+static void raise_fd_limit(size_t needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < needed) {
+        limit.rlim_cur = needed < limit.rlim_max ? needed : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+size_t async_run(const char* const* paths, const struct request* requests, size_t count,
+                 size_t max_inflight, struct sched* sched, async_done_fn done, void* ctx) {
+    struct engine engine = {
+        .paths = paths,
+        .requests = requests,
+        .count = count,
+        .sched = sched,
+        .done = done,
+        .ctx = ctx,
+    };
+    if (max_inflight > count) {
+        max_inflight = count;
+    }
+    if (max_inflight == 0) {
+        return 0;
+    }
+    raise_fd_limit(max_inflight + 64);
+
+    struct slot* slots = calloc(max_inflight, sizeof(*slots));
+    struct pollfd* pfds = calloc(max_inflight, sizeof(*pfds));
+    if (!slots || !pfds) {
+        free(slots);
+        free(pfds);
+        return count;
+    }
+
+    size_t active = 0;
+    for (size_t i = 0; i < max_inflight; i++) {
+        slots[i].fd = -1;
+        if (start(&engine, &slots[i])) {
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        // Wake up in time for the first deadline
+        const uint64_t now = trace_now_us();
+        int timeout_ms = -1;
+        for (size_t i = 0; i < max_inflight; i++) {
+            pfds[i].fd = slots[i].fd;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+            const uint64_t deadline = slots[i].plan.deadline_us;
+            if (slots[i].fd >= 0 && deadline) {
+                const uint64_t left_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+                if (timeout_ms < 0 || left_ms < (uint64_t)timeout_ms) {
+                    timeout_ms = left_ms;
+                }
+            }
+        }
+        if (poll(pfds, max_inflight, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < max_inflight; i++) {
+            struct slot* const slot = &slots[i];
+            if (slot->fd < 0) {
+                continue;
+            }
+            if (!pfds[i].revents) {
+                // Abandon a device that has run out of time. Closing it leaves the kernel to clean up the command
+                if (slot->plan.deadline_us && trace_now_us() >= slot->plan.deadline_us) {
+                    fail(slot, -ETIME);
+                    finish(&engine, slot);
+                    if (!start(&engine, slot)) {
+                        active--;
+                    }
+                }
+                continue;
+            }
+            const int err = slot->transport->async_receive(slot->fd, &slot->hdr);
+            if (err < 0) {
+                if (err == -EAGAIN || err == -EINTR) {
+                    continue;
+                }
+                slot->result.err = step_err(slot->step);
+                slot->result.detail = SCSI_CAT_OTHER;
+                slot->step = STEP_DONE;
+            } else {
+                slot->step = complete(slot, &engine.requests[slot->index], &slot->plan);
+            }
+
+            if (slot->step != STEP_DONE) {
+                const int submitted = submit(slot, &engine.requests[slot->index]);
+                if (submitted != 0) {
+                    fail(slot, submitted);
+                }
+            }
+            if (slot->step == STEP_DONE) {
+                finish(&engine, slot);
+                if (!start(&engine, slot)) {
+                    active--;
+                }
+            }
+        }
+
+        // The scheduler may have been holding devices back until others finished
+        for (size_t i = 0; sched && i < max_inflight && sched_pending(sched); i++) {
+            if (slots[i].fd < 0 && start(&engine, &slots[i])) {
+                active++;
+            }
+        }
+    }
+
+    // Only reached early if poll() failed, give up on anything still running
+    for (size_t i = 0; i < max_inflight; i++) {
+        if (slots[i].fd >= 0) {
+            slots[i].result.err = step_err(slots[i].step);
+            slots[i].result.detail = SCSI_CAT_OTHER;
+            finish(&engine, &slots[i]);
+        }
+    }
+
+    free(slots);
+    free(pfds);
+    return engine.failed;
+}
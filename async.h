@@ -0,0 +1,23 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "device.h"
+#include "sched.h"
+
+// Called from the event loop as each device completes, returns non-zero if the device failed
+typedef int (*async_done_fn)(void* ctx, size_t index, const struct result* result);
+
+// Run each device's request from the calling thread, by submitting commands through the transport's
+// non-blocking interface (write() on /dev/sgN) and reaping them with poll(). Up to max_inflight devices
+// are in progress at once, in order, or in the order sched picks (if not NULL).
+// Returns the number of devices that failed
+size_t async_run(const char* const* paths, const struct request* requests, size_t count,
+                 size_t max_inflight, struct sched* sched, async_done_fn done, void* ctx);
@@ -0,0 +1,108 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "batch.h"
+
+// Almost all of a worker's time is spent blocked in the kernel waiting on the disk,
+// so there's no need for the default 8MiB of stack per thread
+#define BATCH_STACK_SIZE (256 * 1024)
+
+struct batch {
+    batch_fn fn;
+    void* ctx;
+    size_t count;
+    atomic_size_t next;
+    atomic_size_t failed;
+
+    // With a scheduler, workers wait for it to let them start a device
+    struct sched* sched;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+// Pick the next index to run, returns false if there are none left
+static bool batch_next(struct batch* batch, size_t* index) {
+    if (!batch->sched) {
+        *index = atomic_fetch_add(&batch->next, 1);
+        return *index < batch->count;
+    }
+    pthread_mutex_lock(&batch->lock);
+    bool picked;
+    while (!(picked = sched_next(batch->sched, index)) && sched_pending(batch->sched)) {
+        pthread_cond_wait(&batch->done, &batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return picked;
+}
+
+static void* batch_worker(void* arg) {
+    struct batch* batch = arg;
+    size_t index;
+    while (batch_next(batch, &index)) {
+        if (batch->fn(batch->ctx, index) != 0) {
+            atomic_fetch_add(&batch->failed, 1);
+        }
+        if (batch->sched) {
+            pthread_mutex_lock(&batch->lock);
+            sched_done(batch->sched, index);
+            pthread_cond_broadcast(&batch->done);
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    return NULL;
+}
+
+size_t batch_run(size_t count, size_t jobs, struct sched* sched, batch_fn fn, void* ctx) {
+    struct batch batch = {
+        .fn = fn,
+        .ctx = ctx,
+        .count = count,
+        .sched = sched,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, 0);
+
+    if (jobs > count) {
+        jobs = count;
+    }
+
+    // The calling thread is a worker too, so only start jobs-1 extra threads
+    pthread_t* threads = NULL;
+    size_t started = 0;
+    if (jobs > 1) {
+        threads = calloc(jobs - 1, sizeof(*threads));
+    }
+    if (threads) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, BATCH_STACK_SIZE);
+        for (; started < jobs - 1; started++) {
+            // If we run out of threads just carry on with what we have
+            if (pthread_create(&threads[started], &attr, batch_worker, &batch) != 0) {
+                break;
+            }
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    batch_worker(&batch);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    return atomic_load(&batch.failed);
+}
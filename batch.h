@@ -0,0 +1,22 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "sched.h"
+
+#define BATCH_DEFAULT_JOBS 256
+
+// Called once for every index in a batch, returns non-zero on failure
+typedef int (*batch_fn)(void* ctx, size_t index);
+
+// Run fn for every index in [0, count) using up to `jobs` threads (including the calling thread),
+// in order, or in the order sched picks (if not NULL)
+// Returns the number of calls that failed
+size_t batch_run(size_t count, size_t jobs, struct sched* sched, batch_fn fn, void* ctx);
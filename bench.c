@@ -0,0 +1,231 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Benchmark the engines against simulated drives, printing one JSON object per line:
+//   {"op":"get","engine":"async","drives":256,"latency_us":250,"ops":768,"p50_us":..., ...}
+// The field names and units are stable, so results can be compared across releases.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "async.h"
+#include "batch.h"
+#include "device.h"
+#include "sim.h"
+#include "transport.h"
+
+#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+
+#define DEFAULT_DRIVES     "1,16,256,4096"
+#define DEFAULT_LATENCY_US 250
+#define DEFAULT_ITERATIONS 3
+#define DEFAULT_JOBS       256
+#define SERIAL_MAX_DRIVES  256 // One drive at a time gets slow quickly, so stop there
+
+enum engine { ENGINE_SERIAL, ENGINE_THREADED, ENGINE_ASYNC };
+static const char* const engine_names[] = { "serial", "threaded", "async" };
+
+struct op {
+    const char* name;
+    bool set;
+    bool save;
+};
+static const struct op ops[] = {
+    { "get", false, false },
+    { "set", true, false },
+    { "save", true, true },
+};
+
+// One sweep over every drive
+struct sweep {
+    char** paths;
+    struct request* requests;
+    size_t count;
+    uint64_t* elapsed_us; // Per drive
+    int value;            // What the drives' LEDs were last set to
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// The blocking path, as wdled takes it for each drive
+static int bench_device(void* ctx, size_t index) {
+    struct sweep* const sweep = ctx;
+    const char* const path = sweep->paths[index];
+    const struct request* const request = &sweep->requests[index];
+    const struct plan plan = device_plan(request);
+    struct result result = {};
+
+    const uint64_t start = now_us();
+    const struct transport* const transport = transport_for(path);
+    const int fd = transport->open(path, request->new < 0);
+    if (fd < 0) {
+        result.err = DEVICE_ERR_OPEN;
+    } else {
+        transport_run(transport, fd, request, &plan, &result);
+        transport->close(fd);
+    }
+    sweep->elapsed_us[index] = now_us() - start;
+    return result.err != DEVICE_OK;
+}
+
+static int bench_async_done(void* ctx, size_t index, const struct result* result) {
+    struct sweep* const sweep = ctx;
+    sweep->elapsed_us[index] = result->elapsed_us;
+    return result->err != DEVICE_OK;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t* sorted, size_t count, unsigned pct) {
+    return sorted[(count - 1) * pct / 100];
+}
+
+// Run one op over every drive a number of times with one engine, and print the results
+static bool bench_run(struct sweep* sweep, const struct op* op, enum engine engine, unsigned latency_us,
+                      unsigned iterations, size_t jobs) {
+    const size_t count = sweep->count;
+    uint64_t* const samples = malloc(count * iterations * sizeof(*samples));
+    if (!samples) {
+        return false;
+    }
+
+    size_t failed = 0;
+    uint64_t wall_us = 0;
+    const size_t commands = sim_commands();
+    for (unsigned i = 0; i < iterations; i++) {
+        // Alternate the value, so every set really is written
+        if (op->set) {
+            sweep->value ^= 0xff;
+        }
+        for (size_t d = 0; d < count; d++) {
+            sweep->requests[d] = (struct request){
+                .save = op->save,
+                .no_cache = true,
+                .new = op->set ? sweep->value : -1,
+            };
+        }
+        const uint64_t start = now_us();
+        switch (engine) {
+        case ENGINE_SERIAL:
+            for (size_t d = 0; d < count; d++) {
+                failed += bench_device(sweep, d) != 0;
+            }
+            break;
+        case ENGINE_THREADED:
+            failed += batch_run(count, jobs, NULL, bench_device, sweep);
+            break;
+        case ENGINE_ASYNC:
+            failed += async_run((const char* const*)sweep->paths, sweep->requests, count, jobs, NULL, bench_async_done, sweep);
+            break;
+        }
+        wall_us += now_us() - start;
+        memcpy(samples + i * count, sweep->elapsed_us, count * sizeof(*samples));
+    }
+
+    const size_t nops = count * iterations;
+    qsort(samples, nops, sizeof(*samples), compare_u64);
+    printf("{\"op\":\"%s\",\"engine\":\"%s\",\"drives\":%zu,\"latency_us\":%u,\"iterations\":%u,\"jobs\":%zu,"
+           "\"ops\":%zu,\"failed\":%zu,\"p50_us\":%llu,\"p99_us\":%llu,\"commands_per_op\":%.2f,\"drives_per_sec\":%.1f}\n",
+           op->name, engine_names[engine], count, latency_us, iterations, engine == ENGINE_SERIAL ? 1 : jobs,
+           nops, failed, (unsigned long long)percentile(samples, nops, 50), (unsigned long long)percentile(samples, nops, 99),
+           (double)(sim_commands() - commands) / nops, wall_us ? nops * 1e6 / wall_us : 0.0);
+    fflush(stdout);
+    free(samples);
+    return true;
+}
+
+static void usage(const char* argv0) {
+    eprintf("Usage: %s [OPTIONS]\n", argv0);
+    eprintf("  --drives N[,N...]  Numbers of simulated drives to sweep (default %s)\n", DEFAULT_DRIVES);
+    eprintf("  --latency US       Latency of every simulated command (default %d)\n", DEFAULT_LATENCY_US);
+    eprintf("  --iterations N     Sweeps of each op per engine (default %d)\n", DEFAULT_ITERATIONS);
+    eprintf("  -j, --jobs N       Threads, or async devices in flight (default %d)\n", DEFAULT_JOBS);
+}
+
+int main(int argc, char* argv[]) {
+    const char* drives = DEFAULT_DRIVES;
+    unsigned latency_us = DEFAULT_LATENCY_US;
+    unsigned iterations = DEFAULT_ITERATIONS;
+    size_t jobs = DEFAULT_JOBS;
+    for (int i = 1; i < argc; i++) {
+        const char* const arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (!strcmp(arg, "--drives")) {
+            drives = argv[++i];
+        } else if (!strcmp(arg, "--latency")) {
+            latency_us = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(arg, "--iterations")) {
+            iterations = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) {
+            jobs = strtoul(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations == 0 || jobs == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (const char* next = drives; *next;) {
+        char* endptr;
+        const size_t count = strtoul(next, &endptr, 10);
+        if (count == 0 || (*endptr && *endptr != ',')) {
+            eprintf("Invalid drive count: %s\n", next);
+            return 1;
+        }
+        next = *endptr ? endptr + 1 : endptr;
+
+        // Every drive count gets its own set of drives
+        struct sweep sweep = {
+            .paths = calloc(count, sizeof(*sweep.paths)),
+            .requests = calloc(count, sizeof(*sweep.requests)),
+            .elapsed_us = calloc(count, sizeof(*sweep.elapsed_us)),
+            .count = count,
+            .value = 0xff, // Simulated drives start with the LED on
+        };
+        bool ok = sweep.paths && sweep.requests && sweep.elapsed_us;
+        for (size_t d = 0; ok && d < count; d++) {
+            ok = asprintf(&sweep.paths[d], SIM_PREFIX "bench%zu-%zu@%u", count, d, latency_us) >= 0;
+            if (!ok) {
+                sweep.paths[d] = NULL;
+            }
+        }
+        for (size_t o = 0; ok && o < sizeof(ops) / sizeof(ops[0]); o++) {
+            for (enum engine engine = ENGINE_SERIAL; ok && engine <= ENGINE_ASYNC; engine++) {
+                if (engine != ENGINE_SERIAL || count <= SERIAL_MAX_DRIVES) {
+                    ok = bench_run(&sweep, &ops[o], engine, latency_us, iterations, jobs);
+                }
+            }
+        }
+        for (size_t d = 0; sweep.paths && d < count; d++) {
+            free(sweep.paths[d]);
+        }
+        free(sweep.paths);
+        free(sweep.requests);
+        free(sweep.elapsed_us);
+        if (!ok) {
+            eprintf("ERROR: Out of memory\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "budget.h"
+#include "cache.h"
+#include "sysfs.h"
+
+#define BUDGET_MAGIC "wdled-budget 1"
+
+// Non-volatile writes a drive has been sent
+struct budget_entry {
+    long long window; // time() the current window started
+    unsigned writes;  // In the current window
+    unsigned long long total;
+};
+
+// Read an entry from a locked budget file, starting a new window if the last one has ended
+static void budget_read(FILE* file, struct budget_entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    char line[128];
+    bool ok = fgets(line, sizeof(line), file) && !strcmp(line, BUDGET_MAGIC "\n");
+    while (ok && fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        if (!value) {
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(line, "window")) {
+            entry->window = strtoll(value, NULL, 10);
+        } else if (!strcmp(line, "writes")) {
+            entry->writes = strtoul(value, NULL, 10);
+        } else if (!strcmp(line, "total")) {
+            entry->total = strtoull(value, NULL, 10);
+        }
+    }
+    const long long now = time(NULL);
+    if (now < entry->window || now - entry->window >= BUDGET_WINDOW_S) {
+        entry->window = now;
+        entry->writes = 0;
+    }
+}
+
+void budget_prepare(const char* device, const struct request* request, struct plan* plan, struct budget_key* key) {
+    memset(key, 0, sizeof(*key));
+    if (!request->save_budget || !request->save || !plan->select) {
+        return;
+    }
+
+    char dir[PATH_MAX], path[PATH_MAX];
+    if (sysfs_device_dir(device, dir, sizeof(dir)) != 0 || !sysfs_serial(dir, key->serial, sizeof(key->serial))) {
+        plan->no_save = true;
+        return;
+    }
+    key->valid = true;
+    cache_path(STATE_DIR, key->serial, path, sizeof(path));
+    FILE* const file = fopen(path, "re");
+    if (!file) {
+        return; // Nothing saved yet
+    }
+    struct budget_entry entry;
+    flock(fileno(file), LOCK_SH);
+    budget_read(file, &entry);
+    fclose(file);
+    plan->no_save = entry.writes >= request->save_budget;
+}
+
+void budget_update(const struct budget_key* key, const struct result* result) {
+    if (!key->valid || result->err != DEVICE_OK || !result->nv_write) {
+        return;
+    }
+    if (mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+
+    // Concurrent runs add to the count in turn, under the lock
+    char path[PATH_MAX];
+    cache_path(STATE_DIR, key->serial, path, sizeof(path));
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    FILE* const file = fdopen(fd, "r+");
+    if (!file) {
+        close(fd);
+        return;
+    }
+    struct budget_entry entry;
+    flock(fd, LOCK_EX);
+    budget_read(file, &entry);
+    entry.writes++;
+    entry.total++;
+    rewind(file);
+    if (ftruncate(fd, 0) == 0) {
+        fprintf(file, BUDGET_MAGIC "\n");
+        fprintf(file, "window=%lld\n", entry.window);
+        fprintf(file, "writes=%u\n", entry.writes);
+        fprintf(file, "total=%llu\n", entry.total);
+    }
+    fclose(file);
+}
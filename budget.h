@@ -0,0 +1,28 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "cache.h"
+#include "device.h"
+
+// Length of the window request->save_budget applies to
+#define BUDGET_WINDOW_S (24 * 60 * 60)
+
+struct budget_key {
+    bool valid;      // The device is being budgeted, and has a serial number to track it by
+    char serial[64];
+};
+
+// Check a saving request against the device's non-volatile write budget, setting plan->no_save if it's used up.
+// Disks without a serial number can't be tracked, so never have their LED mode saved while there's a budget
+void budget_prepare(const char* device, const struct request* request, struct plan* plan, struct budget_key* key);
+
+// Count the non-volatile write the device was just sent, if any
+void budget_update(const struct budget_key* key, const struct result* result);
@@ -0,0 +1,368 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "scsi.h"
+#include "sysfs.h"
+
+#define CACHE_MAGIC "wdled-cache 1"
+
+// Everything about a drive that doesn't change without a firmware update
+struct cache_entry {
+    char serial[64];
+    struct identity identity;
+    unsigned code;       // Page code (including PS bit)
+    unsigned len;        // Page length
+    unsigned magic;      // Page magic
+    unsigned changeable; // Changeable LED bits
+    bool has_template;
+    struct page template; // Current mode page when cached
+    uint8_t values;       // PC_MASK()s of the LED values below that are known
+    uint8_t led[PC_COUNT]; // LED values last seen, which unlike the rest of the entry do change
+    time_t confirmed;      // When the LED values were last confirmed: the file's mtime
+};
+
+// The LED values that are worth remembering, and their names in the cache file
+static const char* const value_names[PC_COUNT] = {
+    [PC_CURRENT] = "current",
+    [PC_DEFAULT] = "original",
+    [PC_SAVED] = "saved",
+};
+
+void cache_path(const char* dir, const char* serial, char* path, size_t len) {
+    size_t n = snprintf(path, len, "%s/", dir);
+    for (const char* c = serial; *c && n + 1 < len; c++, n++) {
+        const bool safe = (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '-';
+        path[n] = safe ? *c : '_';
+    }
+    path[n] = '\0';
+}
+
+// Parse exactly len bytes of hex
+static bool parse_hex(const char* hex, void* data, size_t len) {
+    if (strlen(hex) != len * 2) {
+        return false;
+    }
+    uint8_t* const bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], '\0' };
+        char* endptr;
+        bytes[i] = strtoul(byte, &endptr, 16);
+        if (*endptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool cache_load(const char* serial, struct cache_entry* entry) {
+    char path[PATH_MAX];
+    cache_path(CACHE_DIR, serial, path, sizeof(path));
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        return false;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0) {
+        entry->confirmed = st.st_mtime;
+    }
+    char line[128];
+    bool ok = fgets(line, sizeof(line), file) && !strcmp(line, CACHE_MAGIC "\n");
+    while (ok && fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        char* newline = strchr(line, '\n');
+        if (!value || !newline) {
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+        *newline = '\0';
+        if (!strcmp(line, "serial")) {
+            snprintf(entry->serial, sizeof(entry->serial), "%s", value);
+        } else if (!strcmp(line, "vendor")) {
+            snprintf(entry->identity.vendor, sizeof(entry->identity.vendor), "%s", value);
+        } else if (!strcmp(line, "product")) {
+            snprintf(entry->identity.product, sizeof(entry->identity.product), "%s", value);
+        } else if (!strcmp(line, "revision")) {
+            snprintf(entry->identity.revision, sizeof(entry->identity.revision), "%s", value);
+        } else if (!strcmp(line, "code")) {
+            entry->code = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "len")) {
+            entry->len = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "magic")) {
+            entry->magic = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "changeable")) {
+            entry->changeable = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "page")) {
+            entry->has_template = parse_hex(value, &entry->template, 2 + sizeof(entry->template.wd21));
+        } else {
+            for (int pc = 0; pc < PC_COUNT; pc++) {
+                if (value_names[pc] && !strcmp(line, value_names[pc])) {
+                    entry->led[pc] = strtoul(value, NULL, 0);
+                    entry->values |= PC_MASK(pc);
+                }
+            }
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+static void cache_store(const struct cache_entry* entry) {
+    if (mkdir(CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+
+    // Write to a temporary file and rename it into place, so concurrent readers never see a partial entry
+    char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+    cache_path(CACHE_DIR, entry->serial, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return;
+    }
+    FILE* file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    fprintf(file, CACHE_MAGIC "\n");
+    fprintf(file, "serial=%s\n", entry->serial);
+    fprintf(file, "vendor=%s\n", entry->identity.vendor);
+    fprintf(file, "product=%s\n", entry->identity.product);
+    fprintf(file, "revision=%s\n", entry->identity.revision);
+    fprintf(file, "code=0x%02x\n", entry->code);
+    fprintf(file, "len=0x%02x\n", entry->len);
+    fprintf(file, "magic=0x%02x\n", entry->magic);
+    fprintf(file, "changeable=0x%02x\n", entry->changeable);
+    fprintf(file, "page=");
+    const uint8_t* const page = (const uint8_t*)&entry->template;
+    for (size_t i = 0; i < 2 + sizeof(entry->template.wd21); i++) {
+        fprintf(file, "%02x", page[i]);
+    }
+    fprintf(file, "\n");
+    for (int pc = 0; pc < PC_COUNT; pc++) {
+        if (value_names[pc] && (entry->values & PC_MASK(pc))) {
+            fprintf(file, "%s=%u\n", value_names[pc], entry->led[pc]);
+        }
+    }
+    fchmod(fd, 0644);
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Set when the LED values of a drive's entry were last confirmed, to now if times is NULL
+static void cache_confirm(const char* serial, const struct timespec times[2]) {
+    char path[PATH_MAX];
+    cache_path(CACHE_DIR, serial, path, sizeof(path));
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+void cache_expire(const char* dir) {
+    char serial[64];
+    if (sysfs_serial(dir, serial, sizeof(serial))) {
+        const struct timespec epoch[2] = {};
+        cache_confirm(serial, epoch);
+    }
+}
+
+// Check that an entry matches the drive as it is now, and everything it records is what we'd have checked for
+static bool cache_entry_valid(const struct cache_entry* entry, const struct cache_key* key) {
+    return !strcmp(entry->serial, key->serial)
+        && !strcmp(entry->identity.vendor, key->identity.vendor)
+        && !strcmp(entry->identity.product, key->identity.product)
+        && !strcmp(entry->identity.revision, key->identity.revision) // Firmware changed? Check everything again
+        && entry->code == (PAGE_CODE | PS_BIT)
+        && entry->len == sizeof(((struct page*)0)->wd21)
+        && entry->magic == PAGE_MAGIC
+        && entry->changeable == 0xff
+        && (!entry->has_template || (entry->template.code == entry->code && entry->template.len == entry->len
+                                     && entry->template.wd21.magic == entry->magic))
+        && device_check_identity(&entry->identity) == DEVICE_OK;
+}
+
+void cache_prepare(const char* device, const struct request* request, struct plan* plan,
+                   struct result* result, struct cache_key* key) {
+    memset(key, 0, sizeof(*key));
+    if (request->no_cache) {
+        return;
+    }
+
+    char dir[PATH_MAX];
+    key->valid = sysfs_device_dir(device, dir, sizeof(dir)) == 0
+              && sysfs_identity(dir, &key->identity)
+              && sysfs_serial(dir, key->serial, sizeof(key->serial));
+    if (!key->valid) {
+        return;
+    }
+
+    struct cache_entry entry;
+    if (cache_load(key->serial, &entry) && cache_entry_valid(&entry, key)) {
+        key->hit = true;
+        key->has_template = entry.has_template;
+        key->template = entry.template;
+        key->values = entry.values;
+        memcpy(key->led, entry.led, sizeof(key->led));
+        key->confirmed = entry.confirmed;
+        result->identity = entry.identity;
+        result->identified = true;
+        result->support = DEVICE_OK;
+        if (!request->full) {
+            plan->inquiry = false;
+            plan->page_controls &= ~PC_MASK(PC_CHANGEABLE);
+        }
+    } else {
+        // Check the changeable mask this once, so it can be cached
+        plan->page_controls |= PC_MASK(PC_CHANGEABLE);
+    }
+}
+
+bool cache_recall(const struct cache_key* key, const struct request* request, const struct plan* plan,
+                  struct result* result) {
+    if (!key->hit || !(key->values & PC_MASK(PC_CURRENT))) {
+        return false;
+    }
+    const uint8_t pages = key->values & plan->page_controls;
+    for (int pc = 0; pc < PC_COUNT; pc++) {
+        if (pages & PC_MASK(pc)) {
+            struct page* const page = device_result_page(result, pc);
+            *page = key->template;
+            page->wd21.led = key->led[pc];
+        }
+    }
+    result->pages = pages;
+    result->pages_valid = true;
+    result->cached = true;
+    result->unchanged = request->new >= 0 && device_unchanged(request, plan, result);
+    return true;
+}
+
+bool cache_answer(const struct cache_key* key, const struct request* request, const struct plan* plan,
+                  struct result* result) {
+    if (!request->cached_s || request->new >= 0 || !key->hit) {
+        return false;
+    }
+    const uint8_t needed = plan->page_controls & ~PC_MASK(PC_CHANGEABLE);
+    const time_t now = time(NULL);
+    if ((key->values & needed) != needed || key->confirmed > now || now - key->confirmed >= request->cached_s) {
+        return false;
+    }
+    return cache_recall(key, request, plan, result);
+}
+
+// Check whether a device reported being reset (or power cycled), which puts its current LED mode back to the saved one
+static bool cache_reset(const struct result* result) {
+    return (result->err == DEVICE_ERR_INQUIRY || result->err == DEVICE_ERR_MODE_SENSE || result->err == DEVICE_ERR_MODE_SELECT)
+        && result->detail == SCSI_CAT_UNIT_ATTENTION;
+}
+
+// Work out the LED values a device was left with, starting from what the cache remembers
+static void cache_values(const struct cache_key* key, const struct request* request, const struct result* result,
+                         uint8_t* values, uint8_t* led) {
+    *values = key->hit ? key->values : 0;
+    memcpy(led, key->led, PC_COUNT);
+    if (result->err != DEVICE_OK || !result->pages_valid || result->cached) {
+        return;
+    }
+    const struct page* const pages[PC_COUNT] = {
+        [PC_CURRENT] = &result->current,
+        [PC_DEFAULT] = &result->original,
+        [PC_SAVED] = &result->saved,
+    };
+    for (int pc = 0; pc < PC_COUNT; pc++) {
+        if (pages[pc] && (result->pages & PC_MASK(pc))) {
+            led[pc] = pages[pc]->wd21.led;
+            *values |= PC_MASK(pc);
+        }
+    }
+    if (request->new >= 0 && !result->unchanged) {
+        led[PC_CURRENT] = request->new;
+        *values |= PC_MASK(PC_CURRENT);
+        if (result->nv_write) {
+            led[PC_SAVED] = request->new;
+            *values |= PC_MASK(PC_SAVED);
+        }
+    }
+}
+
+void cache_update(const struct cache_key* key, const struct request* request, const struct result* result) {
+    if (request->no_cache || !key->valid) {
+        return;
+    }
+
+    if (cache_reset(result)) {
+        const struct timespec epoch[2] = {};
+        cache_confirm(key->serial, epoch);
+        return;
+    }
+
+    uint8_t values, led[PC_COUNT];
+    cache_values(key, request, result, &values, led);
+    if (key->hit) {
+        // Only rewrite the entry when the LED values have moved on from what it remembers,
+        // otherwise just note that they've been confirmed
+        if (values == key->values && !memcmp(led, key->led, sizeof(led))) {
+            if (result->err == DEVICE_OK && result->pages_valid && !result->cached) {
+                cache_confirm(key->serial, NULL);
+            }
+            return;
+        }
+        struct cache_entry entry = {
+            .identity = key->identity,
+            .code = PAGE_CODE | PS_BIT,
+            .len = sizeof(key->template.wd21),
+            .magic = PAGE_MAGIC,
+            .changeable = 0xff,
+            .has_template = key->has_template,
+            .template = key->template,
+            .values = values,
+        };
+        memcpy(entry.led, led, sizeof(led));
+        snprintf(entry.serial, sizeof(entry.serial), "%s", key->serial);
+        cache_store(&entry);
+        return;
+    }
+
+    if (result->err != DEVICE_OK || result->support != DEVICE_OK || !result->pages_valid
+            || !(result->pages & PC_MASK(PC_CHANGEABLE))) {
+        return;
+    }
+    // Only trust the sysfs key if it agrees with what the drive just told us
+    if (strcmp(result->identity.vendor, key->identity.vendor) || strcmp(result->identity.product, key->identity.product)
+            || strcmp(result->identity.revision, key->identity.revision)) {
+        return;
+    }
+
+    struct cache_entry entry = {
+        .identity = result->identity,
+        .code = result->current.code,
+        .len = result->current.len,
+        .magic = result->current.wd21.magic,
+        .changeable = result->changeable.wd21.led,
+        .template = result->current,
+        .values = values,
+    };
+    memcpy(entry.led, led, sizeof(led));
+    snprintf(entry.serial, sizeof(entry.serial), "%s", key->serial);
+    cache_store(&entry);
+}
@@ -0,0 +1,69 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "device.h"
+
+#ifndef CACHE_DIR
+#define CACHE_DIR "/run/wdled"
+#endif
+
+// Per-drive state that has to survive a reboot, unlike the cache
+#ifndef STATE_DIR
+#define STATE_DIR "/var/lib/wdled"
+#endif
+
+// How long LED values stay fresh enough to answer --cached from, by default.
+// Longer than WATCH_MAX_MS, so the values of disks being watched are always fresh
+#define CACHE_TTL_S 120
+
+// What we know about a device from sysfs, without sending it any commands
+struct cache_key {
+    bool valid;               // The device has a serial number and identity we can key on
+    bool hit;                 // A matching cache entry was found
+    char serial[64];          // Unit serial number
+    struct identity identity; // Vendor/product/revision the kernel read at probe time
+    bool has_template;        // On a hit, the cache had a copy of the mode page
+    struct page template;     // The mode page as it was when cached, for a MODE SELECT without a MODE SENSE first
+    uint8_t values;           // On a hit, PC_MASK()s of the LED values the cache remembers
+    uint8_t led[PC_COUNT];    // The LED values last seen on the device
+    time_t confirmed;         // On a hit, when those values were last confirmed (0 if they may be out of date)
+};
+
+// Build the name of a per-drive file in dir from its serial number, avoiding anything unsafe in a file name
+void cache_path(const char* dir, const char* serial, char* path, size_t len);
+
+// Look up the device's capabilities in the cache. On a hit, fill in the identity in result
+// and drop the commands the cache covers from the plan. On a miss, add whatever is needed
+// to create a cache entry once the device has been checked
+void cache_prepare(const char* device, const struct request* request, struct plan* plan,
+                   struct result* result, struct cache_key* key);
+
+// Answer a request from the LED values last seen on a device that's asleep, instead of waking it.
+// Returns false if the cache doesn't know the current value
+bool cache_recall(const struct cache_key* key, const struct request* request, const struct plan* plan,
+                  struct result* result);
+
+// With request->cached_s, answer a read from the LED values the cache remembers, without touching the device,
+// if it has every value the plan would read and they were confirmed within the last cached_s seconds.
+// Returns false if the device has to be asked
+bool cache_answer(const struct cache_key* key, const struct request* request, const struct plan* plan,
+                  struct result* result);
+
+// Mark the LED values cached for the drive at a sysfs SCSI device directory as out of date,
+// e.g because it was reset or reconnected
+void cache_expire(const char* dir);
+
+// Record the capabilities of a device that passed every check, if it isn't already cached,
+// and the LED values it was left with, if they aren't what the cache remembers.
+// The values are marked as just confirmed if they were read or written, or expired if the device was reset
+void cache_update(const struct cache_key* key, const struct request* request, const struct result* result);
@@ -0,0 +1,401 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "device.h"
+#include "scsi.h"
+
+// A list of verified working WD product names
+static const char* wd_products[] = {
+    "My Passport 0837",
+    "My Passport 259D",
+    "My Passport 259E",
+    "My Passport 259F",
+    "My Passport 259A",
+    "My Passport 25E1",
+    "My Passport 25E2",
+    NULL,
+};
+
+const struct supported_vendor supported[] = {
+    { vendor: "WD      ", products: wd_products },
+    { vendor: NULL,       products: NULL },
+};
+
+bool device_parse_value(const char* arg, struct request* request) {
+    if (!strcmp(arg, "FORCEGET")) {
+        // Get value, with no vendor/product checks
+        request->force = true;
+        return true;
+    }
+    const char* const force_str = "FORCESET:";
+    if (!strncmp(arg, force_str, strlen(force_str))) {
+        // Set value, with no vendor/product checks
+        arg += strlen(force_str);
+        request->force = true;
+    }
+    const char* const save_str = "save:";
+    if (!strncasecmp(arg, save_str, strlen(save_str))) {
+        // Set value, and save
+        arg += strlen(save_str);
+        request->save = true;
+    }
+    if (!strcmp(arg, "off")) {
+        request->new = 0;
+    } else if (!strcmp(arg, "on")) {
+        request->new = 255;
+    } else {
+        char* endptr;
+        const long new = strtol(arg, &endptr, 0);
+        if (!*arg || *endptr || new < 0x00 || new > 0xff) {
+            return false;
+        }
+        request->new = new;
+    }
+    return true;
+}
+
+enum device_err device_check_identity(const struct identity* identity) {
+    for (size_t vid=0; supported[vid].vendor; vid++) {
+        if (!strcmp(supported[vid].vendor, identity->vendor)) {
+            for (size_t pid=0; supported[vid].products[pid]; pid++) {
+                if (!strcmp(supported[vid].products[pid], identity->product)) {
+                    return DEVICE_OK;
+                }
+            }
+            return DEVICE_ERR_PRODUCT;
+        }
+    }
+    return DEVICE_ERR_VENDOR;
+}
+
+struct plan device_plan(const struct request* request) {
+    struct plan plan = {
+        .power_check = request->no_wake,
+        .inquiry = true,
+        .page_controls = PC_MASK(PC_CURRENT),
+        .select = request->new >= 0,
+    };
+
+    if (request->full) {
+        plan.page_controls = PC_MASK(PC_CURRENT) | PC_MASK(PC_CHANGEABLE) | PC_MASK(PC_DEFAULT) | PC_MASK(PC_SAVED);
+        return plan;
+    }
+
+    // A plain read reports the original and saved values too
+    if (!request->quiet && !plan.select) {
+        plan.page_controls |= PC_MASK(PC_DEFAULT) | PC_MASK(PC_SAVED);
+    }
+
+    // Reading the saved value is much cheaper than needlessly rewriting non-volatile storage
+    if (plan.select && request->save) {
+        plan.page_controls |= PC_MASK(PC_SAVED);
+    }
+
+    // Every disk in the supported list is known to have changeable LED bits,
+    // so only check the changeable mask when we've been told to skip that list
+    if (request->force) {
+        plan.page_controls |= PC_MASK(PC_CHANGEABLE);
+    }
+    return plan;
+}
+
+int device_next_pc(const struct plan* plan, int pc) {
+    for (pc++; pc < PC_COUNT; pc++) {
+        if (plan->page_controls & PC_MASK(pc)) {
+            return pc;
+        }
+    }
+    return -1;
+}
+
+struct page* device_result_page(struct result* result, int pc) {
+    switch (pc) {
+    case PC_CURRENT:    return &result->current;
+    case PC_CHANGEABLE: return &result->changeable;
+    case PC_DEFAULT:    return &result->original;
+    default:            return &result->saved;
+    }
+}
+
+enum device_err device_check_pages(struct result* result) {
+    const uint8_t code = PAGE_CODE | PS_BIT;
+    const uint8_t wd21_len = sizeof(result->current.wd21);
+    for (int pc = 0; pc < PC_COUNT; pc++) {
+        if (!(result->pages & PC_MASK(pc))) {
+            continue;
+        }
+        const struct page* const page = device_result_page(result, pc);
+        if (page->code != code) {
+            result->detail = page->code;
+            return DEVICE_ERR_PAGE_CODE;
+        }
+        if (page->len != wd21_len) {
+            result->detail = page->len;
+            return DEVICE_ERR_PAGE_LEN;
+        }
+    }
+
+    const struct page* const current = &result->current;
+    if (current->wd21.magic != PAGE_MAGIC) {
+        result->detail = current->wd21.magic;
+        return DEVICE_ERR_PAGE_MAGIC;
+    }
+    const struct page* const changeable = &result->changeable;
+    if ((result->pages & PC_MASK(PC_CHANGEABLE)) && changeable->wd21.led != 0xff) {
+        result->detail = changeable->wd21.led;
+        return DEVICE_ERR_NOT_CHANGEABLE;
+    }
+    return DEVICE_OK;
+}
+
+bool device_unchanged(const struct request* request, const struct plan* plan, const struct result* result) {
+    if (!(result->pages & PC_MASK(PC_CURRENT)) || result->current.wd21.led != request->new) {
+        return false;
+    }
+    if (request->save && !plan->no_save
+            && (!(result->pages & PC_MASK(PC_SAVED)) || result->saved.wd21.led != request->new)) {
+        return false;
+    }
+    return true;
+}
+
+void device_plan_save(const struct request* request, const struct plan* plan, struct result* result) {
+    result->nv_write = false;
+    if (!request->save || ((result->pages & PC_MASK(PC_SAVED)) && result->saved.wd21.led == request->new)) {
+        return;
+    }
+    if (plan->no_save) {
+        result->save_deferred = true;
+        return;
+    }
+    result->nv_write = true;
+}
+
+size_t device_select_packet(struct select_packet* packet, const struct page* current, int new) {
+    memset(packet, 0, sizeof(*packet));
+    memcpy(&packet->page, current, sizeof(*current));
+    packet->page.code &= current->code & 0x7f; // Clear PS bit
+
+    // Set the new LED mode value
+    packet->page.wd21.led = new;
+
+    return sizeof(packet->header) + 2 + sizeof(packet->page.wd21);
+}
+
+void device_format_values(const struct result* result, char* buf, size_t len) {
+    size_t n = 0;
+    buf[0] = '\0';
+    if (result->pages & PC_MASK(PC_CURRENT)) {
+        n += snprintf(buf + n, len - n, "%scurrent=%d", n ? " " : "", result->current.wd21.led);
+    }
+    if ((result->pages & PC_MASK(PC_DEFAULT)) && n < len) {
+        n += snprintf(buf + n, len - n, "%soriginal=%d", n ? " " : "", result->original.wd21.led);
+    }
+    if ((result->pages & PC_MASK(PC_SAVED)) && n < len) {
+        n += snprintf(buf + n, len - n, "%ssaved=%d", n ? " " : "", result->saved.wd21.led);
+    }
+}
+
+static const char* const phase_names[PHASE_COUNT] = {
+    [PHASE_OPEN] = "open",
+    [PHASE_REQUEST_SENSE] = "request_sense",
+    [PHASE_INQUIRY] = "inquiry",
+    [PHASE_MODE_SENSE + PC_CURRENT] = "sense:current",
+    [PHASE_MODE_SENSE + PC_CHANGEABLE] = "sense:changeable",
+    [PHASE_MODE_SENSE + PC_DEFAULT] = "sense:original",
+    [PHASE_MODE_SENSE + PC_SAVED] = "sense:saved",
+    [PHASE_MODE_SELECT] = "select",
+    [PHASE_CLOSE] = "close",
+};
+
+enum command device_phase_command(enum phase phase) {
+    if (phase == PHASE_REQUEST_SENSE) {
+        return COMMAND_REQUEST_SENSE;
+    } else if (phase == PHASE_INQUIRY) {
+        return COMMAND_INQUIRY;
+    } else if (phase >= PHASE_MODE_SENSE && phase < PHASE_MODE_SENSE + PC_COUNT) {
+        return COMMAND_MODE_SENSE;
+    } else if (phase == PHASE_MODE_SELECT) {
+        return COMMAND_MODE_SELECT;
+    }
+    return COMMAND_NONE;
+}
+
+const char* device_command_name(enum command command) {
+    static const char* const names[COMMAND_COUNT] = { "request_sense", "inquiry", "mode_sense", "mode_select" };
+    return command >= 0 && command < COMMAND_COUNT ? names[command] : "none";
+}
+
+void device_time_phase(struct result* result, enum phase phase, uint64_t us) {
+    result->phases |= PHASE_MASK(phase);
+    result->phase_us[phase] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+void device_format_timing(const struct result* result, char* buf, size_t len) {
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int phase = 0; phase < PHASE_COUNT && n < len; phase++) {
+        if (result->phases & PHASE_MASK(phase)) {
+            n += snprintf(buf + n, len - n, "%s=%" PRIu32 "us ", phase_names[phase], result->phase_us[phase]);
+        }
+    }
+    if (n < len) {
+        snprintf(buf + n, len - n, "total=%" PRIu64 "us", result->elapsed_us);
+    }
+}
+
+// Describe the detail of a failed command
+static const char* detail_str(const struct result* result) {
+    return result->detail < 0 ? strerror(-result->detail) : scsi_cat_str(result->detail);
+}
+
+// Short names for errors, which stay the same from release to release
+static const char* const err_names[] = {
+    [DEVICE_OK] = "ok",
+    [DEVICE_ERR_OPEN] = "open",
+    [DEVICE_ERR_INQUIRY] = "inquiry",
+    [DEVICE_ERR_VENDOR] = "vendor",
+    [DEVICE_ERR_PRODUCT] = "product",
+    [DEVICE_ERR_MODE_SENSE] = "mode_sense",
+    [DEVICE_ERR_PAGE_CODE] = "page_code",
+    [DEVICE_ERR_PAGE_LEN] = "page_len",
+    [DEVICE_ERR_PAGE_MAGIC] = "page_magic",
+    [DEVICE_ERR_NOT_CHANGEABLE] = "not_changeable",
+    [DEVICE_ERR_MODE_SELECT] = "mode_select",
+    [DEVICE_ERR_DEADLINE] = "deadline",
+};
+
+const char* device_err_name(enum device_err err) {
+    return (size_t)err < sizeof(err_names) / sizeof(err_names[0]) ? err_names[err] : "unknown";
+}
+
+void device_strerror(const struct result* result, char* buf, size_t len) {
+    switch (result->err) {
+    case DEVICE_OK:
+        snprintf(buf, len, "Success");
+        break;
+    case DEVICE_ERR_OPEN:
+        snprintf(buf, len, "Failed to open (%s)", detail_str(result));
+        break;
+    case DEVICE_ERR_INQUIRY:
+        snprintf(buf, len, "Inquiry failed (%s)", detail_str(result));
+        break;
+    case DEVICE_ERR_VENDOR:
+        snprintf(buf, len, "Unknown or unsupported vendor!");
+        break;
+    case DEVICE_ERR_PRODUCT:
+        snprintf(buf, len, "Unknown or unsupported product!");
+        break;
+    case DEVICE_ERR_MODE_SENSE:
+        snprintf(buf, len, "Get mode page failed (%s)", detail_str(result));
+        break;
+    case DEVICE_ERR_PAGE_CODE:
+        snprintf(buf, len, "Unexpected mode page id (0x%02x)", result->detail);
+        break;
+    case DEVICE_ERR_PAGE_LEN:
+        snprintf(buf, len, "Unexpected mode page length (0x%02x)", result->detail);
+        break;
+    case DEVICE_ERR_PAGE_MAGIC:
+        snprintf(buf, len, "Unexpected mode page magic (0x%02x)", result->detail);
+        break;
+    case DEVICE_ERR_NOT_CHANGEABLE:
+        snprintf(buf, len, "LED bits don't appear changeable (0x%02x)", result->detail);
+        break;
+    case DEVICE_ERR_MODE_SELECT:
+        snprintf(buf, len, "Set mode page failed (%s)", detail_str(result));
+        break;
+    case DEVICE_ERR_DEADLINE:
+        snprintf(buf, len, "Timed out, abandoned during %s", result->detail >= 0 && result->detail < PHASE_COUNT ? phase_names[result->detail] : "?");
+        break;
+    }
+}
+
+// Append to a JSON record, stopping at the end of the buffer
+static size_t json_printf(char* buf, size_t len, size_t n, const char* fmt, ...) {
+    if (n >= len) {
+        return n;
+    }
+    va_list args;
+    va_start(args, fmt);
+    const int written = vsnprintf(buf + n, len - n, fmt, args);
+    va_end(args);
+    return written < 0 ? len : n + written;
+}
+
+// Append a quoted JSON string, escaped, without any padding at the end
+static size_t json_string(char* buf, size_t len, size_t n, const char* str) {
+    size_t end = strlen(str);
+    while (end > 0 && str[end - 1] == ' ') {
+        end--;
+    }
+    n = json_printf(buf, len, n, "\"");
+    for (size_t i = 0; i < end; i++) {
+        const unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            n = json_printf(buf, len, n, "\\%c", c);
+        } else if (c < 0x20) {
+            n = json_printf(buf, len, n, "\\u%04x", c);
+        } else {
+            n = json_printf(buf, len, n, "%c", c);
+        }
+    }
+    return json_printf(buf, len, n, "\"");
+}
+
+void device_format_json(const char* device, const char* action, const struct result* result, char* buf, size_t len) {
+    size_t n = json_printf(buf, len, 0, "{\"device\":");
+    n = json_string(buf, len, n, device);
+    n = json_printf(buf, len, n, ",\"action\":\"%s\"", action);
+    if (result->identified) {
+        n = json_printf(buf, len, n, ",\"vendor\":");
+        n = json_string(buf, len, n, result->identity.vendor);
+        n = json_printf(buf, len, n, ",\"product\":");
+        n = json_string(buf, len, n, result->identity.product);
+        n = json_printf(buf, len, n, ",\"revision\":");
+        n = json_string(buf, len, n, result->identity.revision);
+        n = json_printf(buf, len, n, ",\"supported\":%s", result->support == DEVICE_OK ? "true" : "false");
+    }
+    if (result->pages_valid) {
+        static const char* const names[PC_COUNT] = { [PC_CURRENT] = "current", [PC_DEFAULT] = "original", [PC_SAVED] = "saved" };
+        const struct page* const pages[PC_COUNT] = {
+            [PC_CURRENT] = &result->current,
+            [PC_DEFAULT] = &result->original,
+            [PC_SAVED] = &result->saved,
+        };
+        for (int pc = 0; pc < PC_COUNT; pc++) {
+            if (names[pc] && (result->pages & PC_MASK(pc))) {
+                n = json_printf(buf, len, n, ",\"%s\":%d", names[pc], pages[pc]->wd21.led);
+            }
+        }
+    }
+    n = json_printf(buf, len, n, ",\"cached\":%s,\"save_deferred\":%s",
+                    result->cached ? "true" : "false", result->save_deferred ? "true" : "false");
+    if (result->err == DEVICE_OK) {
+        n = json_printf(buf, len, n, ",\"error\":null");
+    } else {
+        char message[128];
+        device_strerror(result, message, sizeof(message));
+        n = json_printf(buf, len, n, ",\"error\":\"%s\",\"message\":", device_err_name(result->err));
+        n = json_string(buf, len, n, message);
+    }
+    n = json_printf(buf, len, n, ",\"elapsed_us\":%" PRIu64 ",\"phases_us\":{", result->elapsed_us);
+    const char* separator = "";
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        if (result->phases & PHASE_MASK(phase)) {
+            n = json_printf(buf, len, n, "%s\"%s\":%" PRIu32, separator, phase_names[phase], result->phase_us[phase]);
+            separator = ",";
+        }
+    }
+    json_printf(buf, len, n, "}}");
+}
@@ -0,0 +1,224 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_VER     "v0.1"
+#define CMD_URL     "https://jbit.net/wdled/"
+#define PAGE_CODE   0x21
+#define PAGE_MAGIC  0x30
+#define PS_BIT      (1<<7) // Parameters saveable
+#define SPF_BIT     (1<<6) // Sub page format
+
+// MODE SENSE page control values
+enum {
+    PC_CURRENT = 0,
+    PC_CHANGEABLE = 1,
+    PC_DEFAULT = 2,
+    PC_SAVED = 3,
+    PC_COUNT = 4,
+};
+#define PC_MASK(pc) (1 << (pc))
+
+// Phases of operating on a device, timed for --timing
+enum phase {
+    PHASE_OPEN,
+    PHASE_REQUEST_SENSE,
+    PHASE_INQUIRY,
+    PHASE_MODE_SENSE, // One for each page control, PHASE_MODE_SENSE + pc
+    PHASE_MODE_SELECT = PHASE_MODE_SENSE + PC_COUNT,
+    PHASE_CLOSE,
+    PHASE_COUNT,
+};
+#define PHASE_MASK(phase) (1 << (phase))
+
+// The SCSI commands sent, by opcode rather than phase (every MODE SENSE is the same command)
+enum command {
+    COMMAND_NONE = -1, // Opening and closing aren't commands
+    COMMAND_REQUEST_SENSE,
+    COMMAND_INQUIRY,
+    COMMAND_MODE_SENSE,
+    COMMAND_MODE_SELECT,
+    COMMAND_COUNT,
+};
+
+struct supported_vendor { const char* vendor; const char** products; };
+extern const struct supported_vendor supported[];
+
+struct page {
+    // Header bytes
+    uint8_t code; // Page code and PS/SPF bits
+    uint8_t len;  // Length of parameters in bytes
+
+    // Payload
+    union {
+        struct {
+            // Guessed layout of the WD 0x21 mode page
+            uint8_t magic; // Version? Always 0x30. Not modifiable
+            uint8_t zeros0;
+            uint8_t zeros1;
+            uint8_t unknown1; // Flags? some bits modifiable
+            uint8_t zeros2;
+            uint8_t zeros3;
+            uint8_t led;      // LED control 0x00=off, 0xff=on, other=Error
+            uint8_t zeros4;
+            uint8_t zeros5;
+            uint8_t zeros6;
+        } wd21;
+        uint8_t bytes[32];
+    };
+};
+
+// This can be entirely zero for a MODE SELECT packet
+struct mode_parameter_header {
+    uint16_t len;
+    uint8_t  medium_type;
+    uint8_t  flags0; // WP/DPOFUA bits
+    uint8_t  flags1; // LONGLBA bit
+    uint8_t  reserved;
+    uint16_t block_descriptor_length;
+};
+
+// A MODE SELECT(10) parameter list carrying the 0x21 page
+struct select_packet {
+    struct mode_parameter_header header;
+    struct page page;
+};
+
+// Identity of a disk, as reported by a standard INQUIRY (space padded, NUL terminated)
+struct identity {
+    char vendor[9];
+    char product[17];
+    char revision[5];
+};
+
+enum device_err {
+    DEVICE_OK = 0,
+    DEVICE_ERR_OPEN,           // detail: -errno
+    DEVICE_ERR_INQUIRY,        // detail: SCSI category
+    DEVICE_ERR_VENDOR,
+    DEVICE_ERR_PRODUCT,
+    DEVICE_ERR_MODE_SENSE,     // detail: SCSI category
+    DEVICE_ERR_PAGE_CODE,      // detail: page code
+    DEVICE_ERR_PAGE_LEN,       // detail: page length
+    DEVICE_ERR_PAGE_MAGIC,     // detail: page magic
+    DEVICE_ERR_NOT_CHANGEABLE, // detail: changeable LED bits
+    DEVICE_ERR_MODE_SELECT,    // detail: SCSI category
+    DEVICE_ERR_DEADLINE,       // detail: enum phase that was abandoned
+};
+
+// What to do with each device
+struct request {
+    bool force;            // Skip vendor/product checks
+    bool save;             // Have the disk remember the new LED mode
+    bool skip_unsupported; // Quietly skip unknown disks instead of failing (--all)
+    bool prefix;           // Prefix output lines with the device name (batch mode)
+    bool quiet;            // Only read and print the current LED mode
+    bool full;             // Read and validate every page control, even if it isn't needed
+    bool no_cache;         // Don't use or update the capability cache
+    bool no_wake;          // Leave sleeping disks alone, answering reads from the cache
+    bool timing;           // Report how long each phase took
+    bool json;             // Report each device as a JSON object on a line of its own
+    bool journal;          // Record each device's outcome in the journal (wdled --journal/--resume)
+    unsigned timeout_ms;   // Timeout for each command, 0 for SCSI_TIMEOUT_MS
+    unsigned deadline_ms;  // Give up on the device if it hasn't finished in this long, 0 for no deadline
+    unsigned save_budget;  // Non-volatile writes allowed per disk per day, 0 for no limit
+    unsigned cached_s;     // Answer reads from cached LED values confirmed within this many seconds, 0 to ask the disk
+    bool health;           // Keep track of each disk's latency and errors across runs
+    bool adaptive_timeout; // Time commands out based on the latencies seen from the disk's model
+    int new;               // LED mode to set, or -1 to only read
+};
+
+// The SCSI commands needed to carry out a request
+struct plan {
+    bool power_check;      // REQUEST SENSE first, and stop there if the disk is in a low power condition
+    bool inquiry;          // INQUIRY to check the vendor/product
+    uint8_t page_controls; // PC_MASK()s of the MODE SENSE page controls to read
+    bool select;           // MODE SELECT to set the LED mode
+    bool no_save;          // The disk's non-volatile write budget is used up, so a save only sets the current value
+    uint64_t deadline_us;  // trace_now_us() to give up at, 0 for none (set once the device is started)
+    unsigned timeout_ms[COMMAND_COUNT]; // Timeouts learnt for the disk's model, 0 to use the request's
+};
+
+// Outcome of operating on a single device
+struct result {
+    enum device_err err;
+    int detail;              // Extra information about err (see enum device_err)
+    bool identified;         // identity is valid
+    enum device_err support; // Result of the vendor/product check (even if forced)
+    bool pages_valid;        // The mode pages were read and passed validation
+    bool unchanged;          // The disk already had the requested LED mode, so nothing was written
+    bool nv_write;           // The MODE SELECT saved the LED mode, writing non-volatile storage
+    bool save_deferred;      // A save was left for later, as the disk's non-volatile write budget is used up
+    bool asleep;             // The disk was asleep, so it was left alone
+    bool cached;             // The LED values came from the cache rather than the disk
+    uint64_t elapsed_us;     // How long the device took, from opening it to its last command completing
+    uint8_t pages;           // PC_MASK()s of the page controls that have been read
+    uint16_t phases;         // PHASE_MASK()s of the phases that have been timed
+    uint32_t phase_us[PHASE_COUNT];
+    struct identity identity;
+    struct page current, changeable, original, saved;
+};
+
+// Parse a VALUE ('on', 'off', 0-255, optionally prefixed with 'save:' or 'FORCESET:', or 'FORCEGET') into request
+// Returns false if it's invalid
+bool device_parse_value(const char* arg, struct request* request);
+
+// Check the identity against the supported device list
+enum device_err device_check_identity(const struct identity* identity);
+
+// Work out the minimal set of commands needed for a request
+struct plan device_plan(const struct request* request);
+
+// The page control to read after `pc` (or -1 to start), or -1 if there are no more
+int device_next_pc(const struct plan* plan, int pc);
+
+// The page struct in result for a page control
+struct page* device_result_page(struct result* result, int pc);
+
+// Validate the page controls of the 0x21 mode page that have been read, filling in result->detail on failure
+enum device_err device_check_pages(struct result* result);
+
+// Format the LED values that were read, e.g "current=255 original=255 saved=255"
+void device_format_values(const struct result* result, char* buf, size_t len);
+
+// The command a phase sends, and its name (e.g "mode_sense")
+enum command device_phase_command(enum phase phase);
+const char* device_command_name(enum command command);
+
+// Record how long a phase took
+void device_time_phase(struct result* result, enum phase phase, uint64_t us);
+
+// Format the phase timings, e.g "open=12us inquiry=251us sense:current=250us close=3us total=520us"
+void device_format_timing(const struct result* result, char* buf, size_t len);
+
+// Short name for an error, e.g "mode_sense", that stays the same from release to release
+const char* device_err_name(enum device_err err);
+
+// Describe why a device failed, e.g "Inquiry failed (Not ready)"
+void device_strerror(const struct result* result, char* buf, size_t len);
+
+// Format the outcome of a device as a single line JSON object, e.g
+// {"device":"/dev/sdb","action":"set","vendor":"WD",...,"current":255,"error":null,...,"phases_us":{"open":12,...}}
+// action says what was done ("read", "set", "saved", "unchanged", "asleep", "skipped" or "error")
+void device_format_json(const char* device, const char* action, const struct result* result, char* buf, size_t len);
+
+// Check whether the pages that were read show the disk already has the requested LED mode
+// (both current and saved, when saving within budget), in which case the MODE SELECT can be skipped
+bool device_unchanged(const struct request* request, const struct plan* plan, const struct result* result);
+
+// Work out whether setting the LED mode needs to save it, once the saved value has been read.
+// A disk that already remembers the new value only needs it setting, and a save over budget is deferred
+void device_plan_save(const struct request* request, const struct plan* plan, struct result* result);
+
+// Build a MODE SELECT parameter list changing the LED mode, returns the number of bytes to send
+size_t device_select_packet(struct select_packet* packet, const struct page* current, int new);
@@ -0,0 +1,222 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "discover.h"
+#include "sysfs.h"
+
+#define SCSI_TYPE_DISK 0x00 // Peripheral device type of a direct access block device
+
+struct link {
+    char* node;
+    char* name;
+};
+
+static int compare_links(const void* a, const void* b) {
+    const struct link* const la = a;
+    const struct link* const lb = b;
+    const int result = strcmp(la->node, lb->node);
+    return result ? result : strcmp(la->name, lb->name);
+}
+
+static int compare_disks(const void* a, const void* b) {
+    return strcmp(((const struct disk*)a)->node, ((const struct disk*)b)->node);
+}
+
+bool discover_by_id(struct disk_list* list) {
+    memset(list, 0, sizeof(*list));
+    DIR* dir = opendir(BY_ID_DIR);
+    if (!dir) {
+        // No disks at all
+        return true;
+    }
+
+    // Resolve every link, skipping partitions
+    struct link* links = NULL;
+    size_t nlinks = 0, capacity = 0;
+    bool ok = true;
+    for (struct dirent* entry; ok && (entry = readdir(dir));) {
+        if (entry->d_name[0] == '.' || strstr(entry->d_name, "-part")) {
+            continue;
+        }
+        char path[PATH_MAX], node[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", BY_ID_DIR, entry->d_name);
+        if (!realpath(path, node)) {
+            continue;
+        }
+        if (nlinks == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct link* const grown = realloc(links, capacity * sizeof(*grown));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            links = grown;
+        }
+        links[nlinks].node = strdup(node);
+        links[nlinks].name = strdup(entry->d_name);
+        ok = links[nlinks].node && links[nlinks].name;
+        nlinks++;
+    }
+    closedir(dir);
+
+    // Sorting puts all the names of each disk next to each other
+    if (ok) {
+        qsort(links, nlinks, sizeof(*links), compare_links);
+        list->disks = calloc(nlinks ? nlinks : 1, sizeof(*list->disks));
+        ok = list->disks != NULL;
+    }
+    for (size_t i = 0; ok && i < nlinks;) {
+        struct disk* const disk = &list->disks[list->count++];
+        size_t end = i;
+        while (end < nlinks && !strcmp(links[end].node, links[i].node)) {
+            end++;
+        }
+        disk->node = links[i].node;
+        links[i].node = NULL;
+        if (!(disk->ids = calloc(end - i, sizeof(*disk->ids)))) {
+            ok = false;
+            break;
+        }
+        for (; i < end; i++) {
+            disk->ids[disk->nids++] = links[i].name;
+            links[i].name = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < nlinks; i++) {
+        free(links[i].node);
+        free(links[i].name);
+    }
+    free(links);
+    if (!ok) {
+        discover_free(list);
+    }
+    return ok;
+}
+
+const struct disk* discover_find(const struct disk_list* list, const char* node) {
+    const struct disk key = { .node = (char*)node };
+    return list->count ? bsearch(&key, list->disks, list->count, sizeof(key), compare_disks) : NULL;
+}
+
+void discover_free(struct disk_list* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->disks[i].node);
+        for (size_t j = 0; j < list->disks[i].nids; j++) {
+            free(list->disks[i].ids[j]);
+        }
+        free(list->disks[i].ids);
+    }
+    free(list->disks);
+    memset(list, 0, sizeof(*list));
+}
+
+// Name of the only entry in a sysfs directory (e.g the sdb in .../6:0:0:0/block), if it has one
+static bool only_entry(const char* dir, const char* sub, char* name, size_t len) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, sub);
+    DIR* const d = opendir(path);
+    if (!d) {
+        return false;
+    }
+    bool found = false;
+    for (struct dirent* entry; !found && (entry = readdir(d));) {
+        if (entry->d_name[0] != '.') {
+            found = (size_t)snprintf(name, len, "%s", entry->d_name) < len;
+        }
+    }
+    closedir(d);
+    return found;
+}
+
+static int compare_scanned(const void* a, const void* b) {
+    return strcmp(((const struct scanned*)a)->dir, ((const struct scanned*)b)->dir);
+}
+
+// Add the SCSI device behind every entry of a sysfs class directory, if it's a supported disk
+static bool scan_class(struct scan_list* list, size_t* capacity, const char* class_dir) {
+    DIR* const dir = opendir(class_dir);
+    if (!dir) {
+        // The class doesn't exist (e.g the sg driver isn't loaded)
+        return true;
+    }
+    bool ok = true;
+    for (struct dirent* entry; ok && (entry = readdir(dir));) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char link[PATH_MAX], device[PATH_MAX];
+        snprintf(link, sizeof(link), "%s/%s/device", class_dir, entry->d_name);
+        if (!realpath(link, device) || strlen(device) >= sizeof(list->devices->dir)) {
+            // Not backed by a SCSI device (e.g a loop or NVMe block device)
+            continue;
+        }
+
+        // Each SCSI device shows up in both classes, only look at it once
+        bool seen = false;
+        for (size_t i = 0; !seen && i < list->count; i++) {
+            seen = !strcmp(list->devices[i].dir, device);
+        }
+        char type[8];
+        struct scanned scanned = {};
+        if (seen || !sysfs_read_attr(device, "type", type, sizeof(type)) || atoi(type) != SCSI_TYPE_DISK
+                || !sysfs_identity(device, &scanned.identity) || device_check_identity(&scanned.identity) != DEVICE_OK) {
+            continue;
+        }
+
+        strcpy(scanned.dir, device);
+        char name[24];
+        if (only_entry(device, "block", name, sizeof(name))) {
+            snprintf(scanned.node, sizeof(scanned.node), "/dev/%s", name);
+        }
+        if (only_entry(device, "scsi_generic", name, sizeof(name))) {
+            snprintf(scanned.sg, sizeof(scanned.sg), "/dev/%s", name);
+        }
+        if (!scanned.node[0] && !scanned.sg[0]) {
+            continue;
+        }
+        if (list->count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            struct scanned* const grown = realloc(list->devices, *capacity * sizeof(*grown));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            list->devices = grown;
+        }
+        list->devices[list->count++] = scanned;
+    }
+    closedir(dir);
+    return ok;
+}
+
+bool discover_scan(struct scan_list* list) {
+    memset(list, 0, sizeof(*list));
+    size_t capacity = 0;
+    if (!scan_class(list, &capacity, SYSFS_BLOCK_DIR) || !scan_class(list, &capacity, SYSFS_SG_DIR)) {
+        discover_scan_free(list);
+        return false;
+    }
+    qsort(list->devices, list->count, sizeof(*list->devices), compare_scanned);
+    return true;
+}
+
+const char* discover_scan_path(const struct scanned* scanned) {
+    return scanned->node[0] ? scanned->node : scanned->sg;
+}
+
+void discover_scan_free(struct scan_list* list) {
+    free(list->devices);
+    memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,60 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "device.h"
+
+#define BY_ID_DIR       "/dev/disk/by-id"
+#define SYSFS_BLOCK_DIR "/sys/block"
+#define SYSFS_SG_DIR    "/sys/class/scsi_generic"
+
+// A disk, and every name it has in /dev/disk/by-id
+struct disk {
+    char* node;  // Canonical device node, e.g /dev/sdb
+    char** ids;  // Names in /dev/disk/by-id (without the directory)
+    size_t nids;
+};
+
+struct disk_list {
+    struct disk* disks; // Sorted by node
+    size_t count;
+};
+
+// Find every whole disk in /dev/disk/by-id, grouping all of each disk's names together
+bool discover_by_id(struct disk_list* list);
+
+// Find a disk by its canonical device node
+const struct disk* discover_find(const struct disk_list* list, const char* node);
+
+void discover_free(struct disk_list* list);
+
+// A supported disk, found using only what the kernel has cached in sysfs
+struct scanned {
+    char dir[PATH_MAX]; // sysfs SCSI device directory, ending in its H:C:T:L
+    char node[32];      // Block device node (e.g /dev/sdb), empty if it has none
+    char sg[32];        // SCSI generic node (e.g /dev/sg2), empty if it has none
+    struct identity identity;
+};
+
+struct scan_list {
+    struct scanned* devices; // Sorted by dir
+    size_t count;
+};
+
+// Find every supported disk in /sys/block and /sys/class/scsi_generic, without opening any of them.
+// Devices that aren't disks (e.g the virtual SES and CD-ROM LUNs some bridges have) are skipped
+bool discover_scan(struct scan_list* list);
+
+// The node to open a scanned disk with, preferring the block device
+const char* discover_scan_path(const struct scanned* scanned);
+
+void discover_scan_free(struct scan_list* list);
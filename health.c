@@ -0,0 +1,273 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "health.h"
+#include "scsi.h"
+#include "sysfs.h"
+
+#define HEALTH_MAGIC "wdled-health 1"
+#define MODEL_MAGIC  "wdled-model 1"
+
+// Latency buckets: the first up to 64us, each twice as wide as the last, the last over a minute
+#define BUCKET_COUNT 21
+#define BUCKET_US(i) (64ull << (i))
+
+struct health_entry {
+    unsigned long long runs;
+    unsigned long long bad_runs;
+    unsigned strikes;            // Bad runs in a row
+    long long quarantined_until; // time() the quarantine ends, 0 if it isn't quarantined
+};
+
+struct model_entry {
+    unsigned long long buckets[COMMAND_COUNT][BUCKET_COUNT];
+};
+
+static void health_path(const struct health_key* key, char* path, size_t len) {
+    cache_path(STATE_DIR, key->serial, path, len);
+    strncat(path, ".health", len - strlen(path) - 1);
+}
+
+static void model_path(const struct health_key* key, char* path, size_t len) {
+    char name[sizeof(key->model) + 8];
+    snprintf(name, sizeof(name), "model-%s", key->model);
+    cache_path(STATE_DIR, name, path, len);
+}
+
+// Open and lock a state file, returns NULL if it doesn't exist (and can't be created, when writing)
+static FILE* state_open(const char* path, bool write) {
+    if (write && mkdir(STATE_DIR, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    const int fd = open(path, write ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE* const file = fdopen(fd, write ? "r+" : "r");
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+    flock(fd, write ? LOCK_EX : LOCK_SH);
+    return file;
+}
+
+// Get ready to rewrite a state file that has been read
+static bool state_rewind(FILE* file) {
+    rewind(file);
+    return ftruncate(fileno(file), 0) == 0;
+}
+
+static void health_read(FILE* file, struct health_entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    char line[128];
+    bool ok = fgets(line, sizeof(line), file) && !strcmp(line, HEALTH_MAGIC "\n");
+    while (ok && fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        if (!value) {
+            break;
+        }
+        *value++ = '\0';
+        if (!strcmp(line, "runs")) {
+            entry->runs = strtoull(value, NULL, 10);
+        } else if (!strcmp(line, "bad_runs")) {
+            entry->bad_runs = strtoull(value, NULL, 10);
+        } else if (!strcmp(line, "strikes")) {
+            entry->strikes = strtoul(value, NULL, 10);
+        } else if (!strcmp(line, "quarantined_until")) {
+            entry->quarantined_until = strtoll(value, NULL, 10);
+        }
+    }
+}
+
+static void model_read(FILE* file, struct model_entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    char line[1024];
+    bool ok = fgets(line, sizeof(line), file) && !strcmp(line, MODEL_MAGIC "\n");
+    while (ok && fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        if (!value) {
+            break;
+        }
+        *value++ = '\0';
+        for (enum command command = 0; command < COMMAND_COUNT; command++) {
+            if (!strcmp(line, device_command_name(command))) {
+                for (size_t i = 0; i < BUCKET_COUNT && *value; i++) {
+                    entry->buckets[command][i] = strtoull(value, &value, 10);
+                }
+            }
+        }
+    }
+}
+
+// The bucket a percentile of a command's latencies falls in, as its upper bound, or 0 if there are too few
+static uint64_t model_percentile(const struct model_entry* entry, enum command command, unsigned pct) {
+    unsigned long long total = 0, seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        total += entry->buckets[command][i];
+    }
+    if (total < HEALTH_MIN_SAMPLES) {
+        return 0;
+    }
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        seen += entry->buckets[command][i];
+        if (seen * 100 >= total * pct) {
+            return BUCKET_US(i);
+        }
+    }
+    return BUCKET_US(BUCKET_COUNT - 1);
+}
+
+// Work out the health key for a device, returns false if it can't be tracked
+static bool health_key(const char* device, struct health_key* key) {
+    char dir[PATH_MAX];
+    struct identity identity;
+    memset(key, 0, sizeof(*key));
+    if (sysfs_device_dir(device, dir, sizeof(dir)) != 0 || !sysfs_identity(dir, &identity)
+            || !sysfs_serial(dir, key->serial, sizeof(key->serial))) {
+        return false;
+    }
+    size_t vendor_len = strlen(identity.vendor);
+    while (vendor_len > 0 && identity.vendor[vendor_len - 1] == ' ') {
+        vendor_len--;
+    }
+    snprintf(key->model, sizeof(key->model), "%.*s %s", (int)vendor_len, identity.vendor, identity.product);
+    key->valid = true;
+    return true;
+}
+
+bool health_quarantined(const char* device) {
+    struct health_key key;
+    char path[PATH_MAX];
+    if (!health_key(device, &key)) {
+        return false;
+    }
+    health_path(&key, path, sizeof(path));
+    FILE* const file = state_open(path, false);
+    if (!file) {
+        return false;
+    }
+    struct health_entry entry;
+    health_read(file, &entry);
+    fclose(file);
+    return entry.quarantined_until > time(NULL);
+}
+
+void health_prepare(const char* device, const struct request* request, struct plan* plan, struct health_key* key) {
+    char path[PATH_MAX];
+    if (!request->health || !health_key(device, key)) {
+        memset(key, 0, sizeof(*key));
+        return;
+    }
+    model_path(key, path, sizeof(path));
+    FILE* const file = state_open(path, false);
+    if (!file) {
+        return;
+    }
+    struct model_entry entry;
+    model_read(file, &entry);
+    fclose(file);
+
+    const unsigned timeout_ms = request->timeout_ms ? request->timeout_ms : SCSI_TIMEOUT_MS;
+    for (enum command command = 0; command < COMMAND_COUNT; command++) {
+        key->median_us[command] = model_percentile(&entry, command, 50);
+        const uint64_t p99_us = model_percentile(&entry, command, 99);
+        if (request->adaptive_timeout && p99_us) {
+            const uint64_t learnt_ms = p99_us * HEALTH_TIMEOUT_FACTOR / 1000;
+            plan->timeout_ms[command] = learnt_ms < HEALTH_TIMEOUT_MIN_MS ? HEALTH_TIMEOUT_MIN_MS
+                                      : learnt_ms > timeout_ms ? timeout_ms : learnt_ms;
+        }
+    }
+}
+
+void health_update(const struct health_key* key, const struct result* result) {
+    // Sleeping and unsupported disks, and answers from the cache, say nothing about the link
+    if (!key->valid || result->asleep || result->cached || result->err == DEVICE_ERR_VENDOR || result->err == DEVICE_ERR_PRODUCT) {
+        return;
+    }
+    bool bad = result->err != DEVICE_OK;
+    for (enum phase phase = 0; phase < PHASE_COUNT; phase++) {
+        const enum command command = device_phase_command(phase);
+        if (command != COMMAND_NONE && (result->phases & PHASE_MASK(phase)) && key->median_us[command]
+                && result->phase_us[phase] > key->median_us[command] * HEALTH_SLOW_FACTOR) {
+            bad = true;
+        }
+    }
+
+    char path[PATH_MAX];
+    health_path(key, path, sizeof(path));
+    FILE* file = state_open(path, true);
+    if (!file) {
+        return;
+    }
+    struct health_entry entry;
+    health_read(file, &entry);
+    entry.runs++;
+    if (bad) {
+        entry.bad_runs++;
+        entry.strikes++;
+        if (entry.strikes >= HEALTH_STRIKES) {
+            entry.quarantined_until = time(NULL) + HEALTH_QUARANTINE_S;
+        }
+    } else {
+        entry.strikes = 0;
+        entry.quarantined_until = 0;
+    }
+    if (state_rewind(file)) {
+        fprintf(file, HEALTH_MAGIC "\n");
+        fprintf(file, "runs=%llu\n", entry.runs);
+        fprintf(file, "bad_runs=%llu\n", entry.bad_runs);
+        fprintf(file, "strikes=%u\n", entry.strikes);
+        fprintf(file, "quarantined_until=%lld\n", entry.quarantined_until);
+    }
+    fclose(file);
+
+    // Only learn latencies from good runs, so a bad bridge can't drag its model's timeouts out
+    if (bad) {
+        return;
+    }
+    model_path(key, path, sizeof(path));
+    if (!(file = state_open(path, true))) {
+        return;
+    }
+    struct model_entry model;
+    model_read(file, &model);
+    for (enum phase phase = 0; phase < PHASE_COUNT; phase++) {
+        const enum command command = device_phase_command(phase);
+        if (command != COMMAND_NONE && (result->phases & PHASE_MASK(phase))) {
+            size_t i = 0;
+            while (i + 1 < BUCKET_COUNT && result->phase_us[phase] > BUCKET_US(i)) {
+                i++;
+            }
+            model.buckets[command][i]++;
+        }
+    }
+    if (state_rewind(file)) {
+        fprintf(file, MODEL_MAGIC "\n");
+        for (enum command command = 0; command < COMMAND_COUNT; command++) {
+            fprintf(file, "%s=", device_command_name(command));
+            for (size_t i = 0; i < BUCKET_COUNT; i++) {
+                fprintf(file, "%s%llu", i ? " " : "", model.buckets[command][i]);
+            }
+            fprintf(file, "\n");
+        }
+    }
+    fclose(file);
+}
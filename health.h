@@ -0,0 +1,40 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "device.h"
+
+// Each disk's health (and the command latencies of each model) is kept in STATE_DIR across runs.
+// A run is bad if it fails, or any command takes HEALTH_SLOW_FACTOR times the model's median.
+// After HEALTH_STRIKES bad runs in a row a disk is quarantined, and given another chance after HEALTH_QUARANTINE_S
+#define HEALTH_SLOW_FACTOR   10
+#define HEALTH_STRIKES       3
+#define HEALTH_QUARANTINE_S  (60 * 60)
+#define HEALTH_MIN_SAMPLES   20   // Commands a model needs to have completed before its latencies are trusted
+#define HEALTH_TIMEOUT_FACTOR 4   // Learnt timeouts are this many times the model's 99th percentile...
+#define HEALTH_TIMEOUT_MIN_MS 1000 // ...but never shorter than this
+
+struct health_key {
+    bool valid;          // The device is being tracked, and has a serial number and identity to track it by
+    char serial[64];
+    char model[64];      // Vendor and product, whose latencies are shared
+    uint64_t median_us[COMMAND_COUNT]; // The model's median latency for each command, 0 if it isn't known yet
+};
+
+// Check whether a device is quarantined
+bool health_quarantined(const char* device);
+
+// Look up a device's model, and if request->adaptive_timeout is set, time its commands out based on its latencies.
+// Does nothing unless request->health is set
+void health_prepare(const char* device, const struct request* request, struct plan* plan, struct health_key* key);
+
+// Record how a run on the device went, quarantining it if it's had too many bad runs
+void health_update(const struct health_key* key, const struct result* result);
@@ -0,0 +1,171 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "sim.h"
+#include "sysfs.h"
+
+#define JOURNAL_MAGIC "wdled-journal 1"
+
+static struct {
+    int fd;       // -1 until journal_open()
+    char** done;  // Keys of the devices the resumed journal records as done
+    size_t ndone;
+} journal = { .fd = -1 };
+
+// Replace anything that would break up a line's fields
+static void sanitize(char* s) {
+    for (; *s; s++) {
+        if (*s <= ' ' || *s == '=' || *s == 0x7f) {
+            *s = '_';
+        }
+    }
+}
+
+// Build the key a device is journaled under, returns false if it can't be told apart from other disks
+static bool journal_key(const char* device, const struct request* request, char* key, size_t len) {
+    char serial[PATH_MAX] = "";
+    struct identity identity = { .revision = "-" };
+    if (!strncmp(device, SIM_PREFIX, strlen(SIM_PREFIX))) {
+        snprintf(serial, sizeof(serial), "%s", device);
+    } else {
+        char dir[PATH_MAX];
+        if (sysfs_device_dir(device, dir, sizeof(dir)) != 0 || !sysfs_serial(dir, serial, sizeof(serial))
+                || !sysfs_identity(dir, &identity)) {
+            return false;
+        }
+    }
+    sanitize(serial);
+    sanitize(identity.revision);
+    const int result = snprintf(key, len, "serial=%s revision=%s value=%d save=%d", serial, identity.revision,
+                                request->new, request->new >= 0 && request->save);
+    return result > 0 && (size_t)result < len;
+}
+
+// Read the journal's header, and with resume the keys of the devices that are done.
+// Lines without a newline were cut short by a crash, so are ignored
+static bool journal_read(int fd, bool resume, char* error, size_t len) {
+    FILE* const file = fdopen(dup(fd), "re");
+    if (!file) {
+        snprintf(error, len, "%s", strerror(errno));
+        return false;
+    }
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t n;
+    bool ok = true;
+    for (unsigned number = 1; ok && (n = getline(&line, &size, file)) > 0; number++) {
+        if (line[n - 1] != '\n') {
+            break;
+        }
+        line[n - 1] = '\0';
+        if (number == 1) {
+            if (strcmp(line, JOURNAL_MAGIC) != 0) {
+                snprintf(error, len, "not a wdled journal");
+                ok = false;
+            }
+            continue;
+        }
+        char* const action = strstr(line, " action=");
+        if (!resume || !action || !strstr(action, " done=1 ") || !strncmp(line, "serial=- ", 9)) {
+            continue;
+        }
+        *action = '\0';
+        char** const done = realloc(journal.done, (journal.ndone + 1) * sizeof(*done));
+        if (!done || !(done[journal.ndone] = strdup(line))) {
+            journal.done = done ? done : journal.done;
+            snprintf(error, len, "out of memory");
+            ok = false;
+            continue;
+        }
+        journal.done = done;
+        journal.ndone++;
+    }
+    free(line);
+    fclose(file);
+    return ok;
+}
+
+bool journal_open(const char* path, bool resume, char* error, size_t len) {
+    const int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        snprintf(error, len, "%s", strerror(errno));
+        return false;
+    }
+    // Two sweeps writing the same journal would each skip what the other did
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        snprintf(error, len, "%s", errno == EWOULDBLOCK ? "in use by another wdled" : strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    struct stat st;
+    char last = '\n';
+    if (fstat(fd, &st) != 0 || (st.st_size && pread(fd, &last, 1, st.st_size - 1) != 1)) {
+        snprintf(error, len, "%s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (st.st_size && !journal_read(fd, resume, error, len)) {
+        close(fd);
+        return false;
+    }
+    // Start a new journal, or finish off a line a crash cut short so the next one starts cleanly
+    const char* const start = !st.st_size ? JOURNAL_MAGIC "\n" : last != '\n' ? "\n" : "";
+    if (*start && (write(fd, start, strlen(start)) != (ssize_t)strlen(start) || fdatasync(fd) != 0)) {
+        snprintf(error, len, "%s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    journal.fd = fd;
+    return true;
+}
+
+bool journal_done(const char* device, const struct request* request) {
+    char key[PATH_MAX + 64];
+    if (!journal.ndone || !journal_key(device, request, key, sizeof(key))) {
+        return false;
+    }
+    for (size_t i = 0; i < journal.ndone; i++) {
+        if (!strcmp(journal.done[i], key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void journal_record(const char* device, const struct request* request, const char* action, bool done) {
+    if (journal.fd < 0) {
+        return;
+    }
+    char key[PATH_MAX + 64];
+    if (!journal_key(device, request, key, sizeof(key))) {
+        snprintf(key, sizeof(key), "serial=- revision=- value=%d save=%d", request->new,
+                 request->new >= 0 && request->save);
+    }
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s", device);
+    sanitize(name);
+
+    // One write per line, so lines from different threads never interleave
+    char line[sizeof(key) + sizeof(name) + 64];
+    const int n = snprintf(line, sizeof(line), "%s action=%s done=%d device=%s\n", key, action, done, name);
+    if (n > 0 && (size_t)n < sizeof(line) && write(journal.fd, line, n) == n) {
+        fdatasync(journal.fd);
+    }
+}
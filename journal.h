@@ -0,0 +1,33 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "device.h"
+
+// An append-only record of what happened to each device in a sweep, one line per device:
+//
+//   wdled-journal 1
+//   serial=WXA1A12345678 revision=4004 value=0 save=1 action=saved done=1 device=/dev/sdb
+//
+// Each line is synced to disk before the next device's outcome is reported, so after a crash the journal
+// says which devices were finished. A line cut short by a crash is ignored.
+// Devices are keyed by unit serial number and firmware revision (simulated devices by name), so a device
+// is only taken as done if it's the same disk, on the same firmware, and was given the same value
+
+// Open a journal, creating it if needed. With resume, first read which devices it records as done.
+// Returns false with a message in error on failure
+bool journal_open(const char* path, bool resume, char* error, size_t len);
+
+// Check whether the journal being resumed records a device as done with the same request
+bool journal_done(const char* device, const struct request* request);
+
+// Append the outcome of a device (action being its name as in --json) to the journal
+void journal_record(const char* device, const struct request* request, const char* action, bool done);
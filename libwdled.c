@@ -0,0 +1,126 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "device.h"
+#include "libwdled.h"
+#include "sgio.h"
+#include "sim.h"
+#include "transport.h"
+
+_Static_assert(WDLED_ERR_MODE_SELECT == (int)DEVICE_ERR_MODE_SELECT, "enum wdled_err must match enum device_err");
+_Static_assert(WDLED_ERR_DEADLINE == (int)DEVICE_ERR_DEADLINE, "enum wdled_err must match enum device_err");
+_Static_assert(WDLED_ORIGINAL == PC_MASK(PC_DEFAULT) && WDLED_SAVED == PC_MASK(PC_SAVED), "WDLED_* must match PC_MASK()");
+
+// Carry out a plan, returning its error
+static enum wdled_err run(struct wdled* wdled, const struct request* request, const struct plan* plan,
+                          struct result* result) {
+    if (!wdled->transport) {
+        return WDLED_ERR_INVALID;
+    }
+    transport_run(wdled->transport, wdled->handle, request, plan, result);
+    wdled->detail = result->detail;
+    return (enum wdled_err)result->err;
+}
+
+enum wdled_err wdled_open(struct wdled* wdled, const char* path, bool read_only) {
+    memset(wdled, 0, sizeof(*wdled));
+    // Not transport_for(), which the CLI can point elsewhere
+    const struct transport* const transport = !strncmp(path, SIM_PREFIX, strlen(SIM_PREFIX)) ? &sim_transport : &sgio_transport;
+    const int handle = transport->open(path, read_only);
+    if (handle < 0) {
+        wdled->detail = handle;
+        return WDLED_ERR_OPEN;
+    }
+    wdled->transport = transport;
+    wdled->handle = handle;
+    wdled->read_only = read_only;
+    return WDLED_OK;
+}
+
+enum wdled_err wdled_identify(struct wdled* wdled, bool force) {
+    const struct request request = { .force = force, .new = -1, .timeout_ms = wdled->timeout_ms };
+    const struct plan plan = { .inquiry = true };
+    struct result result = {};
+    const enum wdled_err err = run(wdled, &request, &plan, &result);
+    // With no pages read the page checks fail on the empty current page, so only the identity counts here
+    if (!result.identified) {
+        return err;
+    }
+    memcpy(wdled->vendor, result.identity.vendor, sizeof(wdled->vendor));
+    memcpy(wdled->product, result.identity.product, sizeof(wdled->product));
+    memcpy(wdled->revision, result.identity.revision, sizeof(wdled->revision));
+    wdled->identified = force || result.support == DEVICE_OK;
+    wdled->forced = force;
+    return (enum wdled_err)result.support;
+}
+
+enum wdled_err wdled_get(struct wdled* wdled, unsigned which, struct wdled_values* values) {
+    memset(values, 0, sizeof(*values));
+    if (!wdled->identified || !which || (which & ~(WDLED_CURRENT | WDLED_ORIGINAL | WDLED_SAVED))) {
+        return WDLED_ERR_INVALID;
+    }
+    // The current page is always read, as the others are checked against it
+    const struct request request = { .force = wdled->forced, .new = -1, .timeout_ms = wdled->timeout_ms };
+    struct plan plan = device_plan(&request);
+    plan.inquiry = false;
+    plan.page_controls = (plan.page_controls & PC_MASK(PC_CHANGEABLE)) | WDLED_CURRENT | which;
+    struct result result = {};
+    const enum wdled_err err = run(wdled, &request, &plan, &result);
+    if (err == WDLED_OK) {
+        values->read = result.pages & (WDLED_CURRENT | WDLED_ORIGINAL | WDLED_SAVED);
+        values->current = result.current.wd21.led;
+        values->original = result.original.wd21.led;
+        values->saved = result.saved.wd21.led;
+    }
+    return err;
+}
+
+enum wdled_err wdled_set(struct wdled* wdled, uint8_t value, bool save, bool* unchanged) {
+    if (unchanged) {
+        *unchanged = false;
+    }
+    if (!wdled->identified || wdled->read_only) {
+        return WDLED_ERR_INVALID;
+    }
+    const struct request request = { .force = wdled->forced, .save = save, .new = value, .timeout_ms = wdled->timeout_ms };
+    struct plan plan = device_plan(&request);
+    plan.inquiry = false;
+    struct result result = {};
+    const enum wdled_err err = run(wdled, &request, &plan, &result);
+    if (unchanged) {
+        *unchanged = err == WDLED_OK && result.unchanged;
+    }
+    return err;
+}
+
+void wdled_close(struct wdled* wdled) {
+    if (wdled->transport) {
+        wdled->transport->close(wdled->handle);
+    }
+    memset(wdled, 0, sizeof(*wdled));
+}
+
+const char* wdled_strerror(enum wdled_err err) {
+    switch (err) {
+    case WDLED_OK:                 return "Success";
+    case WDLED_ERR_OPEN:           return "Failed to open";
+    case WDLED_ERR_INQUIRY:        return "Inquiry failed";
+    case WDLED_ERR_VENDOR:         return "Unknown or unsupported vendor";
+    case WDLED_ERR_PRODUCT:        return "Unknown or unsupported product";
+    case WDLED_ERR_MODE_SENSE:     return "Get mode page failed";
+    case WDLED_ERR_PAGE_CODE:      return "Unexpected mode page id";
+    case WDLED_ERR_PAGE_LEN:       return "Unexpected mode page length";
+    case WDLED_ERR_PAGE_MAGIC:     return "Unexpected mode page magic";
+    case WDLED_ERR_NOT_CHANGEABLE: return "LED bits don't appear changeable";
+    case WDLED_ERR_MODE_SELECT:    return "Set mode page failed";
+    case WDLED_ERR_DEADLINE:       return "Timed out";
+    case WDLED_ERR_INVALID:        return "Invalid argument";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,84 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// libwdled: the core of wdled as a library, for controlling disks in-process.
+// Every call is reentrant: all state lives in the caller's struct wdled, nothing is allocated,
+// and nothing is printed. Calls block until the disk answers (or the timeout expires).
+// The one exception is simulated disks (sim:NAME), which are shared by the whole process:
+// each is allocated the first time it's opened, and lasts until the process exits.
+// A struct wdled must only be used by one thread at a time.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Only the functions here are exported from libwdled.so
+#define WDLED_API __attribute__((visibility("default")))
+
+// Errors returned by every call, with more detail in wdled.detail
+enum wdled_err {
+    WDLED_OK = 0,
+    WDLED_ERR_OPEN,           // detail: -errno
+    WDLED_ERR_INQUIRY,        // detail: SCSI category
+    WDLED_ERR_VENDOR,         // The disk isn't from a supported vendor
+    WDLED_ERR_PRODUCT,        // The disk isn't a supported product
+    WDLED_ERR_MODE_SENSE,     // detail: SCSI category
+    WDLED_ERR_PAGE_CODE,      // detail: page code
+    WDLED_ERR_PAGE_LEN,       // detail: page length
+    WDLED_ERR_PAGE_MAGIC,     // detail: page magic
+    WDLED_ERR_NOT_CHANGEABLE, // detail: changeable LED bits
+    WDLED_ERR_MODE_SELECT,    // detail: SCSI category
+    WDLED_ERR_DEADLINE,       // Not returned, as the library has no deadlines
+    WDLED_ERR_INVALID,        // Bad arguments, or the disk isn't open or identified
+};
+
+struct transport;
+
+// Which LED values to read
+#define WDLED_CURRENT  (1 << 0) // What the LED is doing now
+#define WDLED_ORIGINAL (1 << 2) // The factory default
+#define WDLED_SAVED    (1 << 3) // What the disk will use after a power cycle
+
+struct wdled_values {
+    unsigned read; // WDLED_* flags of the values that were read
+    uint8_t current, original, saved; // 0x00 = off, 0xff = on
+};
+
+// An open disk. Treat it as opaque, apart from the fields documented as results
+struct wdled {
+    const struct transport* transport;
+    int handle;
+    unsigned timeout_ms; // Timeout for each command, 0 for the default (60 seconds)
+    bool read_only;
+    bool identified;     // wdled_identify has succeeded
+    bool forced;         // ...or was told to accept an unsupported disk
+
+    // Results
+    int detail;          // More about the last error, see enum wdled_err
+    char vendor[9], product[17], revision[5]; // From wdled_identify
+};
+
+// Open a disk (e.g /dev/sdb, /dev/sg2, a /dev/disk/by-id link, or sim:NAME for a simulated one)
+WDLED_API enum wdled_err wdled_open(struct wdled* wdled, const char* path, bool read_only);
+
+// Read the disk's vendor, product and revision, and check it's supported. This must succeed before
+// reading or setting values. With force, unsupported disks are accepted, though the error is still returned
+WDLED_API enum wdled_err wdled_identify(struct wdled* wdled, bool force);
+
+// Read the LED values given by `which` (WDLED_* flags)
+WDLED_API enum wdled_err wdled_get(struct wdled* wdled, unsigned which, struct wdled_values* values);
+
+// Set the LED mode, having the disk remember it if save is set. Nothing is written if the disk already has
+// that mode, in which case unchanged (if not NULL) is set
+WDLED_API enum wdled_err wdled_set(struct wdled* wdled, uint8_t value, bool save, bool* unchanged);
+
+WDLED_API void wdled_close(struct wdled* wdled);
+
+// Describe an error, e.g "Get mode page failed"
+WDLED_API const char* wdled_strerror(enum wdled_err err);
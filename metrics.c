@@ -0,0 +1,272 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "metrics.h"
+#include "scsi.h"
+
+#define ERR_COUNT (DEVICE_ERR_DEADLINE + 1)
+
+// The SCSI categories commands are counted by, anything else counting as SCSI_CAT_OTHER
+static const int cats[] = {
+    SCSI_CAT_CLEAN, SCSI_CAT_NOT_READY, SCSI_CAT_MEDIUM_HARD, SCSI_CAT_ILLEGAL_REQ, SCSI_CAT_UNIT_ATTENTION,
+    SCSI_CAT_INVALID_OP, SCSI_CAT_ABORTED_COMMAND, SCSI_CAT_TIMEOUT, SCSI_CAT_SENSE, SCSI_CAT_OTHER,
+};
+#define CAT_COUNT (sizeof(cats) / sizeof(cats[0]))
+
+// Latency histogram bucket upper bounds, from a quick USB bridge to one that's about to time out
+static const uint64_t buckets_us[] = { 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+                                       1000000, 2500000, 5000000, 10000000 };
+#define BUCKET_COUNT (sizeof(buckets_us) / sizeof(buckets_us[0]))
+
+struct histogram {
+    unsigned long long buckets[BUCKET_COUNT]; // Not cumulative, that's done when they're written
+    unsigned long long count;
+    uint64_t sum_us;
+};
+
+struct metrics_device {
+    char* path;
+    int current;  // -1 if it hasn't been seen
+    int expected; // -1 if there's nothing it should be
+    unsigned long long errors[ERR_COUNT];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    const char* path; // NULL until metrics_open()
+    bool dirty;
+    unsigned long long commands[COMMAND_COUNT][CAT_COUNT];
+    struct histogram latency[COMMAND_COUNT];
+    struct metrics_device* devices;
+    size_t ndevices;
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void metrics_open(const char* path) {
+    metrics.path = path;
+    metrics.dirty = true;
+}
+
+void metrics_command(enum phase phase, int status, uint64_t us) {
+    if (!metrics.path) {
+        return;
+    }
+    const enum command command = device_phase_command(phase);
+    if (command == COMMAND_NONE) {
+        return;
+    }
+    size_t cat = CAT_COUNT - 1;
+    for (size_t i = 0; i < CAT_COUNT; i++) {
+        if (cats[i] == status) {
+            cat = i;
+        }
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    metrics.commands[command][cat]++;
+    struct histogram* const histogram = &metrics.latency[command];
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        if (us <= buckets_us[i]) {
+            histogram->buckets[i]++;
+            break;
+        }
+    }
+    histogram->count++;
+    histogram->sum_us += us;
+    metrics.dirty = true;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+// Find a device, adding it if it's new. Call with the lock held
+static struct metrics_device* find_device(const char* path) {
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        if (!strcmp(metrics.devices[i].path, path)) {
+            return &metrics.devices[i];
+        }
+    }
+    struct metrics_device* const devices = realloc(metrics.devices, (metrics.ndevices + 1) * sizeof(*devices));
+    if (!devices) {
+        return NULL;
+    }
+    metrics.devices = devices;
+    struct metrics_device* const device = &devices[metrics.ndevices];
+    *device = (struct metrics_device){ .path = strdup(path), .current = -1, .expected = -1 };
+    if (!device->path) {
+        return NULL;
+    }
+    metrics.ndevices++;
+    return device;
+}
+
+void metrics_led(const char* device, int current, int expected) {
+    if (!metrics.path) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    struct metrics_device* const entry = find_device(device);
+    if (entry && (entry->current != current || entry->expected != expected)) {
+        entry->current = current;
+        entry->expected = expected;
+        metrics.dirty = true;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void metrics_error(const char* device, enum device_err err) {
+    if (!metrics.path || err == DEVICE_OK) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    struct metrics_device* const entry = find_device(device);
+    if (entry) {
+        entry->errors[err]++;
+        metrics.dirty = true;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void metrics_forget(const char* device) {
+    if (!metrics.path) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        if (!strcmp(metrics.devices[i].path, device)) {
+            free(metrics.devices[i].path);
+            metrics.devices[i] = metrics.devices[--metrics.ndevices];
+            metrics.dirty = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+// Write a device label value, escaped as the text format requires
+static void write_label(FILE* file, const char* value) {
+    for (const char* c = value; *c; c++) {
+        if (*c == '\\' || *c == '"') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c == '\n') {
+            fprintf(file, "\\n");
+        } else {
+            fputc(*c, file);
+        }
+    }
+}
+
+static void write_metrics(FILE* file) {
+    fprintf(file, "# HELP wdled_led_mode LED mode each disk was last seen with (0 off, 255 on).\n");
+    fprintf(file, "# TYPE wdled_led_mode gauge\n");
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        if (metrics.devices[i].current >= 0) {
+            fprintf(file, "wdled_led_mode{device=\"");
+            write_label(file, metrics.devices[i].path);
+            fprintf(file, "\"} %d\n", metrics.devices[i].current);
+        }
+    }
+    fprintf(file, "# HELP wdled_led_expected LED mode each disk should have, from its VALUE or policy.\n");
+    fprintf(file, "# TYPE wdled_led_expected gauge\n");
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        if (metrics.devices[i].expected >= 0) {
+            fprintf(file, "wdled_led_expected{device=\"");
+            write_label(file, metrics.devices[i].path);
+            fprintf(file, "\"} %d\n", metrics.devices[i].expected);
+        }
+    }
+    fprintf(file, "# HELP wdled_led_drift Whether each disk's LED mode differs from the mode it should have.\n");
+    fprintf(file, "# TYPE wdled_led_drift gauge\n");
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        const struct metrics_device* const device = &metrics.devices[i];
+        if (device->current >= 0 && device->expected >= 0) {
+            fprintf(file, "wdled_led_drift{device=\"");
+            write_label(file, device->path);
+            fprintf(file, "\"} %d\n", device->current != device->expected);
+        }
+    }
+
+    fprintf(file, "# HELP wdled_device_errors_total Failed operations on each disk, by error.\n");
+    fprintf(file, "# TYPE wdled_device_errors_total counter\n");
+    for (size_t i = 0; i < metrics.ndevices; i++) {
+        for (int err = DEVICE_OK + 1; err < ERR_COUNT; err++) {
+            if (metrics.devices[i].errors[err]) {
+                fprintf(file, "wdled_device_errors_total{device=\"");
+                write_label(file, metrics.devices[i].path);
+                fprintf(file, "\",error=\"%s\"} %llu\n", device_err_name(err), metrics.devices[i].errors[err]);
+            }
+        }
+    }
+
+    fprintf(file, "# HELP wdled_scsi_commands_total SCSI commands completed, by command and result.\n");
+    fprintf(file, "# TYPE wdled_scsi_commands_total counter\n");
+    for (enum command command = 0; command < COMMAND_COUNT; command++) {
+        for (size_t cat = 0; cat < CAT_COUNT; cat++) {
+            if (metrics.commands[command][cat]) {
+                fprintf(file, "wdled_scsi_commands_total{command=\"%s\",result=\"%s\"} %llu\n",
+                        device_command_name(command), scsi_cat_name(cats[cat]), metrics.commands[command][cat]);
+            }
+        }
+    }
+
+    fprintf(file, "# HELP wdled_scsi_command_duration_seconds Latency of SCSI commands, by command.\n");
+    fprintf(file, "# TYPE wdled_scsi_command_duration_seconds histogram\n");
+    for (enum command command = 0; command < COMMAND_COUNT; command++) {
+        const struct histogram* const histogram = &metrics.latency[command];
+        unsigned long long cumulative = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            cumulative += histogram->buckets[i];
+            fprintf(file, "wdled_scsi_command_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n",
+                    device_command_name(command), buckets_us[i] / 1e6, cumulative);
+        }
+        fprintf(file, "wdled_scsi_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n",
+                device_command_name(command), histogram->count);
+        fprintf(file, "wdled_scsi_command_duration_seconds_sum{command=\"%s\"} %.6f\n",
+                device_command_name(command), histogram->sum_us / 1e6);
+        fprintf(file, "wdled_scsi_command_duration_seconds_count{command=\"%s\"} %llu\n",
+                device_command_name(command), histogram->count);
+    }
+}
+
+void metrics_flush(void) {
+    if (!metrics.path) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.lock);
+    if (!metrics.dirty) {
+        pthread_mutex_unlock(&metrics.lock);
+        return;
+    }
+
+    // Write to a temporary file and rename it into place, so the collector never reads a partial file
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", metrics.path);
+    const int fd = mkstemp(tmp_path);
+    FILE* const file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        pthread_mutex_unlock(&metrics.lock);
+        return;
+    }
+    write_metrics(file);
+    fchmod(fd, 0644);
+    if (fclose(file) != 0 || rename(tmp_path, metrics.path) != 0) {
+        unlink(tmp_path);
+    } else {
+        metrics.dirty = false;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
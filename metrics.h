@@ -0,0 +1,34 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "device.h"
+
+// Metrics in the Prometheus text format, written to a file for node_exporter's textfile collector.
+// Nothing is recorded until metrics_open() has been called, so the other calls cost next to nothing without it
+
+// Start recording metrics, to be written to path
+void metrics_open(const char* path);
+
+// Count a SCSI command that completed (phase being its PHASE_*), with its SCSI category and latency
+void metrics_command(enum phase phase, int status, uint64_t us);
+
+// Record the LED mode a device was last seen with, and the mode it should have (or -1 if it has none)
+void metrics_led(const char* device, int current, int expected);
+
+// Count a failed operation on a device
+void metrics_error(const char* device, enum device_err err);
+
+// Drop a device that has gone away
+void metrics_forget(const char* device);
+
+// Write out the metrics if they've changed since they were last written
+void metrics_flush(void);
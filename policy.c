@@ -0,0 +1,347 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "policy.h"
+#include "sysfs.h"
+
+#define NO_RULE SIZE_MAX
+
+// Rules with exact selectors live in a hash table, keyed on kind and selector
+struct hash_slot {
+    enum policy_kind kind;
+    const char* key; // NULL if the slot is empty
+    size_t rule;     // Index of the first rule with this selector
+};
+
+// Rules with glob selectors live in a trie of their literal prefix (up to the first wildcard),
+// so a lookup only has to try the patterns whose prefix matches the string
+struct trie {
+    char c;
+    struct trie* child;
+    struct trie* sibling;
+    size_t* rules; // Indices of the rules whose prefix ends here, in file order
+    size_t nrules;
+};
+
+struct policy {
+    struct policy_rule* rules;
+    size_t nrules;
+    struct hash_slot* table;
+    size_t table_size; // Power of two
+    struct trie* tries[POLICY_KINDS];
+    size_t any; // First rule matching every device
+};
+
+static const char* const kind_prefixes[POLICY_KINDS] = {
+    [POLICY_SERIAL] = "serial:",
+    [POLICY_ID] = "id:",
+    [POLICY_MODEL] = "model:",
+    [POLICY_VENDOR] = "vendor:",
+    [POLICY_USB] = "usb:",
+};
+
+// FNV-1a
+static size_t hash(enum policy_kind kind, const char* key) {
+    uint64_t h = 0xcbf29ce484222325ull ^ kind;
+    for (; *key; key++) {
+        h = (h ^ (uint8_t)*key) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static struct hash_slot* hash_find(const struct policy* policy, enum policy_kind kind, const char* key) {
+    const size_t mask = policy->table_size - 1;
+    for (size_t i = hash(kind, key) & mask;; i = (i + 1) & mask) {
+        struct hash_slot* const slot = &policy->table[i];
+        if (!slot->key || (slot->kind == kind && !strcmp(slot->key, key))) {
+            return slot;
+        }
+    }
+}
+
+static bool trie_insert(struct trie* node, const char* prefix, size_t prefix_len, size_t rule) {
+    for (size_t i = 0; i < prefix_len; i++) {
+        struct trie* child = node->child;
+        while (child && child->c != prefix[i]) {
+            child = child->sibling;
+        }
+        if (!child) {
+            if (!(child = calloc(1, sizeof(*child)))) {
+                return false;
+            }
+            child->c = prefix[i];
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    size_t* const rules = realloc(node->rules, (node->nrules + 1) * sizeof(*rules));
+    if (!rules) {
+        return false;
+    }
+    node->rules = rules;
+    node->rules[node->nrules++] = rule;
+    return true;
+}
+
+static void trie_free(struct trie* node) {
+    while (node) {
+        struct trie* const sibling = node->sibling;
+        trie_free(node->child);
+        free(node->rules);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Find the first glob rule matching str, only considering rules before `best`
+static size_t trie_lookup(const struct policy* policy, const struct trie* node, const char* str, size_t best) {
+    for (const char* c = str;; c++) {
+        // Rules are in file order, so only the first match at each node matters
+        for (size_t i = 0; i < node->nrules && node->rules[i] < best; i++) {
+            if (fnmatch(policy->rules[node->rules[i]].pattern, str, 0) == 0) {
+                best = node->rules[i];
+                break;
+            }
+        }
+        if (!*c) {
+            return best;
+        }
+        const struct trie* child = node->child;
+        while (child && child->c != *c) {
+            child = child->sibling;
+        }
+        if (!child) {
+            return best;
+        }
+        node = child;
+    }
+}
+
+static size_t lookup_string(const struct policy* policy, enum policy_kind kind, const char* str, size_t best) {
+    if (!str || !*str) {
+        return best;
+    }
+    const struct hash_slot* const slot = hash_find(policy, kind, str);
+    if (slot->key && slot->rule < best) {
+        best = slot->rule;
+    }
+    if (policy->tries[kind]) {
+        best = trie_lookup(policy, policy->tries[kind], str, best);
+    }
+    return best;
+}
+
+const struct policy_rule* policy_lookup(const struct policy* policy, const struct policy_device* device) {
+    size_t best = policy->any;
+    best = lookup_string(policy, POLICY_SERIAL, device->serial, best);
+    best = lookup_string(policy, POLICY_MODEL, device->model, best);
+    best = lookup_string(policy, POLICY_VENDOR, device->vendor, best);
+    best = lookup_string(policy, POLICY_USB, device->usb, best);
+    for (size_t i = 0; i < device->nids; i++) {
+        best = lookup_string(policy, POLICY_ID, device->ids[i], best);
+    }
+    return best == NO_RULE ? NULL : &policy->rules[best];
+}
+
+const struct policy_rule* policy_lookup_node(const struct policy* policy, const char* node,
+                                             const char* const* ids, size_t nids) {
+    char dir[PATH_MAX], serial[64] = "", port[64] = "";
+    struct identity identity = {};
+    if (sysfs_device_dir(node, dir, sizeof(dir)) == 0) {
+        sysfs_identity(dir, &identity);
+        sysfs_serial(dir, serial, sizeof(serial));
+        sysfs_usb_port(dir, port, sizeof(port));
+    }
+    // Vendors and products are space padded
+    for (size_t len = strlen(identity.product); len > 0 && identity.product[len - 1] == ' ';) {
+        identity.product[--len] = '\0';
+    }
+    for (size_t len = strlen(identity.vendor); len > 0 && identity.vendor[len - 1] == ' ';) {
+        identity.vendor[--len] = '\0';
+    }
+    const struct policy_device device = {
+        .serial = serial,
+        .model = identity.product,
+        .vendor = identity.vendor,
+        .usb = port,
+        .ids = ids,
+        .nids = nids,
+    };
+    return policy_lookup(policy, &device);
+}
+
+// Parse one non-empty line into a rule
+static bool parse_rule(char* line, struct policy_rule* rule, char* error, size_t len) {
+    // The value is the last word, everything before it is the selector
+    char* end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    char* value = end;
+    while (value > line && !isspace((unsigned char)value[-1])) {
+        value--;
+    }
+    char* selector_end = value;
+    while (selector_end > line && isspace((unsigned char)selector_end[-1])) {
+        *--selector_end = '\0';
+    }
+    if (selector_end == line) {
+        snprintf(error, len, "expected SELECTOR VALUE");
+        return false;
+    }
+
+    rule->request = (struct request){ .new = -1 };
+    if (!device_parse_value(value, &rule->request) || rule->request.new < 0 || rule->request.force) {
+        snprintf(error, len, "invalid value '%s'", value);
+        return false;
+    }
+
+    const char* pattern = NULL;
+    if (!strcmp(line, "*")) {
+        rule->any = true;
+        pattern = line;
+    }
+    for (int kind = 0; kind < POLICY_KINDS && !pattern; kind++) {
+        const size_t prefix_len = strlen(kind_prefixes[kind]);
+        if (!strncmp(line, kind_prefixes[kind], prefix_len) && line[prefix_len]) {
+            rule->kind = kind;
+            pattern = line + prefix_len;
+        }
+    }
+    if (!pattern) {
+        snprintf(error, len, "invalid selector '%s'", line);
+        return false;
+    }
+    if (!(rule->pattern = strdup(pattern))) {
+        snprintf(error, len, "out of memory");
+        return false;
+    }
+    return true;
+}
+
+// Build the hash table and tries for the loaded rules
+static bool policy_compile(struct policy* policy) {
+    policy->any = NO_RULE;
+    policy->table_size = 16;
+    while (policy->table_size < policy->nrules * 2) {
+        policy->table_size *= 2;
+    }
+    if (!(policy->table = calloc(policy->table_size, sizeof(*policy->table)))) {
+        return false;
+    }
+
+    for (size_t i = 0; i < policy->nrules; i++) {
+        const struct policy_rule* const rule = &policy->rules[i];
+        if (rule->any) {
+            if (policy->any == NO_RULE) {
+                policy->any = i;
+            }
+            continue;
+        }
+        const size_t literal_len = strcspn(rule->pattern, "*?[\\");
+        if (!rule->pattern[literal_len]) {
+            struct hash_slot* const slot = hash_find(policy, rule->kind, rule->pattern);
+            if (!slot->key) {
+                *slot = (struct hash_slot){ .kind = rule->kind, .key = rule->pattern, .rule = i };
+            }
+            continue;
+        }
+        if (!policy->tries[rule->kind] && !(policy->tries[rule->kind] = calloc(1, sizeof(struct trie)))) {
+            return false;
+        }
+        if (!trie_insert(policy->tries[rule->kind], rule->pattern, literal_len, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct policy* policy_load(const char* path, char* error, size_t len) {
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        snprintf(error, len, "%s", strerror(errno));
+        return NULL;
+    }
+    struct policy* policy = calloc(1, sizeof(*policy));
+    size_t capacity = 0;
+    char* line = NULL;
+    size_t line_size = 0;
+    unsigned line_number = 0;
+    bool ok = policy != NULL;
+    if (!ok) {
+        snprintf(error, len, "out of memory");
+    }
+    while (ok && getline(&line, &line_size, file) >= 0) {
+        line_number++;
+        char* start = line;
+        while (isspace((unsigned char)*start)) {
+            start++;
+        }
+        if (!*start || *start == '#') {
+            continue;
+        }
+        if (policy->nrules == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct policy_rule* const rules = realloc(policy->rules, capacity * sizeof(*rules));
+            if (!rules) {
+                snprintf(error, len, "out of memory");
+                ok = false;
+                break;
+            }
+            policy->rules = rules;
+        }
+        struct policy_rule* const rule = &policy->rules[policy->nrules];
+        memset(rule, 0, sizeof(*rule));
+        rule->line = line_number;
+        char rule_error[128];
+        if (!parse_rule(start, rule, rule_error, sizeof(rule_error))) {
+            snprintf(error, len, "line %u: %s", line_number, rule_error);
+            free(rule->pattern);
+            ok = false;
+            break;
+        }
+        policy->nrules++;
+    }
+    free(line);
+    fclose(file);
+
+    if (ok && !policy_compile(policy)) {
+        snprintf(error, len, "out of memory");
+        ok = false;
+    }
+    if (!ok) {
+        policy_free(policy);
+        return NULL;
+    }
+    return policy;
+}
+
+void policy_free(struct policy* policy) {
+    if (!policy) {
+        return;
+    }
+    for (size_t i = 0; i < policy->nrules; i++) {
+        free(policy->rules[i].pattern);
+    }
+    for (int kind = 0; kind < POLICY_KINDS; kind++) {
+        trie_free(policy->tries[kind]);
+    }
+    free(policy->rules);
+    free(policy->table);
+    free(policy);
+}
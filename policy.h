@@ -0,0 +1,67 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "device.h"
+
+// A policy file maps device selectors to LED modes, one rule per line:
+//
+//   # SELECTOR                       VALUE
+//   serial:WXA1A12345678             save:off
+//   id:usb-WD_My_Passport_25E2_*     off
+//   model:My Passport 259?           on
+//   vendor:WD                        off
+//   usb:2-1.4                        off
+//   *                                on
+//
+// The VALUE is the last word on the line, the selector is everything before it.
+// Selectors may use shell glob patterns, and the first matching rule in the file wins.
+
+enum policy_kind {
+    POLICY_SERIAL, // Unit serial number
+    POLICY_ID,     // Name in /dev/disk/by-id
+    POLICY_MODEL,  // INQUIRY product, without padding
+    POLICY_VENDOR, // INQUIRY vendor, without padding
+    POLICY_USB,    // USB port path
+    POLICY_KINDS,
+};
+
+struct policy_rule {
+    enum policy_kind kind;
+    bool any;          // Matches every device ("*")
+    char* pattern;
+    struct request request;
+    unsigned line;
+};
+
+// Everything a device can be matched on, any of which may be NULL (or empty)
+struct policy_device {
+    const char* serial;
+    const char* model;
+    const char* vendor;
+    const char* usb;
+    const char* const* ids;
+    size_t nids;
+};
+
+struct policy;
+
+// Load and compile a policy file, on failure returns NULL and describes the problem in error
+struct policy* policy_load(const char* path, char* error, size_t len);
+
+void policy_free(struct policy* policy);
+
+// Find the first rule that matches a device, or NULL if none do
+const struct policy_rule* policy_lookup(const struct policy* policy, const struct policy_device* device);
+
+// Find the first rule that matches a device node, using what the kernel knows about it from sysfs
+// and any names it has in /dev/disk/by-id
+const struct policy_rule* policy_lookup_node(const struct policy* policy, const char* node,
+                                             const char* const* ids, size_t nids);
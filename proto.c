@@ -0,0 +1,76 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "proto.h"
+
+int proto_connect(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+int proto_transact(int fd, const char* request, char* response, size_t len) {
+    char line[PROTO_LINE_MAX];
+    const int line_len = snprintf(line, sizeof(line), "%s\n", request);
+    if (line_len < 0 || (size_t)line_len >= sizeof(line)) {
+        return -EMSGSIZE;
+    }
+    for (int sent = 0; sent < line_len;) {
+        const ssize_t result = send(fd, line + sent, line_len - sent, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        sent += result;
+    }
+
+    // Responses are a single line, and we only have one request outstanding at a time
+    size_t received = 0;
+    while (received + 1 < len) {
+        const ssize_t result = recv(fd, response + received, len - 1 - received, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -ECONNRESET;
+        }
+        received += result;
+        response[received] = '\0';
+        char* newline = strchr(response, '\n');
+        if (newline) {
+            *newline = '\0';
+            return 0;
+        }
+    }
+    return -EMSGSIZE;
+}
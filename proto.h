@@ -0,0 +1,34 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// wdledd speaks a simple line based protocol over a Unix stream socket.
+// Each request line gets exactly one response line:
+//   GET DEVICE        -> OK current=N original=N saved=N
+//   GET DEVICE MAX_AGE -> the same, from the daemon's copy if it's from the last MAX_AGE seconds
+//   SET DEVICE VALUE  -> OK current=N original=N saved=N   (values from before the set)
+//   PING              -> OK wdledd VERSION
+// Failures are reported as "ERR message". DEVICE must be an absolute path.
+// The values may be followed by "unchanged" (the SET didn't need to write anything) and "cached"
+// (the disk was asleep, or the copy was fresh enough, so the values came from the cache), and a SET for a sleeping disk
+// may be answered with just "OK deferred".
+
+#ifndef DAEMON_SOCKET
+#define DAEMON_SOCKET "/run/wdled/wdled.sock"
+#endif
+#define PROTO_LINE_MAX 1024
+
+// Connect to the daemon, returns a socket or -errno
+int proto_connect(const char* path);
+
+// Send one request line (without newline) and read back one response line (without newline)
+// Returns 0, or -errno if the daemon couldn't be reached
+int proto_transact(int fd, const char* request, char* response, size_t len);
@@ -0,0 +1,167 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sched.h"
+#include "sysfs.h"
+
+#define NO_GROUP SIZE_MAX
+
+// A hub (or USB bus), and the devices on it in the order they were given
+struct group {
+    char name[64];  // USB port path of the hub (e.g 2-1), or of the bus (e.g 2)
+    size_t bus;     // Index of the bus group a hub is on, NO_GROUP for buses and the unlimited group
+    size_t* devices;
+    size_t count;
+    size_t next;    // Next device to start
+    unsigned inflight;
+};
+
+struct sched {
+    struct group* groups;
+    size_t ngroups;
+    size_t* device_group; // Hub group of each device
+    size_t remaining;
+    size_t turn;          // Round robin position
+    unsigned per_hub;
+    unsigned per_bus;
+};
+
+// Find or add a group by name, returns its index or NO_GROUP if out of memory
+static size_t group_find(struct sched* sched, const char* name, size_t bus) {
+    for (size_t i = 0; i < sched->ngroups; i++) {
+        if (!strcmp(sched->groups[i].name, name) && sched->groups[i].bus == bus) {
+            return i;
+        }
+    }
+    struct group* const groups = realloc(sched->groups, (sched->ngroups + 1) * sizeof(*groups));
+    if (!groups) {
+        return NO_GROUP;
+    }
+    sched->groups = groups;
+    struct group* const group = &groups[sched->ngroups];
+    memset(group, 0, sizeof(*group));
+    snprintf(group->name, sizeof(group->name), "%s", name);
+    group->bus = bus;
+    return sched->ngroups++;
+}
+
+// Work out the bus and hub a device is connected to, e.g 2-1.4 is on port 4 of hub 2-1, on bus 2
+static bool topology(const char* path, char* bus, char* hub, size_t len) {
+    char dir[PATH_MAX], port[64];
+    if (sysfs_device_dir(path, dir, sizeof(dir)) != 0 || !sysfs_usb_port(dir, port, sizeof(port))) {
+        return false;
+    }
+    const size_t bus_len = strcspn(port, "-");
+    snprintf(bus, len, "%.*s", (int)bus_len, port);
+    char* const dot = strrchr(port, '.');
+    if (dot) {
+        *dot = '\0';
+        snprintf(hub, len, "%s", port);
+    } else {
+        // Plugged straight into the root hub
+        snprintf(hub, len, "%s-0", bus);
+    }
+    return true;
+}
+
+struct sched* sched_new(const char* const* paths, size_t count, unsigned per_hub, unsigned per_bus) {
+    struct sched* const sched = calloc(1, sizeof(*sched));
+    if (!sched) {
+        return NULL;
+    }
+    sched->per_hub = per_hub;
+    sched->per_bus = per_bus;
+    sched->remaining = count;
+    sched->device_group = calloc(count ? count : 1, sizeof(*sched->device_group));
+    bool ok = sched->device_group != NULL;
+
+    // Group 0 is every device that isn't limited
+    ok = ok && group_find(sched, "", NO_GROUP) == 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        char bus[64], hub[64];
+        size_t group = 0;
+        if (topology(paths[i], bus, hub, sizeof(bus))) {
+            const size_t bus_group = group_find(sched, bus, NO_GROUP);
+            group = bus_group == NO_GROUP ? NO_GROUP : group_find(sched, hub, bus_group);
+        }
+        ok = group != NO_GROUP;
+        if (ok) {
+            struct group* const g = &sched->groups[group];
+            size_t* const devices = realloc(g->devices, (g->count + 1) * sizeof(*devices));
+            ok = devices != NULL;
+            if (ok) {
+                g->devices = devices;
+                g->devices[g->count++] = i;
+                sched->device_group[i] = group;
+            }
+        }
+    }
+    if (!ok) {
+        sched_free(sched);
+        return NULL;
+    }
+    return sched;
+}
+
+void sched_free(struct sched* sched) {
+    for (size_t i = 0; i < sched->ngroups; i++) {
+        free(sched->groups[i].devices);
+    }
+    free(sched->groups);
+    free(sched->device_group);
+    free(sched);
+}
+
+// Check whether a group can start another device
+static bool group_ready(const struct sched* sched, size_t index) {
+    const struct group* const group = &sched->groups[index];
+    if (group->next >= group->count) {
+        return false;
+    }
+    if (index == 0) {
+        return true;
+    }
+    const struct group* const bus = &sched->groups[group->bus];
+    return (!sched->per_hub || group->inflight < sched->per_hub) && (!sched->per_bus || bus->inflight < sched->per_bus);
+}
+
+bool sched_next(struct sched* sched, size_t* index) {
+    for (size_t i = 0; i < sched->ngroups; i++) {
+        const size_t g = (sched->turn + i) % sched->ngroups;
+        if (!group_ready(sched, g)) {
+            continue;
+        }
+        struct group* const group = &sched->groups[g];
+        *index = group->devices[group->next++];
+        group->inflight++;
+        if (group->bus != NO_GROUP) {
+            sched->groups[group->bus].inflight++;
+        }
+        sched->remaining--;
+        sched->turn = g + 1;
+        return true;
+    }
+    return false;
+}
+
+bool sched_pending(const struct sched* sched) {
+    return sched->remaining > 0;
+}
+
+void sched_done(struct sched* sched, size_t index) {
+    struct group* const group = &sched->groups[sched->device_group[index]];
+    group->inflight--;
+    if (group->bus != NO_GROUP) {
+        sched->groups[group->bus].inflight--;
+    }
+}
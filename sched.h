@@ -0,0 +1,34 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SCHED_DEFAULT_PER_HUB 4  // Devices in progress at once behind one USB hub
+#define SCHED_DEFAULT_PER_BUS 16 // and on one USB bus (host controller)
+
+// Orders the devices of a batch by USB topology, so a dense hub or busy host controller only has
+// a few devices in progress at once, taking turns with the others. Not thread safe
+struct sched;
+
+// Group the devices by the hub and bus they're connected to, from sysfs. Devices that aren't on USB
+// (or are simulated) aren't limited. A limit of 0 is unlimited. Returns NULL if out of memory
+struct sched* sched_new(const char* const* paths, size_t count, unsigned per_hub, unsigned per_bus);
+void sched_free(struct sched* sched);
+
+// Pick the next device to start, taking hubs in turn. Returns false if none can start until another
+// finishes (or none are left)
+bool sched_next(struct sched* sched, size_t* index);
+
+// Check whether any devices haven't been started yet
+bool sched_pending(const struct sched* sched);
+
+// A device picked by sched_next has finished
+void sched_done(struct sched* sched, size_t index);
@@ -0,0 +1,190 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "scsi.h"
+
+#define REQUEST_SENSE  0x03
+#define INQUIRY        0x12
+#define MODE_SELECT10  0x55
+#define MODE_SENSE10   0x5a
+
+#define STATUS_CHECK_CONDITION 0x02
+#define DID_TIME_OUT           0x03
+#define DRIVER_TIMEOUT         0x06
+
+// Sense keys
+#define SK_NO_SENSE        0x0
+#define SK_RECOVERED_ERROR 0x1
+#define SK_NOT_READY       0x2
+#define SK_MEDIUM_ERROR    0x3
+#define SK_HARDWARE_ERROR  0x4
+#define SK_ILLEGAL_REQUEST 0x5
+#define SK_UNIT_ATTENTION  0x6
+#define SK_ABORTED_COMMAND 0xb
+
+// Additional sense codes
+#define ASC_INVALID_OPCODE  0x20
+#define ASC_LOW_POWER       0x5e
+
+// Pull the sense key and additional sense code out of fixed (0x70/0x71) or descriptor (0x72/0x73) format sense data
+static bool parse_sense(const uint8_t* sense, size_t sense_len, uint8_t* key, uint8_t* asc) {
+    if (sense_len < 3) {
+        return false;
+    }
+    const uint8_t response_code = sense[0] & 0x7f;
+    if (response_code >= 0x72) {
+        *key = sense[1] & 0x0f;
+        *asc = sense[2];
+    } else {
+        *key = sense[2] & 0x0f;
+        *asc = sense_len > 12 ? sense[12] : 0;
+    }
+    return true;
+}
+
+size_t scsi_request_sense_cdb(uint8_t* cdb, uint8_t alloc_len) {
+    memset(cdb, 0, 6);
+    cdb[0] = REQUEST_SENSE;
+    cdb[4] = alloc_len;
+    return 6;
+}
+
+size_t scsi_inquiry_cdb(uint8_t* cdb, uint16_t alloc_len) {
+    memset(cdb, 0, 6);
+    cdb[0] = INQUIRY;
+    cdb[3] = alloc_len >> 8;
+    cdb[4] = alloc_len & 0xff;
+    return 6;
+}
+
+size_t scsi_mode_sense10_cdb(uint8_t* cdb, int pc, int page_code, uint16_t alloc_len) {
+    memset(cdb, 0, 10);
+    cdb[0] = MODE_SENSE10;
+    cdb[1] = 0x08; // DBD: we never want block descriptors
+    cdb[2] = (pc << 6) | (page_code & 0x3f);
+    cdb[7] = alloc_len >> 8;
+    cdb[8] = alloc_len & 0xff;
+    return 10;
+}
+
+size_t scsi_mode_select10_cdb(uint8_t* cdb, bool save, uint16_t param_len) {
+    memset(cdb, 0, 10);
+    cdb[0] = MODE_SELECT10;
+    cdb[1] = 0x10 | (save ? 0x01 : 0x00); // PF, and SP if saving
+    cdb[7] = param_len >> 8;
+    cdb[8] = param_len & 0xff;
+    return 10;
+}
+
+// Copy a fixed width INQUIRY field, keeping the space padding like sg_simple_inquiry does
+static void copy_field(char* dst, const uint8_t* data, size_t len, size_t offset, size_t width) {
+    size_t i = 0;
+    for (; i < width && offset + i < len; i++) {
+        dst[i] = data[offset + i] ? data[offset + i] : ' ';
+    }
+    dst[i] = '\0';
+}
+
+void scsi_parse_inquiry(const uint8_t* data, size_t len, struct identity* identity) {
+    copy_field(identity->vendor, data, len, 8, sizeof(identity->vendor) - 1);
+    copy_field(identity->product, data, len, 16, sizeof(identity->product) - 1);
+    copy_field(identity->revision, data, len, 32, sizeof(identity->revision) - 1);
+}
+
+bool scsi_parse_mode_sense10(const uint8_t* data, size_t len, struct page* page) {
+    if (len < sizeof(struct mode_parameter_header)) {
+        return false;
+    }
+    const size_t bd_len = (data[6] << 8) | data[7];
+    const size_t offset = sizeof(struct mode_parameter_header) + bd_len;
+    if (offset + 2 > len) {
+        return false;
+    }
+    size_t page_len = 2 + data[offset + 1];
+    if (page_len > sizeof(*page)) {
+        page_len = sizeof(*page);
+    }
+    if (offset + page_len > len) {
+        page_len = len - offset;
+    }
+    memset(page, 0, sizeof(*page));
+    memcpy(page, data + offset, page_len);
+    return true;
+}
+
+bool scsi_sense_low_power(const uint8_t* sense, size_t sense_len) {
+    const uint8_t response_code = sense_len ? sense[0] & 0x7f : 0;
+    uint8_t key, asc;
+    return response_code >= 0x70 && response_code <= 0x73 && parse_sense(sense, sense_len, &key, &asc)
+        && asc == ASC_LOW_POWER;
+}
+
+enum scsi_cat scsi_categorize(int status, int host_status, int driver_status, const uint8_t* sense, size_t sense_len) {
+    if (host_status == DID_TIME_OUT || (driver_status & 0x0f) == DRIVER_TIMEOUT) {
+        return SCSI_CAT_TIMEOUT;
+    }
+    if (host_status != 0) {
+        return SCSI_CAT_OTHER;
+    }
+    if ((status & 0x7e) != STATUS_CHECK_CONDITION) {
+        return status ? SCSI_CAT_OTHER : SCSI_CAT_CLEAN;
+    }
+    uint8_t key, asc;
+    if (!parse_sense(sense, sense_len, &key, &asc)) {
+        return SCSI_CAT_SENSE;
+    }
+    switch (key) {
+    case SK_NO_SENSE:
+    case SK_RECOVERED_ERROR:
+        return SCSI_CAT_CLEAN;
+    case SK_NOT_READY:
+        return SCSI_CAT_NOT_READY;
+    case SK_MEDIUM_ERROR:
+    case SK_HARDWARE_ERROR:
+        return SCSI_CAT_MEDIUM_HARD;
+    case SK_ILLEGAL_REQUEST:
+        return asc == ASC_INVALID_OPCODE ? SCSI_CAT_INVALID_OP : SCSI_CAT_ILLEGAL_REQ;
+    case SK_UNIT_ATTENTION:
+        return SCSI_CAT_UNIT_ATTENTION;
+    case SK_ABORTED_COMMAND:
+        return SCSI_CAT_ABORTED_COMMAND;
+    default:
+        return SCSI_CAT_SENSE;
+    }
+}
+
+const char* scsi_cat_str(int cat) {
+    switch (cat) {
+    case SCSI_CAT_CLEAN:           return "No errors";
+    case SCSI_CAT_NOT_READY:       return "Not ready";
+    case SCSI_CAT_MEDIUM_HARD:     return "Medium or hardware error";
+    case SCSI_CAT_ILLEGAL_REQ:     return "Illegal request";
+    case SCSI_CAT_UNIT_ATTENTION:  return "Unit attention";
+    case SCSI_CAT_INVALID_OP:      return "Invalid opcode";
+    case SCSI_CAT_ABORTED_COMMAND: return "Aborted command";
+    case SCSI_CAT_TIMEOUT:         return "Timeout";
+    case SCSI_CAT_SENSE:           return "Sense error";
+    default:                       return "Other SCSI error";
+    }
+}
+
+const char* scsi_cat_name(int cat) {
+    switch (cat) {
+    case SCSI_CAT_CLEAN:           return "clean";
+    case SCSI_CAT_NOT_READY:       return "not_ready";
+    case SCSI_CAT_MEDIUM_HARD:     return "medium_hard";
+    case SCSI_CAT_ILLEGAL_REQ:     return "illegal_request";
+    case SCSI_CAT_UNIT_ATTENTION:  return "unit_attention";
+    case SCSI_CAT_INVALID_OP:      return "invalid_op";
+    case SCSI_CAT_ABORTED_COMMAND: return "aborted_command";
+    case SCSI_CAT_TIMEOUT:         return "timeout";
+    case SCSI_CAT_SENSE:           return "sense";
+    default:                       return "other";
+    }
+}
@@ -0,0 +1,58 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "device.h"
+
+#define INQUIRY_LEN       36 // Standard INQUIRY data, enough for vendor/product/revision
+// Exactly the 0x21 page with no block descriptors, anything longer is caught by device_check_pages
+#define MODE_SENSE10_LEN  (sizeof(struct mode_parameter_header) + 2 + sizeof(((struct page*)0)->wd21))
+#define SENSE_LEN         32
+#define SCSI_TIMEOUT_MS   60000 // Same as the sg3_utils default
+
+// Result categories, these match the values of sg3_utils' SG_LIB_CAT_* so either can be reported the same way
+enum scsi_cat {
+    SCSI_CAT_CLEAN = 0,
+    SCSI_CAT_NOT_READY = 2,
+    SCSI_CAT_MEDIUM_HARD = 3,
+    SCSI_CAT_ILLEGAL_REQ = 5,
+    SCSI_CAT_UNIT_ATTENTION = 6,
+    SCSI_CAT_INVALID_OP = 9,
+    SCSI_CAT_ABORTED_COMMAND = 11,
+    SCSI_CAT_TIMEOUT = 33,
+    SCSI_CAT_SENSE = 98,
+    SCSI_CAT_OTHER = 99,
+};
+
+// Build CDBs, returning the CDB length
+size_t scsi_request_sense_cdb(uint8_t* cdb, uint8_t alloc_len);
+size_t scsi_inquiry_cdb(uint8_t* cdb, uint16_t alloc_len);
+size_t scsi_mode_sense10_cdb(uint8_t* cdb, int pc, int page_code, uint16_t alloc_len);
+size_t scsi_mode_select10_cdb(uint8_t* cdb, bool save, uint16_t param_len);
+
+// Extract the identity from standard INQUIRY data
+void scsi_parse_inquiry(const uint8_t* data, size_t len, struct identity* identity);
+
+// Extract the mode page from MODE SENSE(10) data, returns false if it's truncated
+bool scsi_parse_mode_sense10(const uint8_t* data, size_t len, struct page* page);
+
+// Check whether sense data (e.g from REQUEST SENSE) reports a low power condition (ASC 0x5E),
+// meaning the drive is idle or in standby with its media spun down
+bool scsi_sense_low_power(const uint8_t* sense, size_t sense_len);
+
+// Categorise the outcome of a command from its status bytes and sense data
+enum scsi_cat scsi_categorize(int status, int host_status, int driver_status, const uint8_t* sense, size_t sense_len);
+
+// Human readable description of a category
+const char* scsi_cat_str(int cat);
+
+// Short name for a category, e.g "not_ready", that stays the same from release to release
+const char* scsi_cat_name(int cat);
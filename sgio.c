@@ -0,0 +1,112 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "scsi.h"
+#include "sgio.h"
+#include "sysfs.h"
+
+// Everything a command needs lives on the stack, so nothing is allocated per command
+static int sgio_command(int fd, const uint8_t* cdb, size_t cdb_len, int direction, void* data, size_t len,
+                        unsigned timeout_ms) {
+    uint8_t sense[SENSE_LEN];
+    struct sg_io_hdr hdr = {
+        .interface_id = 'S',
+        .dxfer_direction = direction,
+        .cmd_len = cdb_len,
+        .mx_sb_len = sizeof(sense),
+        .dxfer_len = len,
+        .dxferp = data,
+        .cmdp = (uint8_t*)cdb,
+        .sbp = sense,
+        .timeout = timeout_ms,
+    };
+    if (ioctl(fd, SG_IO, &hdr) < 0) {
+        return SCSI_CAT_OTHER;
+    }
+    return scsi_categorize(hdr.status, hdr.host_status, hdr.driver_status, sense, hdr.sb_len_wr);
+}
+
+static int sgio_open(const char* path, bool read_only) {
+    const int fd = open(path, (read_only ? O_RDONLY : O_RDWR) | O_NONBLOCK | O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+static void sgio_close(int fd) {
+    close(fd);
+}
+
+static int sgio_request_sense(int fd, uint8_t* sense, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[6];
+    const size_t cdb_len = scsi_request_sense_cdb(cdb, len);
+    return sgio_command(fd, cdb, cdb_len, SG_DXFER_FROM_DEV, sense, len, timeout_ms);
+}
+
+static int sgio_inquiry(int fd, struct identity* identity, unsigned timeout_ms) {
+    uint8_t cdb[6], data[INQUIRY_LEN] = {};
+    const size_t cdb_len = scsi_inquiry_cdb(cdb, sizeof(data));
+    const int cat = sgio_command(fd, cdb, cdb_len, SG_DXFER_FROM_DEV, data, sizeof(data), timeout_ms);
+    if (cat == SCSI_CAT_CLEAN) {
+        scsi_parse_inquiry(data, sizeof(data), identity);
+    }
+    return cat;
+}
+
+static int sgio_mode_sense10(int fd, int pc, uint8_t* data, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[10];
+    const size_t cdb_len = scsi_mode_sense10_cdb(cdb, pc, PAGE_CODE, len);
+    return sgio_command(fd, cdb, cdb_len, SG_DXFER_FROM_DEV, data, len, timeout_ms);
+}
+
+static int sgio_mode_select10(int fd, bool save, const void* param, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[10];
+    const size_t cdb_len = scsi_mode_select10_cdb(cdb, save, len);
+    return sgio_command(fd, cdb, cdb_len, SG_DXFER_TO_DEV, (void*)param, len, timeout_ms);
+}
+
+// SG_IO blocks, so for async talk to the /dev/sgN node with write()/read() instead
+int sgio_async_open(const char* path) {
+    char sg_path[PATH_MAX];
+    const int err = sysfs_sg_path(path, sg_path, sizeof(sg_path));
+    if (err != 0) {
+        return err;
+    }
+    const int fd = open(sg_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+void sgio_async_close(int fd) {
+    close(fd);
+}
+
+int sgio_async_submit(int fd, struct sg_io_hdr* hdr) {
+    return write(fd, hdr, sizeof(*hdr)) == sizeof(*hdr) ? 0 : -errno;
+}
+
+int sgio_async_receive(int fd, struct sg_io_hdr* hdr) {
+    return read(fd, hdr, sizeof(*hdr)) < 0 ? -errno : 0;
+}
+
+const struct transport sgio_transport = {
+    .name = "sgio",
+    .open = sgio_open,
+    .close = sgio_close,
+    .request_sense = sgio_request_sense,
+    .inquiry = sgio_inquiry,
+    .mode_sense10 = sgio_mode_sense10,
+    .mode_select10 = sgio_mode_select10,
+    .async_open = sgio_async_open,
+    .async_close = sgio_async_close,
+    .async_submit = sgio_async_submit,
+    .async_receive = sgio_async_receive,
+};
@@ -0,0 +1,20 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include "transport.h"
+
+// Real devices, using the SG_IO ioctl directly (and the /dev/sg read/write interface for async)
+extern const struct transport sgio_transport;
+
+// The non-blocking half of sgio_transport, which other transports for real devices share
+int sgio_async_open(const char* path);
+void sgio_async_close(int fd);
+int sgio_async_submit(int fd, struct sg_io_hdr* hdr);
+int sgio_async_receive(int fd, struct sg_io_hdr* hdr);
@@ -0,0 +1,78 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <scsi/sg_cmds_basic.h>
+#include <scsi/sg_lib.h>
+#include "scsi.h"
+#include "sgio.h"
+#include "sgutils.h"
+
+#define VERBOSE 0
+#define NOISY   true
+
+static int sgutils_open(const char* path, bool read_only) {
+    return sg_cmds_open_device(path, read_only, VERBOSE);
+}
+
+static void sgutils_close(int fd) {
+    sg_cmds_close_device(fd);
+}
+
+// sg3_utils returns a SG_LIB_CAT_* category, or -1 for other failures
+static int sg_cat(int status) {
+    return status < 0 ? SCSI_CAT_OTHER : status;
+}
+
+// These sg3_utils calls have no timeout argument, so they always use its default (SCSI_TIMEOUT_MS)
+static int sgutils_request_sense(int fd, uint8_t* sense, size_t len, unsigned timeout_ms) {
+    (void)timeout_ms;
+    return sg_cat(sg_ll_request_sense(fd, false, sense, len, false, VERBOSE));
+}
+
+static int sgutils_inquiry(int fd, struct identity* identity, unsigned timeout_ms) {
+    (void)timeout_ms;
+    struct sg_simple_inquiry_resp inquiry;
+    const int status = sg_simple_inquiry(fd, &inquiry, NOISY, VERBOSE);
+    if (status != 0) {
+        return sg_cat(status);
+    }
+    snprintf(identity->vendor, sizeof(identity->vendor), "%s", inquiry.vendor);
+    snprintf(identity->product, sizeof(identity->product), "%s", inquiry.product);
+    snprintf(identity->revision, sizeof(identity->revision), "%s", inquiry.revision);
+    return SCSI_CAT_CLEAN;
+}
+
+static int sgutils_mode_sense10(int fd, int pc, uint8_t* data, size_t len, unsigned timeout_ms) {
+    (void)timeout_ms;
+    return sg_cat(sg_ll_mode_sense10(fd, false, true, pc, PAGE_CODE, 0, data, len, NOISY, VERBOSE));
+}
+
+static int sgutils_mode_select10(int fd, bool save, const void* param, size_t len, unsigned timeout_ms) {
+    (void)timeout_ms;
+    const bool page_format = true;
+    return sg_cat(sg_ll_mode_select10(fd, page_format, save, (void*)param, len, NOISY, VERBOSE));
+}
+
+const char* sgutils_version(void) {
+    return sg_cmds_version();
+}
+
+const struct transport sgutils_transport = {
+    .name = "sgutils",
+    .open = sgutils_open,
+    .close = sgutils_close,
+    .request_sense = sgutils_request_sense,
+    .inquiry = sgutils_inquiry,
+    .mode_sense10 = sgutils_mode_sense10,
+    .mode_select10 = sgutils_mode_select10,
+    .async_open = sgio_async_open, // sg3_utils has no non-blocking interface
+    .async_close = sgio_async_close,
+    .async_submit = sgio_async_submit,
+    .async_receive = sgio_async_receive,
+};
@@ -0,0 +1,18 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include "transport.h"
+
+// Real devices, using blocking sg3_utils calls (and the /dev/sg read/write interface for async).
+// Only built with HAVE_SGUTILS, as a fallback for the built-in sgio_transport
+extern const struct transport sgutils_transport;
+
+// Version of the sg3_utils library in use
+const char* sgutils_version(void);
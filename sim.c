@@ -0,0 +1,382 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "scsi.h"
+#include "sim.h"
+
+#define SIM_VENDOR   "WD      "
+#define SIM_PRODUCT  "My Passport 25E2"
+#define SIM_REVISION "4004"
+
+// SCSI opcodes, status and sense
+#define REQUEST_SENSE          0x03
+#define INQUIRY                0x12
+#define MODE_SELECT10          0x55
+#define MODE_SENSE10           0x5a
+#define STATUS_CHECK_CONDITION 0x02
+#define SK_HARDWARE_ERROR      0x4
+#define SK_ILLEGAL_REQUEST     0x5
+#define ASC_INVALID_OPCODE     0x20
+#define ASC_INVALID_CDB_FIELD  0x24
+#define ASC_INVALID_PARAM      0x26
+#define DID_TIME_OUT           0x03
+
+struct sim_device {
+    char name[64];
+    unsigned latency_us;
+    unsigned select_failures; // How many more MODE SELECTs fail
+    pthread_mutex_t lock;
+    struct page pages[PC_COUNT]; // Indexed by page control
+};
+
+// Every simulated device, and which device each async file descriptor is talking to
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_device** sim_devices;
+static size_t sim_count;
+static int* sim_fds;
+static size_t sim_nfds;
+static atomic_size_t sim_executed;
+
+static void sim_reset(struct sim_device* device) {
+    struct page* const pages = device->pages;
+    for (int pc = 0; pc < PC_COUNT; pc++) {
+        pages[pc].code = PAGE_CODE | PS_BIT;
+        pages[pc].len = sizeof(pages[pc].wd21);
+    }
+    pages[PC_CHANGEABLE].wd21.led = 0xff;
+    pages[PC_DEFAULT].wd21.magic = PAGE_MAGIC;
+    pages[PC_DEFAULT].wd21.led = 0xff;
+    pages[PC_SAVED] = pages[PC_DEFAULT];
+    pages[PC_CURRENT] = pages[PC_SAVED];
+}
+
+// Find (or create) the device for a path, returns its handle or -errno
+static int sim_lookup(const char* path) {
+    const char* const name = path + strlen(SIM_PREFIX);
+    const size_t name_len = strcspn(name, "@!");
+    const char* const at = name[name_len] == '@' ? name + name_len : NULL;
+    const char* const bang = strchr(name + name_len, '!');
+    unsigned latency_us = 0, select_failures = 0;
+    char* endptr;
+    if (at) {
+        latency_us = strtoul(at + 1, &endptr, 10);
+        if (!at[1] || endptr == at + 1 || (*endptr && endptr != bang)) {
+            return -EINVAL;
+        }
+    }
+    if (bang) {
+        select_failures = strtoul(bang + 1, &endptr, 10);
+        if (!bang[1] || *endptr) {
+            return -EINVAL;
+        }
+    }
+    if (name_len == 0 || name_len >= sizeof(sim_devices[0]->name)) {
+        return -ENOENT;
+    }
+
+    int handle = -ENOMEM;
+    pthread_mutex_lock(&sim_lock);
+    for (size_t i = 0; i < sim_count; i++) {
+        if (!strncmp(sim_devices[i]->name, name, name_len) && !sim_devices[i]->name[name_len]) {
+            handle = i;
+            goto out;
+        }
+    }
+    struct sim_device** const devices = realloc(sim_devices, (sim_count + 1) * sizeof(*devices));
+    struct sim_device* const device = calloc(1, sizeof(*device));
+    if (devices) {
+        sim_devices = devices;
+    }
+    if (!devices || !device) {
+        free(device);
+        goto out;
+    }
+    memcpy(device->name, name, name_len);
+    device->latency_us = latency_us;
+    device->select_failures = select_failures;
+    pthread_mutex_init(&device->lock, NULL);
+    sim_reset(device);
+    sim_devices[sim_count] = device;
+    handle = sim_count++;
+out:
+    pthread_mutex_unlock(&sim_lock);
+    return handle;
+}
+
+static struct sim_device* sim_device(int handle) {
+    pthread_mutex_lock(&sim_lock);
+    struct sim_device* const device = sim_devices[handle];
+    pthread_mutex_unlock(&sim_lock);
+    return device;
+}
+
+static void check_condition(struct sg_io_hdr* hdr, uint8_t key, uint8_t asc) {
+    const uint8_t sense[18] = { [0] = 0x70, [2] = key, [7] = 10, [12] = asc };
+    const size_t len = hdr->mx_sb_len < sizeof(sense) ? hdr->mx_sb_len : sizeof(sense);
+    memcpy(hdr->sbp, sense, len);
+    hdr->sb_len_wr = len;
+    hdr->status = STATUS_CHECK_CONDITION;
+    hdr->masked_status = STATUS_CHECK_CONDITION >> 1;
+    hdr->resid = hdr->dxfer_len;
+}
+
+// Return data to the initiator, truncated to the allocation length
+static void data_in(struct sg_io_hdr* hdr, const void* data, size_t len, size_t alloc_len) {
+    if (len > alloc_len) {
+        len = alloc_len;
+    }
+    if (len > hdr->dxfer_len) {
+        len = hdr->dxfer_len;
+    }
+    memcpy(hdr->dxferp, data, len);
+    hdr->resid = hdr->dxfer_len - len;
+}
+
+static void execute_mode_select10(struct sim_device* device, struct sg_io_hdr* hdr) {
+    const uint8_t* const cdb = hdr->cmdp;
+    const size_t param_len = (cdb[7] << 8) | cdb[8];
+    const size_t header_len = sizeof(struct mode_parameter_header);
+    const struct page* const changeable = &device->pages[PC_CHANGEABLE];
+    struct page* const current = &device->pages[PC_CURRENT];
+    if (!(cdb[1] & 0x10) || param_len > hdr->dxfer_len || param_len < header_len + 2) {
+        check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_CDB_FIELD);
+        return;
+    }
+
+    // The page must be the whole 0x21 page, only changing bits the changeable mask allows
+    const uint8_t* const data = hdr->dxferp;
+    struct page page = {};
+    memcpy(&page, data + header_len, param_len - header_len < sizeof(page) ? param_len - header_len : sizeof(page));
+    if ((page.code & 0x3f) != PAGE_CODE || page.len != current->len || param_len != header_len + 2 + page.len) {
+        check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_PARAM);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(page.wd21); i++) {
+        const uint8_t* const new = (const uint8_t*)&page.wd21;
+        const uint8_t* const old = (const uint8_t*)&current->wd21;
+        const uint8_t* const mask = (const uint8_t*)&changeable->wd21;
+        if ((new[i] ^ old[i]) & ~mask[i]) {
+            check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_PARAM);
+            return;
+        }
+    }
+    current->wd21 = page.wd21;
+    if (cdb[1] & 0x01) {
+        device->pages[PC_SAVED].wd21 = page.wd21;
+    }
+}
+
+// How long a command takes: the device's latency, or its timeout if that's shorter
+static unsigned sim_delay_us(const struct sim_device* device, const struct sg_io_hdr* hdr) {
+    return hdr->timeout && device->latency_us > hdr->timeout * 1000ull ? hdr->timeout * 1000u : device->latency_us;
+}
+
+// Carry out a command, filling in the status, sense and data
+static void sim_execute(struct sim_device* device, struct sg_io_hdr* hdr) {
+    const uint8_t* const cdb = hdr->cmdp;
+    hdr->status = hdr->masked_status = 0;
+    hdr->host_status = hdr->driver_status = 0;
+    hdr->sb_len_wr = 0;
+    hdr->resid = 0;
+    hdr->duration = sim_delay_us(device, hdr) / 1000;
+
+    // A command slower than its timeout is aborted before it does anything
+    if (sim_delay_us(device, hdr) < device->latency_us) {
+        hdr->host_status = DID_TIME_OUT;
+        hdr->resid = hdr->dxfer_len;
+        return;
+    }
+
+    sim_executed++;
+    pthread_mutex_lock(&device->lock);
+    switch (cdb[0]) {
+    case REQUEST_SENSE: {
+        const uint8_t sense[18] = { [0] = 0x70, [7] = 10 };
+        data_in(hdr, sense, sizeof(sense), cdb[4]);
+        break;
+    }
+    case INQUIRY: {
+        if (cdb[1] & 0x01) {
+            check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_CDB_FIELD); // No VPD pages
+            break;
+        }
+        uint8_t data[INQUIRY_LEN] = { [2] = 0x06, [3] = 0x02, [4] = INQUIRY_LEN - 5 };
+        memcpy(data + 8, SIM_VENDOR, 8);
+        memcpy(data + 16, SIM_PRODUCT, 16);
+        memcpy(data + 32, SIM_REVISION, 4);
+        data_in(hdr, data, sizeof(data), (cdb[3] << 8) | cdb[4]);
+        break;
+    }
+    case MODE_SENSE10: {
+        const int pc = cdb[2] >> 6;
+        if ((cdb[2] & 0x3f) != PAGE_CODE) {
+            check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_CDB_FIELD);
+            break;
+        }
+        uint8_t data[MODE_SENSE10_LEN] = {};
+        const size_t len = sizeof(struct mode_parameter_header) + 2 + device->pages[pc].len;
+        data[1] = len - 2; // Mode data length
+        memcpy(data + sizeof(struct mode_parameter_header), &device->pages[pc], len - sizeof(struct mode_parameter_header));
+        data_in(hdr, data, len, (cdb[7] << 8) | cdb[8]);
+        break;
+    }
+    case MODE_SELECT10:
+        if (device->select_failures) {
+            device->select_failures--;
+            check_condition(hdr, SK_HARDWARE_ERROR, 0);
+            break;
+        }
+        execute_mode_select10(device, hdr);
+        break;
+    default:
+        check_condition(hdr, SK_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+        break;
+    }
+    pthread_mutex_unlock(&device->lock);
+}
+
+// Run a command to completion, taking as long as the device is configured to
+static int sim_command(int handle, uint8_t* cdb, size_t cdb_len, int direction, void* data, size_t len,
+                       unsigned timeout_ms) {
+    struct sim_device* const device = sim_device(handle);
+    uint8_t sense[SENSE_LEN];
+    struct sg_io_hdr hdr = {
+        .interface_id = 'S',
+        .dxfer_direction = direction,
+        .cmd_len = cdb_len,
+        .mx_sb_len = sizeof(sense),
+        .dxfer_len = len,
+        .dxferp = data,
+        .cmdp = cdb,
+        .sbp = sense,
+        .timeout = timeout_ms,
+    };
+    sim_execute(device, &hdr);
+    const unsigned delay_us = sim_delay_us(device, &hdr);
+    if (delay_us) {
+        const struct timespec delay = { delay_us / 1000000, delay_us % 1000000 * 1000 };
+        while (nanosleep(&delay, NULL) != 0 && errno == EINTR) {
+        }
+    }
+    return scsi_categorize(hdr.status, hdr.host_status, hdr.driver_status, sense, hdr.sb_len_wr);
+}
+
+static int sim_open(const char* path, bool read_only) {
+    (void)read_only;
+    return sim_lookup(path);
+}
+
+static void sim_close(int handle) {
+    (void)handle;
+}
+
+static int sim_request_sense(int handle, uint8_t* sense, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[6];
+    const size_t cdb_len = scsi_request_sense_cdb(cdb, len);
+    return sim_command(handle, cdb, cdb_len, SG_DXFER_FROM_DEV, sense, len, timeout_ms);
+}
+
+static int sim_inquiry(int handle, struct identity* identity, unsigned timeout_ms) {
+    uint8_t cdb[6], data[INQUIRY_LEN] = {};
+    const size_t cdb_len = scsi_inquiry_cdb(cdb, sizeof(data));
+    const int cat = sim_command(handle, cdb, cdb_len, SG_DXFER_FROM_DEV, data, sizeof(data), timeout_ms);
+    if (cat == SCSI_CAT_CLEAN) {
+        scsi_parse_inquiry(data, sizeof(data), identity);
+    }
+    return cat;
+}
+
+static int sim_mode_sense10(int handle, int pc, uint8_t* data, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[10];
+    const size_t cdb_len = scsi_mode_sense10_cdb(cdb, pc, PAGE_CODE, len);
+    return sim_command(handle, cdb, cdb_len, SG_DXFER_FROM_DEV, data, len, timeout_ms);
+}
+
+static int sim_mode_select10(int handle, bool save, const void* param, size_t len, unsigned timeout_ms) {
+    uint8_t cdb[10];
+    const size_t cdb_len = scsi_mode_select10_cdb(cdb, save, len);
+    return sim_command(handle, cdb, cdb_len, SG_DXFER_TO_DEV, (void*)param, len, timeout_ms);
+}
+
+// Commands complete when a timerfd set to the device's latency expires
+static int sim_async_open(const char* path) {
+    const int handle = sim_lookup(path);
+    if (handle < 0) {
+        return handle;
+    }
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    if ((size_t)fd >= sim_nfds) {
+        const size_t nfds = fd + 64;
+        int* const fds = realloc(sim_fds, nfds * sizeof(*fds));
+        if (!fds) {
+            pthread_mutex_unlock(&sim_lock);
+            close(fd);
+            return -ENOMEM;
+        }
+        sim_fds = fds;
+        sim_nfds = nfds;
+    }
+    sim_fds[fd] = handle;
+    pthread_mutex_unlock(&sim_lock);
+    return fd;
+}
+
+static void sim_async_close(int fd) {
+    close(fd);
+}
+
+static int sim_async_submit(int fd, struct sg_io_hdr* hdr) {
+    pthread_mutex_lock(&sim_lock);
+    struct sim_device* const device = sim_devices[sim_fds[fd]];
+    pthread_mutex_unlock(&sim_lock);
+
+    // The result is ready straight away, but isn't handed back until the latency has passed
+    sim_execute(device, hdr);
+    const unsigned delay_us = sim_delay_us(device, hdr);
+    const unsigned long ns = delay_us ? delay_us * 1000ul : 1;
+    const struct itimerspec timer = { .it_value = { ns / 1000000000, ns % 1000000000 } };
+    return timerfd_settime(fd, 0, &timer, NULL) == 0 ? 0 : -errno;
+}
+
+static int sim_async_receive(int fd, struct sg_io_hdr* hdr) {
+    (void)hdr;
+    uint64_t expirations;
+    return read(fd, &expirations, sizeof(expirations)) < 0 ? -errno : 0;
+}
+
+size_t sim_commands(void) {
+    return sim_executed;
+}
+
+const struct transport sim_transport = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .request_sense = sim_request_sense,
+    .inquiry = sim_inquiry,
+    .mode_sense10 = sim_mode_sense10,
+    .mode_select10 = sim_mode_select10,
+    .async_open = sim_async_open,
+    .async_close = sim_async_close,
+    .async_submit = sim_async_submit,
+    .async_receive = sim_async_receive,
+};
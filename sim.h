@@ -0,0 +1,22 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include "transport.h"
+
+// Simulated devices are named sim:NAME, or sim:NAME@LATENCY to have every command take LATENCY microseconds.
+// A suffix of !FAILS makes the device's first FAILS MODE SELECTs fail with a hardware error.
+// Each NAME is a separate drive, created the first time it's opened and kept for the life of the process
+#define SIM_PREFIX "sim:"
+
+// An in-process WD My Passport, emulating the SCSI commands wdled sends and the 0x21 mode page
+extern const struct transport sim_transport;
+
+// Number of commands simulated devices have executed, for counting the commands an operation needs
+size_t sim_commands(void);
@@ -0,0 +1,197 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "sysfs.h"
+
+#define SG_MAJOR 21
+
+int sysfs_device_dir(const char* path, char* dir, size_t len) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -errno;
+    }
+    const char* type;
+    if (S_ISBLK(st.st_mode)) {
+        type = "block";
+    } else if (S_ISCHR(st.st_mode) && major(st.st_rdev) == SG_MAJOR) {
+        type = "char";
+    } else {
+        return -ENODEV;
+    }
+
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/%s/%u:%u/device", type, major(st.st_rdev), minor(st.st_rdev));
+    char resolved[PATH_MAX];
+    if (!realpath(link, resolved)) {
+        // Partitions don't have a device link of their own
+        return -ENODEV;
+    }
+    if ((size_t)snprintf(dir, len, "%s", resolved) >= len) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+int sysfs_sg_path(const char* path, char* sg_path, size_t len) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -errno;
+    }
+    if (S_ISCHR(st.st_mode) && major(st.st_rdev) == SG_MAJOR) {
+        snprintf(sg_path, len, "%s", path);
+        return 0;
+    }
+
+    char dir_path[PATH_MAX];
+    int result = sysfs_device_dir(path, dir_path, sizeof(dir_path) - 16);
+    if (result != 0) {
+        return result;
+    }
+    strcat(dir_path, "/scsi_generic");
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        return -ENODEV;
+    }
+    result = -ENODEV;
+    for (struct dirent* entry; (entry = readdir(dir));) {
+        if (entry->d_name[0] != '.') {
+            snprintf(sg_path, len, "/dev/%s", entry->d_name);
+            result = 0;
+            break;
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// Read a whole (small) sysfs file, returns the number of bytes read or -1
+static ssize_t read_file(const char* dir, const char* name, void* buf, size_t len) {
+    char path[PATH_MAX];
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+        return -1;
+    }
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    const ssize_t result = read(fd, buf, len);
+    close(fd);
+    return result;
+}
+
+bool sysfs_read_attr(const char* dir, const char* name, char* buf, size_t len) {
+    const ssize_t result = read_file(dir, name, buf, len - 1);
+    if (result < 0) {
+        return false;
+    }
+    buf[result] = '\0';
+    char* newline = strchr(buf, '\n');
+    if (newline) {
+        *newline = '\0';
+    }
+    return true;
+}
+
+bool sysfs_identity(const char* dir, struct identity* identity) {
+    return sysfs_read_attr(dir, "vendor", identity->vendor, sizeof(identity->vendor))
+        && sysfs_read_attr(dir, "model", identity->product, sizeof(identity->product))
+        && sysfs_read_attr(dir, "rev", identity->revision, sizeof(identity->revision));
+}
+
+// Copy a serial number, without any surrounding spaces
+static bool copy_serial(char* serial, size_t len, const char* src, size_t src_len) {
+    while (src_len > 0 && (*src == ' ' || *src == '\0')) {
+        src++;
+        src_len--;
+    }
+    while (src_len > 0 && (src[src_len - 1] == ' ' || src[src_len - 1] == '\0' || src[src_len - 1] == '\n')) {
+        src_len--;
+    }
+    if (src_len == 0 || src_len >= len) {
+        return false;
+    }
+    memcpy(serial, src, src_len);
+    serial[src_len] = '\0';
+    return true;
+}
+
+bool sysfs_serial(const char* dir, char* serial, size_t len) {
+    // The kernel caches VPD page 0x80 (Unit Serial Number), if the device was willing to report it
+    uint8_t vpd[256];
+    const ssize_t vpd_len = read_file(dir, "vpd_pg80", vpd, sizeof(vpd));
+    if (vpd_len > 4 && vpd[1] == 0x80) {
+        size_t page_len = (vpd[2] << 8) | vpd[3];
+        if (page_len > (size_t)vpd_len - 4) {
+            page_len = vpd_len - 4;
+        }
+        if (copy_serial(serial, len, (const char*)vpd + 4, page_len)) {
+            return true;
+        }
+    }
+
+    // usb-storage normally stops the kernel reading VPD pages, so fall back to the USB device's serial number
+    char usb[PATH_MAX], buf[128];
+    if (sysfs_usb_dir(dir, usb, sizeof(usb)) && sysfs_read_attr(usb, "serial", buf, sizeof(buf))) {
+        return copy_serial(serial, len, buf, strlen(buf));
+    }
+    return false;
+}
+
+bool sysfs_usb_dir(const char* dir, char* usb, size_t len) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char* slash; (slash = strrchr(path, '/')) && slash != path;) {
+        *slash = '\0';
+        char id[8];
+        if (sysfs_read_attr(path, "idVendor", id, sizeof(id))) {
+            return (size_t)snprintf(usb, len, "%s", path) < len;
+        }
+    }
+    return false;
+}
+
+bool sysfs_usb_port(const char* dir, char* port, size_t len) {
+    char usb[PATH_MAX];
+    if (!sysfs_usb_dir(dir, usb, sizeof(usb))) {
+        return false;
+    }
+    return (size_t)snprintf(port, len, "%s", strrchr(usb, '/') + 1) < len;
+}
+
+bool sysfs_runtime_suspended(const char* path) {
+    char dir[PATH_MAX], usb[PATH_MAX], status[16];
+    if (sysfs_device_dir(path, dir, sizeof(dir)) != 0) {
+        return false;
+    }
+    if (sysfs_read_attr(dir, "power/runtime_status", status, sizeof(status)) && !strcmp(status, "suspended")) {
+        return true;
+    }
+    return sysfs_usb_dir(dir, usb, sizeof(usb))
+        && sysfs_read_attr(usb, "power/runtime_status", status, sizeof(status)) && !strcmp(status, "suspended");
+}
+
+bool sysfs_disk_key(const char* path, char* key, size_t len) {
+    char dir[PATH_MAX], serial[64] = "";
+    if (sysfs_device_dir(path, dir, sizeof(dir)) != 0) {
+        return false;
+    }
+    // The address alone could be reused by another disk after a replug, the serial number rules that out
+    sysfs_serial(dir, serial, sizeof(serial));
+    return (size_t)snprintf(key, len, "%s %s", strrchr(dir, '/') + 1, serial) < len;
+}
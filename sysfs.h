@@ -0,0 +1,44 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "device.h"
+
+// Find the sysfs SCSI device directory (e.g /sys/devices/.../6:0:0:0) for a block or sg device node
+// Returns 0 or -errno
+int sysfs_device_dir(const char* path, char* dir, size_t len);
+
+// Find the /dev/sgN node for a device, which may be a block device or symlink to one
+// Returns 0 or -errno
+int sysfs_sg_path(const char* path, char* sg_path, size_t len);
+
+// Read a sysfs attribute, without the trailing newline
+bool sysfs_read_attr(const char* dir, const char* name, char* buf, size_t len);
+
+// Read the identity the kernel cached from its own INQUIRY
+bool sysfs_identity(const char* dir, struct identity* identity);
+
+// Build a key naming the physical disk behind a device node, however it was reached:
+// its SCSI address (H:C:T:L) and unit serial number. Returns false if it isn't a SCSI device
+bool sysfs_disk_key(const char* path, char* key, size_t len);
+
+// Read the unit serial number: VPD page 0x80 if the kernel cached it, otherwise the USB serial number
+bool sysfs_serial(const char* dir, char* serial, size_t len);
+
+// Find the sysfs directory of the USB device a SCSI device belongs to
+bool sysfs_usb_dir(const char* dir, char* usb, size_t len);
+
+// Find the USB port path (e.g 2-1.4) a SCSI device is connected to
+bool sysfs_usb_port(const char* dir, char* port, size_t len);
+
+// Check whether runtime power management has suspended a device node's SCSI device or the USB device
+// behind it, in which case opening it would wake it up
+bool sysfs_runtime_suspended(const char* path);
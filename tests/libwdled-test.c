@@ -0,0 +1,77 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// The library API, used only through libwdled.h and linked against libwdled.a as another program would
+
+#include <stdio.h>
+#include <string.h>
+#include "../libwdled.h"
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+int main(void) {
+    struct wdled disk;
+    struct wdled_values values;
+    bool unchanged;
+
+    CHECK(wdled_open(&disk, "sim:", false) == WDLED_ERR_OPEN && disk.detail < 0);
+
+    // Nothing can be read or set until the disk has been identified
+    CHECK(wdled_open(&disk, "sim:lib", false) == WDLED_OK);
+    CHECK(wdled_get(&disk, WDLED_CURRENT, &values) == WDLED_ERR_INVALID);
+    CHECK(wdled_set(&disk, 0x00, false, &unchanged) == WDLED_ERR_INVALID && !unchanged);
+    CHECK(wdled_identify(&disk, false) == WDLED_OK);
+    CHECK(!strcmp(disk.vendor, "WD      ") && !strncmp(disk.product, "My Passport", 11) && disk.revision[0]);
+    CHECK(wdled_get(&disk, 0, &values) == WDLED_ERR_INVALID);
+    CHECK(wdled_get(&disk, 1 << 1, &values) == WDLED_ERR_INVALID);
+
+    CHECK(wdled_get(&disk, WDLED_CURRENT | WDLED_ORIGINAL | WDLED_SAVED, &values) == WDLED_OK);
+    CHECK(values.read == (WDLED_CURRENT | WDLED_ORIGINAL | WDLED_SAVED));
+    CHECK(values.current == 0xff && values.original == 0xff && values.saved == 0xff);
+
+    // Set without saving, then save, then again with nothing left to write
+    CHECK(wdled_set(&disk, 0x00, false, &unchanged) == WDLED_OK && !unchanged);
+    CHECK(wdled_get(&disk, WDLED_SAVED, &values) == WDLED_OK);
+    CHECK(values.read == (WDLED_CURRENT | WDLED_SAVED) && values.current == 0x00 && values.saved == 0xff);
+    CHECK(wdled_set(&disk, 0x00, false, &unchanged) == WDLED_OK && unchanged);
+    CHECK(wdled_set(&disk, 0x00, true, &unchanged) == WDLED_OK && !unchanged);
+    CHECK(wdled_set(&disk, 0x00, true, NULL) == WDLED_OK);
+    CHECK(wdled_set(&disk, 0x00, true, &unchanged) == WDLED_OK && unchanged);
+    wdled_close(&disk);
+    CHECK(wdled_get(&disk, WDLED_CURRENT, &values) == WDLED_ERR_INVALID);
+
+    // Simulated disks last as long as the process, and read-only handles can't set
+    CHECK(wdled_open(&disk, "sim:lib", true) == WDLED_OK && wdled_identify(&disk, false) == WDLED_OK);
+    CHECK(wdled_get(&disk, WDLED_SAVED, &values) == WDLED_OK && values.current == 0x00 && values.saved == 0x00);
+    CHECK(wdled_set(&disk, 0xff, false, NULL) == WDLED_ERR_INVALID);
+    wdled_close(&disk);
+
+    // Failures come back with their detail
+    CHECK(wdled_open(&disk, "sim:lib-fail!1", false) == WDLED_OK && wdled_identify(&disk, false) == WDLED_OK);
+    CHECK(wdled_set(&disk, 0x00, false, NULL) == WDLED_ERR_MODE_SELECT && disk.detail > 0);
+    CHECK(!strcmp(wdled_strerror(WDLED_ERR_MODE_SELECT), "Set mode page failed"));
+    CHECK(wdled_set(&disk, 0x00, false, NULL) == WDLED_OK);
+    wdled_close(&disk);
+
+    CHECK(wdled_open(&disk, "sim:lib-slow@200000", false) == WDLED_OK);
+    disk.timeout_ms = 10;
+    CHECK(wdled_identify(&disk, false) == WDLED_ERR_INQUIRY && disk.detail > 0);
+    wdled_close(&disk);
+
+    if (!failed) {
+        printf("PASS: libwdled\n");
+    }
+    return failed;
+}
@@ -0,0 +1,116 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+
+// The compiled policy (hash table and prefix tries) must pick the same rule as trying each rule in file order
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../policy.h"
+
+static const char policy_text[] =
+    "# Exact selectors, before and after globs that also match\n"
+    "serial:EXACT1                 on\n"
+    "serial:EXACT*                 off\n"
+    "serial:GLOB*                  off\n"
+    "serial:GLOB2                  on\n"
+    "# Patterns sharing a literal prefix\n"
+    "id:usb-WD_My_Passport_25E2_*  off\n"
+    "id:usb-WD_*                   on\n"
+    "id:usb-Seagate_*              on\n"
+    "model:*25E2                   off\n"
+    "vendor:WD                     on\n"
+    "usb:2-1.?                     off\n"
+    "*                             save:on\n";
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+static struct policy* load(const char* text) {
+    char path[] = "/tmp/wdled-policy-XXXXXX";
+    const int fd = mkstemp(path);
+    FILE* const file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+    char error[256];
+    struct policy* const policy = policy_load(path, error, sizeof(error));
+    unlink(path);
+    if (!policy) {
+        fprintf(stderr, "FAIL: %s\n", error);
+        exit(1);
+    }
+    return policy;
+}
+
+// Line of the rule a device matches, 0 for none
+static unsigned match(const struct policy* policy, const struct policy_device* device) {
+    const struct policy_rule* const rule = policy_lookup(policy, device);
+    return rule ? rule->line : 0;
+}
+
+int main(void) {
+    struct policy* const policy = load(policy_text);
+
+    // The first matching rule wins, whether it's exact or a glob
+    CHECK(match(policy, &(struct policy_device){ .serial = "EXACT1" }) == 2);
+    CHECK(match(policy, &(struct policy_device){ .serial = "EXACT9" }) == 3);
+    CHECK(match(policy, &(struct policy_device){ .serial = "GLOB2" }) == 4);
+
+    // The longest literal prefix isn't what decides, file order is
+    const char* const ids[] = { "usb-Seagate_Expansion", "usb-WD_My_Passport_25E2_575831" };
+    CHECK(match(policy, &(struct policy_device){ .ids = ids, .nids = 2 }) == 7);
+    CHECK(match(policy, &(struct policy_device){ .ids = ids, .nids = 1 }) == 9);
+    CHECK(match(policy, &(struct policy_device){ .ids = ids + 1, .nids = 1 }) == 7);
+
+    // A pattern with no literal prefix lives at the root of its trie
+    CHECK(match(policy, &(struct policy_device){ .model = "My Passport 25E2" }) == 10);
+    CHECK(match(policy, &(struct policy_device){ .model = "My Passport 25E1", .vendor = "WD" }) == 11);
+    CHECK(match(policy, &(struct policy_device){ .usb = "2-1.4" }) == 12);
+    CHECK(match(policy, &(struct policy_device){ .usb = "2-1.10" }) == 13);
+
+    // Across kinds, the earliest rule any of them match wins
+    CHECK(match(policy, &(struct policy_device){ .serial = "EXACT1", .model = "My Passport 25E2" }) == 2);
+    CHECK(match(policy, &(struct policy_device){ .serial = "OTHER", .usb = "2-1.4", .vendor = "WD" }) == 11);
+
+    const struct policy_rule* const any = policy_lookup(policy, &(struct policy_device){});
+    CHECK(any && any->any && any->request.new == 255 && any->request.save);
+    policy_free(policy);
+
+    // Enough exact selectors to grow the hash table, with a glob among them
+    char* const text = malloc(64 * 4096);
+    size_t n = 0;
+    for (unsigned i = 0; i < 4000; i++) {
+        n += sprintf(text + n, i == 2000 ? "serial:SN1*  off\n" : "serial:SN%04u  on\n", i);
+    }
+    struct policy* const large = load(text);
+    free(text);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN0042" }) == 43);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN1999" }) == 2000);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN3999" }) == 4000);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN2999" }) == 3000);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN1_x" }) == 2001);
+    CHECK(match(large, &(struct policy_device){ .serial = "SN4000" }) == 0);
+    policy_free(large);
+
+    if (!failed) {
+        printf("PASS: policy\n");
+    }
+    return failed;
+}
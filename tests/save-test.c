@@ -0,0 +1,121 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Saves must only write non-volatile storage when the saved value differs, and stop once the budget is used up.
+// Built with STATE_DIR pointing into tests/, and with sysfs stubbed to give the simulated drive a serial number
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "../budget.h"
+#include "../sim.h"
+#include "../sysfs.h"
+
+#define DEVICE "sim:save"
+#define SERIAL "WXSAVETEST"
+#define BUDGET 2
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+int sysfs_device_dir(const char* path, char* dir, size_t len) {
+    (void)path;
+    snprintf(dir, len, "/sys/devices/test/0:0:0:0");
+    return 0;
+}
+
+bool sysfs_serial(const char* dir, char* serial, size_t len) {
+    (void)dir;
+    snprintf(serial, len, "%s", SERIAL);
+    return true;
+}
+
+// Only linked in, never reached
+bool sysfs_identity(const char* dir, struct identity* identity) {
+    (void)dir;
+    (void)identity;
+    return false;
+}
+
+int sysfs_sg_path(const char* path, char* sg_path, size_t len) {
+    (void)path;
+    (void)sg_path;
+    (void)len;
+    return -ENOENT;
+}
+
+// Set the LED mode with save:, counting against the budget as wdled does
+static struct result save(int handle, int value) {
+    const struct request request = { .new = value, .save = true, .save_budget = BUDGET };
+    struct plan plan = device_plan(&request);
+    transport_start(&request, &plan);
+    struct budget_key budget;
+    budget_prepare(DEVICE, &request, &plan, &budget);
+    struct result result = {};
+    transport_run(&sim_transport, handle, &request, &plan, &result);
+    budget_update(&budget, &result);
+    return result;
+}
+
+static bool selected(const struct result* result) {
+    return result->phases & PHASE_MASK(PHASE_MODE_SELECT);
+}
+
+static int saved(int handle) {
+    const struct request request = { .new = -1 };
+    const struct plan plan = { .page_controls = PC_MASK(PC_CURRENT) | PC_MASK(PC_SAVED) };
+    struct result result = {};
+    transport_run(&sim_transport, handle, &request, &plan, &result);
+    return result.err == DEVICE_OK ? result.saved.wd21.led : -1;
+}
+
+int main(void) {
+    char path[PATH_MAX];
+    cache_path(STATE_DIR, SERIAL, path, sizeof(path));
+    unlink(path);
+    const int handle = sim_transport.open(DEVICE, false);
+    CHECK(handle >= 0);
+
+    // The drive starts with 255 saved, so this is a real save
+    struct result result = save(handle, 0);
+    CHECK(result.err == DEVICE_OK && selected(&result) && result.nv_write && !result.save_deferred);
+    CHECK(saved(handle) == 0);
+
+    // Already saved, so nothing is written
+    result = save(handle, 0);
+    CHECK(result.err == DEVICE_OK && result.unchanged && !selected(&result) && !result.nv_write);
+
+    // The second save uses up the budget
+    result = save(handle, 255);
+    CHECK(result.err == DEVICE_OK && result.nv_write && !result.save_deferred);
+    CHECK(saved(handle) == 255);
+
+    // Over budget: the current value is set, the saved value is left alone
+    result = save(handle, 0);
+    CHECK(result.err == DEVICE_OK && selected(&result) && !result.nv_write && result.save_deferred);
+    CHECK(saved(handle) == 255);
+
+    // Going back to the saved value doesn't need a save, so isn't held back by the budget
+    result = save(handle, 255);
+    CHECK(result.err == DEVICE_OK && selected(&result) && !result.nv_write && !result.save_deferred);
+    CHECK(saved(handle) == 255);
+
+    unlink(path);
+    if (!failed) {
+        printf("PASS: save coalescing and budget\n");
+    }
+    return failed;
+}
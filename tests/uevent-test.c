@@ -0,0 +1,78 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+// Remove events must lead back to the drive they're for, whichever of its nodes they name,
+// even though the drive has already gone from sysfs
+
+#include <stdio.h>
+#include <string.h>
+#include "../uevent.h"
+
+#define SCSI_DEVICE "/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host6/target6:0:0/6:0:0:0"
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+// Build a kernel uevent message: "action@devpath" then NUL separated KEY=VALUE pairs
+static size_t message(char* buf, size_t len, const char* action, const char* node, const char* subsystem,
+                      const char* devtype, const char* devname) {
+    int n = snprintf(buf, len, "%s@%s%c", action, node, '\0');
+    n += snprintf(buf + n, len - n, "ACTION=%s%c", action, '\0');
+    n += snprintf(buf + n, len - n, "DEVPATH=%s%c", node, '\0');
+    n += snprintf(buf + n, len - n, "SUBSYSTEM=%s%c", subsystem, '\0');
+    if (devtype) {
+        n += snprintf(buf + n, len - n, "DEVTYPE=%s%c", devtype, '\0');
+    }
+    n += snprintf(buf + n, len - n, "DEVNAME=%s%c", devname, '\0');
+    return n;
+}
+
+int main(void) {
+    char buf[UEVENT_BUFFER_SIZE], dir[4096];
+    struct uevent event;
+    size_t len;
+
+    // The sg node's remove event names the SCSI device the disk node was opened through
+    len = message(buf, sizeof(buf), "remove", SCSI_DEVICE "/scsi_generic/sg2", "scsi_generic", NULL, "sg2");
+    CHECK(uevent_parse(buf, len, &event));
+    CHECK(!strcmp(event.action, "remove"));
+    CHECK(!strcmp(event.devname, "sg2"));
+    CHECK(uevent_is_scsi_disk(&event));
+    CHECK(uevent_device_dir(&event, dir, sizeof(dir)));
+    CHECK(!strcmp(dir, "/sys" SCSI_DEVICE));
+
+    // As does the disk node's
+    len = message(buf, sizeof(buf), "remove", SCSI_DEVICE "/block/sdb", "block", "disk", "sdb");
+    CHECK(uevent_parse(buf, len, &event));
+    CHECK(uevent_is_scsi_disk(&event));
+    CHECK(uevent_device_dir(&event, dir, sizeof(dir)));
+    CHECK(!strcmp(dir, "/sys" SCSI_DEVICE));
+
+    // Partitions aren't disks
+    len = message(buf, sizeof(buf), "remove", SCSI_DEVICE "/block/sdb/sdb1", "block", "partition", "sdb1");
+    CHECK(uevent_parse(buf, len, &event));
+    CHECK(!uevent_is_scsi_disk(&event));
+
+    // Too short to have a SCSI device above it, and missing the fields every event has
+    len = message(buf, sizeof(buf), "remove", "/sg2", "scsi_generic", NULL, "sg2");
+    CHECK(uevent_parse(buf, len, &event));
+    CHECK(!uevent_device_dir(&event, dir, sizeof(dir)));
+    len = snprintf(buf, sizeof(buf), "remove@/x%cACTION=remove%c", '\0', '\0');
+    CHECK(!uevent_parse(buf, len, &event));
+
+    if (!failed) {
+        printf("PASS: uevents\n");
+    }
+    return failed;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# --correct must keep trying when a correction fails, rather than taking the drifted value as the new normal.
+# sim:flaky starts with its LED on and fails its first MODE SELECT, so only a second correction turns it off
+set -eu
+
+WDLED=${WDLED:-./wdled}
+metrics=$(mktemp)
+out=$(mktemp)
+trap 'rm -f "$metrics" "$out"' EXIT
+
+timeout 3 "$WDLED" --no-daemon --watch --correct --metrics "$metrics" 'sim:flaky!1' 0 >"$out" || [ $? -eq 124 ]
+
+selects=$(sed -n 's/^wdled_scsi_commands_total{command="mode_select",result="clean"} //p' "$metrics")
+if ! grep -q 'corrected' "$out" || [ "${selects:-0}" -ne 1 ]; then
+    echo "FAIL: watch gave up correcting after a failed MODE SELECT (${selects:-0} succeeded)" >&2
+    cat "$out" >&2
+    exit 1
+fi
+echo "PASS: watch corrected a disk after a failed MODE SELECT"
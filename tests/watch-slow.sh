@@ -0,0 +1,20 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# A disk whose poll takes longer than another disk's poll interval must not stop --watch polling.
+# sim:slow takes 2s for its first poll (INQUIRY and MODE SENSE), leaving sim:fast overdue by the time it's done
+set -eu
+
+WDLED=${WDLED:-./wdled}
+metrics=$(mktemp)
+trap 'rm -f "$metrics"' EXIT
+
+timeout 6 "$WDLED" --no-daemon --watch --metrics "$metrics" sim:fast sim:slow@1000000 >/dev/null || [ $? -eq 124 ]
+
+# One MODE SENSE for each disk's first poll, and sim:fast keeps being polled after that
+sense=$(sed -n 's/^wdled_scsi_commands_total{command="mode_sense",result="clean"} //p' "$metrics")
+if [ "${sense:-0}" -le 2 ]; then
+    echo "FAIL: watch stopped polling after a slow disk (${sense:-0} MODE SENSEs)" >&2
+    exit 1
+fi
+echo "PASS: watch kept polling past a slow disk ($sense MODE SENSEs)"
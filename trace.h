@@ -0,0 +1,36 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// USDT probes (provider "wdled"), built in if systemtap's <sys/sdt.h> is available:
+//   device__start(path)                          Starting on a device
+//   device__done(path, err, us)                  Finished with a device, with its enum device_err
+//   command__start(handle, phase)                A SCSI command is being sent (enum phase)
+//   command__done(handle, phase, status, us)     It completed with a SCSI category, or -errno
+// e.g: bpftrace -e 'usdt:./wdled:wdled:command__done { @us[arg1] = hist(arg3); }'
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_DEVICE_START(path)                    DTRACE_PROBE1(wdled, device__start, path)
+#define TRACE_DEVICE_DONE(path, err, us)            DTRACE_PROBE3(wdled, device__done, path, err, us)
+#define TRACE_COMMAND_START(handle, phase)          DTRACE_PROBE2(wdled, command__start, handle, phase)
+#define TRACE_COMMAND_DONE(handle, phase, status, us) DTRACE_PROBE4(wdled, command__done, handle, phase, status, us)
+#endif
+#endif
+#ifndef TRACE_DEVICE_START
+#define TRACE_DEVICE_START(path)                    ((void)(path))
+#define TRACE_DEVICE_DONE(path, err, us)            ((void)(path), (void)(err), (void)(us))
+#define TRACE_COMMAND_START(handle, phase)          ((void)(handle), (void)(phase))
+#define TRACE_COMMAND_DONE(handle, phase, status, us) ((void)(handle), (void)(phase), (void)(status), (void)(us))
+#endif
+
+// CLOCK_MONOTONIC in microseconds
+uint64_t trace_now_us(void);
@@ -0,0 +1,205 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include "metrics.h"
+#include "scsi.h"
+#include "sgio.h"
+#include "sim.h"
+#include "trace.h"
+#include "transport.h"
+
+const struct transport* transport_default = &sgio_transport;
+
+const struct transport* transport_for(const char* path) {
+    if (!strncmp(path, SIM_PREFIX, strlen(SIM_PREFIX))) {
+        return &sim_transport;
+    }
+    return transport_default;
+}
+
+bool transport_is_device(const char* arg) {
+    return strchr(arg, '/') || !strncmp(arg, SIM_PREFIX, strlen(SIM_PREFIX));
+}
+
+void transport_start(const struct request* request, struct plan* plan) {
+    plan->deadline_us = request->deadline_ms ? trace_now_us() + request->deadline_ms * 1000ull : 0;
+}
+
+unsigned transport_timeout(const struct request* request, const struct plan* plan, enum phase phase) {
+    const enum command command = device_phase_command(phase);
+    unsigned timeout_ms = request->timeout_ms ? request->timeout_ms : SCSI_TIMEOUT_MS;
+    if (command != COMMAND_NONE && plan->timeout_ms[command]) {
+        timeout_ms = plan->timeout_ms[command];
+    }
+    if (!plan->deadline_us) {
+        return timeout_ms;
+    }
+    const uint64_t now = trace_now_us();
+    if (now >= plan->deadline_us) {
+        return 0;
+    }
+    const uint64_t remaining_ms = (plan->deadline_us - now + 999) / 1000;
+    return remaining_ms < timeout_ms ? remaining_ms : timeout_ms;
+}
+
+// A command in progress
+struct in_flight {
+    int handle;
+    enum phase phase;
+    unsigned timeout_ms;
+    uint64_t start;
+};
+
+// Start timing a command, and work out its timeout.
+// Returns false, having abandoned the device, if the deadline has already passed
+static bool command_start(struct in_flight* command, int handle, enum phase phase,
+                          const struct request* request, const struct plan* plan, struct result* result) {
+    *command = (struct in_flight){ .handle = handle, .phase = phase, .timeout_ms = transport_timeout(request, plan, phase) };
+    if (!command->timeout_ms) {
+        result->err = DEVICE_ERR_DEADLINE;
+        result->detail = phase;
+        return false;
+    }
+    TRACE_COMMAND_START(handle, phase);
+    command->start = trace_now_us();
+    return true;
+}
+
+// Finish timing a command, passing its status through
+static int command_done(const struct in_flight* command, struct result* result, int status) {
+    const uint64_t us = trace_now_us() - command->start;
+    TRACE_COMMAND_DONE(command->handle, command->phase, status, us);
+#ifndef WDLED_LIBRARY
+    metrics_command(command->phase, status, us); // Process-wide, so left out of libwdled
+#endif
+    device_time_phase(result, command->phase, us);
+    return status;
+}
+
+static bool asleep(const struct transport* transport, int handle, const struct request* request,
+                   const struct plan* plan, struct result* result) {
+    // If the REQUEST SENSE itself fails we can't tell, so assume the disk is awake
+    uint8_t sense[SENSE_LEN] = {};
+    struct in_flight command;
+    if (!command_start(&command, handle, PHASE_REQUEST_SENSE, request, plan, result)) {
+        return false;
+    }
+    const int status = command_done(&command, result,
+                                    transport->request_sense(handle, sense, sizeof(sense), command.timeout_ms));
+    return status == SCSI_CAT_CLEAN && scsi_sense_low_power(sense, sizeof(sense));
+}
+
+bool transport_asleep(const struct transport* transport, int handle, const struct request* request) {
+    struct plan plan = {};
+    transport_start(request, &plan);
+    struct result result = {};
+    return asleep(transport, handle, request, &plan, &result);
+}
+
+static void run(const struct transport* transport, int handle, const struct request* request,
+                const struct plan* plan, struct result* result) {
+    struct in_flight command;
+    int status;
+
+    // Don't go any further if that would spin up a sleeping disk
+    if (plan->power_check && asleep(transport, handle, request, plan, result)) {
+        result->asleep = true;
+        return;
+    }
+    if (result->err != DEVICE_OK) {
+        return;
+    }
+
+    // Verify that we know about the disk model (unless the cache already told us)
+    if (plan->inquiry) {
+        if (!command_start(&command, handle, PHASE_INQUIRY, request, plan, result)) {
+            return;
+        }
+        status = command_done(&command, result, transport->inquiry(handle, &result->identity, command.timeout_ms));
+        if (status != SCSI_CAT_CLEAN) {
+            result->err = DEVICE_ERR_INQUIRY;
+            result->detail = status;
+            return;
+        }
+        result->identified = true;
+        result->support = device_check_identity(&result->identity);
+        if (result->support != DEVICE_OK && !request->force) {
+            result->err = result->support;
+            return;
+        }
+    }
+
+    // Read just the page controls of the mode page that we need
+    for (int pc = device_next_pc(plan, -1); pc >= 0; pc = device_next_pc(plan, pc)) {
+        uint8_t data[MODE_SENSE10_LEN] = {};
+        if (!command_start(&command, handle, PHASE_MODE_SENSE + pc, request, plan, result)) {
+            return;
+        }
+        status = command_done(&command, result, transport->mode_sense10(handle, pc, data, sizeof(data), command.timeout_ms));
+        if (status != SCSI_CAT_CLEAN) {
+            result->err = DEVICE_ERR_MODE_SENSE;
+            result->detail = status;
+            return;
+        }
+        if (!scsi_parse_mode_sense10(data, sizeof(data), device_result_page(result, pc))) {
+            result->err = DEVICE_ERR_MODE_SENSE;
+            result->detail = SCSI_CAT_OTHER;
+            return;
+        }
+        result->pages |= PC_MASK(pc);
+    }
+
+    // Verify details about the modepage
+    result->err = device_check_pages(result);
+    if (result->err != DEVICE_OK) {
+        return;
+    }
+    result->pages_valid = true;
+
+    if (plan->select) {
+        device_plan_save(request, plan, result);
+    }
+    if (plan->select && device_unchanged(request, plan, result)) {
+        result->unchanged = true;
+    } else if (plan->select) {
+        // Build a mode select parameter list payload, and send it!
+        struct select_packet packet;
+        const size_t packet_size = device_select_packet(&packet, &result->current, request->new);
+        if (!command_start(&command, handle, PHASE_MODE_SELECT, request, plan, result)) {
+            return;
+        }
+        status = command_done(&command, result,
+                              transport->mode_select10(handle, result->nv_write, &packet, packet_size, command.timeout_ms));
+        if (status != SCSI_CAT_CLEAN) {
+            result->err = DEVICE_ERR_MODE_SELECT;
+            result->detail = status;
+            return;
+        }
+    }
+}
+
+bool transport_deadline_passed(const struct plan* plan, int status) {
+    return status == SCSI_CAT_TIMEOUT && plan->deadline_us && trace_now_us() >= plan->deadline_us;
+}
+
+void transport_run(const struct transport* transport, int handle, const struct request* request,
+                   const struct plan* plan, struct result* result) {
+    run(transport, handle, request, plan, result);
+
+    // A command that timed out because the deadline cut it short means the device was abandoned
+    if (result->err != DEVICE_OK && transport_deadline_passed(plan, result->detail)) {
+        result->err = DEVICE_ERR_DEADLINE;
+        for (int phase = PHASE_MODE_SELECT; phase >= 0; phase--) {
+            if (result->phases & PHASE_MASK(phase)) {
+                result->detail = phase;
+                break;
+            }
+        }
+    }
+}
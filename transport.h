@@ -0,0 +1,67 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <scsi/sg.h>
+#include "device.h"
+
+// A way of getting SCSI commands to a device.
+// The blocking commands return a SCSI category (SCSI_CAT_CLEAN on success).
+struct transport {
+    const char* name;
+
+    // Open a device, returns a handle or -errno
+    int (*open)(const char* path, bool read_only);
+    void (*close)(int handle);
+    // Each command is aborted (returning SCSI_CAT_TIMEOUT) if it takes longer than timeout_ms
+    int (*request_sense)(int handle, uint8_t* sense, size_t len, unsigned timeout_ms);
+    int (*inquiry)(int handle, struct identity* identity, unsigned timeout_ms);
+    int (*mode_sense10)(int handle, int pc, uint8_t* data, size_t len, unsigned timeout_ms);
+    int (*mode_select10)(int handle, bool save, const void* param, size_t len, unsigned timeout_ms);
+
+    // Non-blocking commands, following the sg v3 write()/read() interface.
+    // Open returns a file descriptor that polls readable when a command has completed, or -errno
+    int (*async_open)(const char* path);
+    void (*async_close)(int fd);
+    // Start a command (with hdr->timeout), returns 0 or -errno. hdr must stay valid until the command is received
+    int (*async_submit)(int fd, struct sg_io_hdr* hdr);
+    // Collect a completed command, returns 0, -EAGAIN if it hasn't completed yet, or -errno
+    int (*async_receive)(int fd, struct sg_io_hdr* hdr);
+};
+
+// The transport for real devices, sgio_transport unless told otherwise
+extern const struct transport* transport_default;
+
+// Pick the transport for a device path (a simulated device, or a real one through transport_default)
+const struct transport* transport_for(const char* path);
+
+// Check whether a command line argument names a device rather than a VALUE
+bool transport_is_device(const char* arg);
+
+// Check whether a disk reports a low power condition, using a REQUEST SENSE that doesn't wake it.
+// The REQUEST SENSE is given request's timeout and deadline
+bool transport_asleep(const struct transport* transport, int handle, const struct request* request);
+
+// Set a plan's deadline from the request, for a device starting now
+void transport_start(const struct request* request, struct plan* plan);
+
+// Timeout for the next command of a plan, in phase: the timeout learnt for the command (or the request's
+// command timeout), cut short by the deadline. Returns 0 if the deadline has already passed
+unsigned transport_timeout(const struct request* request, const struct plan* plan, enum phase phase);
+
+// Check whether a command's status means the plan's deadline cut it short
+bool transport_deadline_passed(const struct plan* plan, int status);
+
+// Carry out a plan on an open device using blocking commands, filling in result.
+// If the deadline passes the device is abandoned with DEVICE_ERR_DEADLINE
+void transport_run(const struct transport* transport, int handle, const struct request* request,
+                   const struct plan* plan, struct result* result);
@@ -0,0 +1,113 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "uevent.h"
+
+#define UEVENT_GROUP_KERNEL 1
+
+int uevent_open(void) {
+    const int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = UEVENT_GROUP_KERNEL,
+    };
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+    // Events come in bursts when a hub full of drives appears, don't drop any
+    const int size = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+    return fd;
+}
+
+bool uevent_read(int fd, char* buf, size_t len, struct uevent* event) {
+    for (;;) {
+        struct sockaddr_nl addr;
+        struct iovec iov = { .iov_base = buf, .iov_len = len - 1 };
+        struct msghdr msg = { .msg_name = &addr, .msg_namelen = sizeof(addr), .msg_iov = &iov, .msg_iovlen = 1 };
+        const ssize_t result = recvmsg(fd, &msg, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf[result] = '\0';
+
+        // Only believe the kernel, anyone else could send us anything
+        if (msg.msg_namelen != sizeof(addr) || addr.nl_pid != 0) {
+            continue;
+        }
+        if (uevent_parse(buf, result, event)) {
+            return true;
+        }
+    }
+}
+
+bool uevent_parse(const char* buf, size_t len, struct uevent* event) {
+    // "action@devpath" followed by NUL separated KEY=VALUE pairs
+    memset(event, 0, sizeof(*event));
+    for (const char* field = buf + strlen(buf) + 1; field < buf + len; field += strlen(field) + 1) {
+        if (!strncmp(field, "ACTION=", 7)) {
+            event->action = field + 7;
+        } else if (!strncmp(field, "DEVPATH=", 8)) {
+            event->devpath = field + 8;
+        } else if (!strncmp(field, "SUBSYSTEM=", 10)) {
+            event->subsystem = field + 10;
+        } else if (!strncmp(field, "DEVTYPE=", 8)) {
+            event->devtype = field + 8;
+        } else if (!strncmp(field, "DEVNAME=", 8)) {
+            event->devname = field + 8;
+        }
+    }
+    return event->action && event->devpath && event->subsystem;
+}
+
+bool uevent_is_scsi_disk(const struct uevent* event) {
+    if (!event->devname || strchr(event->devname, '/')) {
+        return false;
+    }
+    if (!strcmp(event->subsystem, "scsi_generic")) {
+        return true;
+    }
+    return !strcmp(event->subsystem, "block") && event->devtype && !strcmp(event->devtype, "disk");
+}
+
+bool uevent_device_dir(const struct uevent* event, char* dir, size_t len) {
+    // The node is two levels below the SCSI device (.../6:0:0:0/block/sdb or .../6:0:0:0/scsi_generic/sg2).
+    // Work it out from the path alone, as it's already gone from sysfs by the time a remove event arrives
+    char path[PATH_MAX];
+    if (!event->devpath || snprintf(path, sizeof(path), "/sys%s", event->devpath) >= (int)sizeof(path)) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        char* const slash = strrchr(path, '/');
+        if (!slash || slash == path) {
+            return false;
+        }
+        *slash = '\0';
+    }
+    if (strlen(path) >= len) {
+        return false;
+    }
+    strcpy(dir, path);
+    return true;
+}
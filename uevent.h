@@ -0,0 +1,39 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define UEVENT_BUFFER_SIZE 8192
+
+// A kernel uevent, all fields point into the buffer it was read into (NULL if missing)
+struct uevent {
+    const char* action;    // add, remove, change, bind...
+    const char* devpath;   // e.g /devices/pci0000:00/.../host6/target6:0:0/6:0:0:0/scsi_generic/sg2
+    const char* subsystem; // e.g scsi_generic, block
+    const char* devtype;   // e.g disk, partition
+    const char* devname;   // e.g sg2, sdb
+};
+
+// Open a non-blocking netlink socket receiving kernel uevents, returns the socket or -errno
+int uevent_open(void);
+
+// Read a single uevent from the kernel, returns false if there are none (or it wasn't from the kernel)
+bool uevent_read(int fd, char* buf, size_t len, struct uevent* event);
+
+// Parse a uevent message of len bytes in buf, returns false if it's missing the fields every event has
+bool uevent_parse(const char* buf, size_t len, struct uevent* event);
+
+// Is this the whole-disk device node of a SCSI device (an sg node, or a disk rather than a partition)?
+bool uevent_is_scsi_disk(const struct uevent* event);
+
+// Find the sysfs SCSI device directory (e.g /sys/devices/.../6:0:0:0) of a SCSI disk's event,
+// the same for its sg and disk nodes, and even once the device has gone
+bool uevent_device_dir(const struct uevent* event, char* dir, size_t len);
@@ -0,0 +1,304 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "budget.h"
+#include "cache.h"
+#include "metrics.h"
+#include "sysfs.h"
+#include "transport.h"
+#include "uevent.h"
+#include "watch.h"
+
+// A disk being watched
+struct watched {
+    char* path;
+    struct request request;
+    const struct transport* transport;
+    int fd;             // Kept open between polls, -1 if it isn't
+    bool identified;    // The INQUIRY has been checked, so polls only need a MODE SENSE
+    int value;          // Last LED mode seen, -1 if it hasn't been read yet
+    char error[128];    // Last error reported, empty if the last poll worked
+    unsigned interval;  // Milliseconds between polls
+    uint64_t due;       // When to poll next, in CLOCK_MONOTONIC milliseconds
+    bool keep;          // Still in the set passed to watch_set
+};
+
+struct watch {
+    struct watched* disks;
+    size_t count;
+    bool correct;
+    int uevent_fd; // -1 if uevents aren't available, in which case only polling is done
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// Print an event line straight away, so it can be piped into something else
+static void event(const struct watched* disk, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("%s: ", disk->path);
+    vprintf(fmt, args);
+    printf("\n");
+    fflush(stdout);
+    va_end(args);
+}
+
+// Poll soon, something changed
+static void tighten(struct watched* disk, uint64_t now) {
+    disk->interval = WATCH_MIN_MS;
+    disk->due = now;
+}
+
+static void close_disk(struct watched* disk) {
+    if (disk->fd >= 0) {
+        disk->transport->close(disk->fd);
+        disk->fd = -1;
+    }
+    disk->identified = false;
+}
+
+// Report a failed poll, only the first time it fails in a particular way
+static void poll_failed(struct watched* disk, const struct result* result) {
+    char error[sizeof(disk->error)];
+    device_strerror(result, error, sizeof(error));
+    metrics_error(disk->path, result->err);
+    if (strcmp(disk->error, error)) {
+        event(disk, "ERROR: %s", error);
+        strcpy(disk->error, error);
+    }
+    close_disk(disk);
+    disk->interval = WATCH_MIN_MS;
+}
+
+// Set a disk back to its expected value
+static void correct(struct watched* disk) {
+    struct request request = disk->request;
+    request.no_wake = false; // It's just been read, so it's awake
+    struct plan plan = device_plan(&request);
+    plan.inquiry = false;
+    transport_start(&request, &plan);
+    struct result result = {};
+    struct cache_key key;
+    struct budget_key budget;
+    cache_prepare(disk->path, &request, &plan, &result, &key);
+    budget_prepare(disk->path, &request, &plan, &budget);
+    transport_run(disk->transport, disk->fd, &request, &plan, &result);
+    cache_update(&key, &request, &result);
+    budget_update(&budget, &result);
+    if (result.err != DEVICE_OK) {
+        poll_failed(disk, &result);
+        disk->value = -1; // Still drifted, so the next poll reports it and tries again
+        return;
+    }
+    disk->value = request.new;
+    metrics_led(disk->path, disk->value, request.new);
+    event(disk, "current=%d corrected%s", disk->value, result.save_deferred ? " unsaved" : "");
+}
+
+// Read a disk's current LED mode with as few commands as possible: once it's been identified, a single MODE SENSE.
+// Each poll keeps the cache's copy of the current value fresh, for wdled --cached
+static void poll_disk(struct watch* watch, struct watched* disk) {
+    struct request request = disk->request;
+    request.quiet = true;
+    request.new = -1;
+    struct plan plan = device_plan(&request);
+    transport_start(&request, &plan);
+    struct result result = {};
+    struct cache_key key;
+    cache_prepare(disk->path, &request, &plan, &result, &key);
+    if (disk->identified) {
+        // The first poll checked everything, and cached it if it could
+        plan.inquiry = false;
+        plan.page_controls &= ~PC_MASK(PC_CHANGEABLE);
+    }
+
+    if (disk->fd < 0) {
+        // Opening a runtime suspended disk would resume it
+        if (plan.power_check && sysfs_runtime_suspended(disk->path)) {
+            return;
+        }
+        disk->fd = disk->transport->open(disk->path, !watch->correct);
+        if (disk->fd < 0) {
+            result.err = DEVICE_ERR_OPEN;
+            result.detail = disk->fd;
+            poll_failed(disk, &result);
+            return;
+        }
+    }
+    transport_run(disk->transport, disk->fd, &request, &plan, &result);
+    cache_update(&key, &request, &result);
+    if (result.asleep) {
+        return;
+    }
+    if (result.err != DEVICE_OK) {
+        poll_failed(disk, &result);
+        return;
+    }
+    disk->identified = true;
+    disk->error[0] = '\0';
+
+    const int value = result.current.wd21.led;
+    const int expected = disk->request.new;
+    metrics_led(disk->path, value, expected);
+    if (value == disk->value) {
+        // Stable, so back off
+        disk->interval = disk->interval * 2 < WATCH_MAX_MS ? disk->interval * 2 : WATCH_MAX_MS;
+        return;
+    }
+    if (expected >= 0 && value != expected) {
+        event(disk, "current=%d expected=%d drift", value, expected);
+    } else if (disk->value >= 0) {
+        event(disk, "current=%d was=%d", value, disk->value);
+    } else {
+        event(disk, "current=%d", value);
+    }
+    disk->value = value;
+    disk->interval = WATCH_MIN_MS;
+    if (expected >= 0 && value != expected && watch->correct) {
+        correct(disk);
+    }
+}
+
+struct watch* watch_new(bool correct) {
+    struct watch* const watch = calloc(1, sizeof(*watch));
+    if (!watch) {
+        return NULL;
+    }
+    watch->correct = correct;
+    watch->uevent_fd = uevent_open();
+    return watch;
+}
+
+void watch_free(struct watch* watch) {
+    for (size_t i = 0; i < watch->count; i++) {
+        close_disk(&watch->disks[i]);
+        free(watch->disks[i].path);
+    }
+    if (watch->uevent_fd >= 0) {
+        close(watch->uevent_fd);
+    }
+    free(watch->disks);
+    free(watch);
+}
+
+bool watch_set(struct watch* watch, const char* const* paths, const struct request* requests, size_t count) {
+    const uint64_t now = now_ms();
+    for (size_t i = 0; i < watch->count; i++) {
+        watch->disks[i].keep = false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct watched* disk = NULL;
+        for (size_t j = 0; !disk && j < watch->count; j++) {
+            if (!strcmp(watch->disks[j].path, paths[i])) {
+                disk = &watch->disks[j];
+            }
+        }
+        if (!disk) {
+            struct watched* const disks = realloc(watch->disks, (watch->count + 1) * sizeof(*disks));
+            if (!disks) {
+                return false;
+            }
+            watch->disks = disks;
+            disk = &watch->disks[watch->count];
+            *disk = (struct watched){
+                .path = strdup(paths[i]),
+                .transport = transport_for(paths[i]),
+                .fd = -1,
+                .value = -1,
+            };
+            if (!disk->path) {
+                return false;
+            }
+            watch->count++;
+        }
+        disk->request = requests[i];
+        disk->keep = true;
+        // A hotplug can be a USB reset, which drops volatile settings
+        tighten(disk, now);
+    }
+
+    // Forget disks that have gone away
+    size_t kept = 0;
+    for (size_t i = 0; i < watch->count; i++) {
+        struct watched* const disk = &watch->disks[i];
+        if (disk->keep) {
+            watch->disks[kept++] = *disk;
+        } else {
+            event(disk, "removed");
+            metrics_forget(disk->path);
+            close_disk(disk);
+            free(disk->path);
+        }
+    }
+    watch->count = kept;
+    return true;
+}
+
+// Read every pending uevent, returns true if any of them was for a disk.
+// A disk that appeared or changed may have been reset, so its cached LED values are expired
+static bool hotplugged(int fd) {
+    char buf[UEVENT_BUFFER_SIZE];
+    struct uevent event;
+    bool result = false;
+    while (uevent_read(fd, buf, sizeof(buf), &event)) {
+        if (!uevent_is_scsi_disk(&event)) {
+            continue;
+        }
+        char dir[PATH_MAX];
+        if ((!strcmp(event.action, "add") || !strcmp(event.action, "change")) && uevent_device_dir(&event, dir, sizeof(dir))) {
+            cache_expire(dir);
+        }
+        result = true;
+    }
+    return result;
+}
+
+bool watch_wait(struct watch* watch) {
+    for (;;) {
+        // Poll whatever is due, and work out how long until the next one
+        uint64_t now = now_ms(), next = now + WATCH_MAX_MS;
+        for (size_t i = 0; i < watch->count; i++) {
+            struct watched* const disk = &watch->disks[i];
+            if (disk->due <= now) {
+                poll_disk(watch, disk);
+                now = now_ms();
+                disk->due = now + disk->interval;
+            }
+            if (disk->due < next) {
+                next = disk->due;
+            }
+        }
+
+        metrics_flush();
+        // A slow poll can leave other disks overdue, in which case don't wait at all
+        const uint64_t wait = next > now ? next - now : 0;
+        struct pollfd pfd = { .fd = watch->uevent_fd, .events = POLLIN };
+        const int result = poll(&pfd, 1, wait < INT_MAX ? (int)wait : INT_MAX);
+        if (result < 0 && errno != EINTR) {
+            return false;
+        }
+        if (result > 0 && hotplugged(watch->uevent_fd)) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * wdled - Control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "device.h"
+
+// Each disk is polled every WATCH_MIN_MS at first, backing off to WATCH_MAX_MS while its LED mode stays the same
+#define WATCH_MIN_MS 1000
+#define WATCH_MAX_MS 60000
+
+struct watch;
+
+// Start watching, correct is whether to set disks back to their expected value when they drift from it
+struct watch* watch_new(bool correct);
+void watch_free(struct watch* watch);
+
+// Replace the set of disks being watched. A disk's request gives its expected value, if it has one.
+// Disks that were already being watched keep their state, but are polled again soon, as something changed
+bool watch_set(struct watch* watch, const char* const* paths, const struct request* requests, size_t count);
+
+// Poll the disks as they come due, printing a line whenever one changes, until a disk is hotplugged.
+// Returns true when the set of disks should be rebuilt and passed to watch_set, or false on a fatal error
+bool watch_wait(struct watch* watch);
@@ -29,239 +29,1018 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
-#include <scsi/sg_cmds_basic.h>
-#include <scsi/sg_lib.h>
+#include <unistd.h>
+#include "async.h"
+#include "batch.h"
+#include "budget.h"
+#include "cache.h"
+#include "device.h"
+#include "discover.h"
+#include "health.h"
+#include "journal.h"
+#include "metrics.h"
+#include "policy.h"
+#include "proto.h"
+#include "sched.h"
+#include "scsi.h"
+#ifdef HAVE_SGUTILS
+#include "sgutils.h"
+#endif
+#include "sysfs.h"
+#include "trace.h"
+#include "transport.h"
+#include "watch.h"
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 #define CMD_NAME    "wdled"
-#define CMD_VER     "v0.1"
-#define CMD_URL     "https://jbit.net/wdled/"
-#define PAGE_CODE   0x21
-#define PAGE_MAGIC  0x30
-#define PS_BIT      (1<<7) // Parameters saveable
-#define SPF_BIT     (1<<6) // Sub page format
-
-// A list of verified working WD product names
-const char* wd_products[] = {
-    "My Passport 0837",
-    "My Passport 259D",
-    "My Passport 259E",
-    "My Passport 259F",
-    "My Passport 259A",
-    "My Passport 25E1",
-    "My Passport 25E2",
-    NULL,
-};
 
-static const struct { const char* vendor; const char** products; } supported[] = {
-    { vendor: "WD      ", products: wd_products },
-    { vendor: NULL,       products: NULL },
+// A growable list of device paths, and what to do with each of them
+struct device_list {
+    char** paths;
+    struct request* requests;
+    size_t count;
+    size_t capacity;
 };
 
-struct page {
-    // Header bytes
-    uint8_t code; // Page code and PS/SPF bits
-    uint8_t len;  // Length of parameters in bytes
-
-    // Payload
-    union {
-        struct {
-            // Guessed layout of the WD 0x21 mode page
-            uint8_t magic; // Version? Always 0x30. Not modifiable
-            uint8_t zeros0;
-            uint8_t zeros1;
-            uint8_t unknown1; // Flags? some bits modifiable
-            uint8_t zeros2;
-            uint8_t zeros3;
-            uint8_t led;      // LED control 0x00=off, 0xff=on, other=Error
-            uint8_t zeros4;
-            uint8_t zeros5;
-            uint8_t zeros6;
-        } wd21;
-        uint8_t bytes[32];
-    };
-};
+static void usage(const char* argv0) {
+    eprintf("%s %s (%s) - Control the LED mode of WD My Passport Disks\n", CMD_NAME, CMD_VER, CMD_URL);
+#ifdef HAVE_SGUTILS
+    eprintf("sg_cmds v%s\n", sgutils_version());
+#endif
+    eprintf("Usage: %s [OPTIONS] DEVICE... [VALUE]\n", argv0);
+    eprintf("       %s [OPTIONS] --all [VALUE]\n", argv0);
+    eprintf("       %s [OPTIONS] --apply-policy FILE [DEVICE...]\n", argv0);
+    eprintf("       %s [OPTIONS] --watch [--correct] DEVICE...|--all|--apply-policy FILE [VALUE]\n", argv0);
+    eprintf("       %s --scan\n", argv0);
+    eprintf("  DEVICE: SCSI device to control (e.g /dev/disk/by-id/usb-WD_My_Passport_...)\n");
+    eprintf("          May be given more than once, and may be a quoted glob pattern\n");
+    eprintf("  VALUE:  LED mode to set ('on' or 'off', 0 or 255)\n");
+    eprintf("          Omit to read current mode\n");
+    eprintf("          Prefix with 'save:' to have the disk remember the LED mode\n");
+    eprintf("\n");
+    eprintf("Options:\n");
+    eprintf("  --all         Operate on every supported disk, as listed by --scan\n");
+    eprintf("  --watch       Keep polling the LED mode, printing a line whenever it changes or drifts from VALUE or the policy\n");
+    eprintf("  --correct     With --watch, set disks that drift back to VALUE or their policy's value\n");
+    eprintf("  --quarantine skip|last\n");
+    eprintf("                Skip disks that keep failing or being slow (quarantined), or leave them until last (%s)\n", STATE_DIR);
+    eprintf("  --adaptive-timeout\n");
+    eprintf("                Time commands out based on the latencies seen from each disk's model\n");
+    eprintf("  --journal FILE\n");
+    eprintf("                Record each disk's outcome in FILE as it finishes, so an interrupted sweep can be resumed\n");
+    eprintf("  --resume FILE\n");
+    eprintf("                Skip disks FILE records as done with the same value, and carry on recording in it\n");
+    eprintf("  --metrics FILE\n");
+    eprintf("                With --watch, keep FILE up to date with metrics for node_exporter's textfile collector\n");
+    eprintf("  --scan        List every supported disk, using only what the kernel has cached in sysfs\n");
+    eprintf("  --async       Operate on all disks from a single thread using the /dev/sg read/write interface\n");
+    eprintf("  -j, --jobs N  Operate on up to N disks in parallel (default %d)\n", BATCH_DEFAULT_JOBS);
+    eprintf("  --per-hub N   Operate on up to N disks behind each USB hub at once (default %d)\n", SCHED_DEFAULT_PER_HUB);
+    eprintf("  --per-bus N   Operate on up to N disks on each USB bus (host controller) at once (default %d)\n", SCHED_DEFAULT_PER_BUS);
+    eprintf("  --apply-policy FILE\n");
+    eprintf("                Set each disk (or every disk, if none are given) to the value of the first matching rule in FILE\n");
+    eprintf("  --quiet-get   Only read and print the current LED mode (a single MODE SENSE)\n");
+    eprintf("  --full        Read and validate every page control (current, changeable, default and saved)\n");
+    eprintf("  --no-cache    Don't use or update the drive capability cache (%s)\n", CACHE_DIR);
+    eprintf("  --cached[=S]  Read the LED mode from the cache without touching the disk, if it was seen in the last S seconds (default %d)\n", CACHE_TTL_S);
+    eprintf("  --timeout MS  Abort any SCSI command that takes longer than MS milliseconds (default %d)\n", SCSI_TIMEOUT_MS);
+    eprintf("  --deadline MS Give up on a disk that hasn't finished within MS milliseconds, reporting it as timed out\n");
+    eprintf("  --save-budget N\n");
+    eprintf("                Save the LED mode of each disk at most N times a day, just setting it once that's used up (%s)\n", STATE_DIR);
+    eprintf("  --json        Print one JSON object per disk as it finishes, instead of the usual output\n");
+    eprintf("  --timing      Print how long each phase (open, each command, close) took for each disk\n");
+    eprintf("  --no-wake     Don't wake sleeping disks: read their LED mode from the cache, and leave it unchanged\n");
+    eprintf("  --no-daemon   Talk to the disk directly, even if wdledd is running (%s)\n", DAEMON_SOCKET);
+#ifdef HAVE_SGUTILS
+    eprintf("  --sgutils     Send blocking commands through sg3_utils instead of SG_IO directly\n");
+#endif
+    eprintf("\n");
+    eprintf("Example: (to turn the LED off permanently)\n");
+    eprintf("  %s /dev/disk/by-id/usb-WD_My_Passport_foo save:off\n", argv0);
+    eprintf("\n");
+    eprintf("Supported devices:\n");
+    for (size_t vid=0; supported[vid].vendor; vid++) {
+        for (size_t pid=0; supported[vid].products[pid]; pid++) {
+            eprintf("  %s %s\n", supported[vid].vendor, supported[vid].products[pid]);
+        }
+    }
+}
 
-// This can be entirely zero for a MODE SELECT packet
-struct mode_parameter_header {
-    uint16_t len;
-    uint8_t  medium_type;
-    uint8_t  flags0; // WP/DPOFUA bits
-    uint8_t  flags1; // LONGLBA bit
-    uint8_t  reserved;
-    uint16_t block_descriptor_length;
+// Parse a positive integer option argument
+static bool parse_count(const char* arg, long* count) {
+    char* endptr;
+    const long value = strtol(arg, &endptr, 10);
+    if (!*arg || *endptr || value < 1) {
+        eprintf("Invalid count: %s\n", arg);
+        return false;
+    }
+    *count = value;
+    return true;
+}
+
+// As parse_count, for a count that has to fit in an unsigned
+static bool parse_unsigned(const char* arg, unsigned* count) {
+    long value;
+    if (!parse_count(arg, &value)) {
+        return false;
+    }
+    if (value > UINT_MAX) {
+        eprintf("Invalid count: %s\n", arg);
+        return false;
+    }
+    *count = value;
+    return true;
+}
+
+static bool device_list_add(struct device_list* list, const char* path, const struct request* request) {
+    if (list->count == list->capacity) {
+        const size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        char** paths = realloc(list->paths, capacity * sizeof(*paths));
+        if (!paths) {
+            return false;
+        }
+        list->paths = paths;
+        struct request* requests = realloc(list->requests, capacity * sizeof(*requests));
+        if (!requests) {
+            return false;
+        }
+        list->requests = requests;
+        list->capacity = capacity;
+    }
+    if (!(list->paths[list->count] = strdup(path))) {
+        return false;
+    }
+    list->requests[list->count] = *request;
+    list->count++;
+    return true;
+}
+
+static void device_list_free(struct device_list* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    free(list->requests);
+    memset(list, 0, sizeof(*list));
+}
+
+// A device in the list, and the physical disk behind it
+struct disk_key {
+    char* key;
+    size_t index;
 };
 
+static int compare_disk_keys(const void* a, const void* b) {
+    const struct disk_key* const ka = a;
+    const struct disk_key* const kb = b;
+    const int result = strcmp(ka->key, kb->key);
+    return result ? result : (ka->index > kb->index) - (ka->index < kb->index);
+}
 
-int main(const int argc, const char* const argv[]) {
-    if (argc < 2 || argc > 3 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-help") || !strcmp(argv[1], "-h")) {
-        // Print basic help
-        eprintf("%s %s (%s) - Control the LED mode of WD My Passport Disks\n", CMD_NAME, CMD_VER, CMD_URL);
-        eprintf("sg_cmds v%s\n", sg_cmds_version());
-        eprintf("Usage: %s DEVICE [VALUE]\n", argv[0]);
-        eprintf("  DEVICE: SCSI device to control (e.g /dev/disk/by-id/usb-WD_My_Passport_...)\n");
-        eprintf("  VALUE:  LED mode to set ('on' or 'off', 0 or 255)\n");
-        eprintf("          Omit to read current mode\n");
-        eprintf("          Prefix with 'save:' to have the disk remember the LED mode\n");  
-        eprintf("\n");
-        eprintf("Example: (to turn the LED off permanently)\n");
-        eprintf("  %s /dev/disk/by-id/usb-WD_My_Passport_foo save:off\n", argv[0]);
-        eprintf("\n");
-        eprintf("Supported devices:\n");
-        for (size_t vid=0; supported[vid].vendor; vid++) {
-            for (size_t pid=0; supported[vid].products[pid]; pid++) {
-                eprintf("  %s %s\n", supported[vid].vendor, supported[vid].products[pid]);
-            }
+// Collapse every path to the same disk (e.g /dev/sdb, /dev/sg2 and its /dev/disk/by-id names) into the first one,
+// so no disk is sent the same commands twice, or two MODE SELECTs at once.
+// Fails if the paths to one disk were given different values
+static bool device_list_dedupe(struct device_list* list) {
+    struct disk_key* const keys = calloc(list->count, sizeof(*keys));
+    bool ok = keys != NULL;
+    for (size_t i = 0; ok && i < list->count; i++) {
+        char key[128];
+        keys[i].index = i;
+        // Anything that isn't a SCSI device (e.g a simulated one) is only the same disk if it's the same path
+        keys[i].key = strdup(sysfs_disk_key(list->paths[i], key, sizeof(key)) ? key : list->paths[i]);
+        ok = keys[i].key != NULL;
+    }
+    if (!ok) {
+        eprintf("ERROR: Out of memory\n");
+    }
+
+    // Sorting puts every path to a disk next to each other, with the first one given at the front
+    if (ok) {
+        qsort(keys, list->count, sizeof(*keys), compare_disk_keys);
+    }
+    for (size_t i = 1, first = 0; ok && i < list->count; i++) {
+        if (strcmp(keys[first].key, keys[i].key)) {
+            first = i;
+            continue;
         }
+        const size_t kept = keys[first].index, dup = keys[i].index;
+        if (list->requests[kept].new != list->requests[dup].new || list->requests[kept].save != list->requests[dup].save) {
+            eprintf("ERROR: %s and %s are the same disk, but were given different values\n", list->paths[kept], list->paths[dup]);
+            ok = false;
+        }
+        free(list->paths[dup]);
+        list->paths[dup] = NULL;
+    }
+
+    for (size_t i = 0; keys && i < list->count; i++) {
+        free(keys[i].key);
+    }
+    free(keys);
+    if (!ok) {
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->paths[i]) {
+            list->paths[count] = list->paths[i];
+            list->requests[count] = list->requests[i];
+            count++;
+        }
+    }
+    list->count = count;
+    return true;
+}
+
+// Add every device matching a glob pattern
+static bool device_list_glob(struct device_list* list, const char* pattern, const struct request* request) {
+    glob_t matches;
+    const int result = glob(pattern, 0, NULL, &matches);
+    if (result == GLOB_NOMATCH) {
+        return true;
+    } else if (result != 0) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < matches.gl_pathc; i++) {
+        ok = device_list_add(list, matches.gl_pathv[i], request);
+    }
+    globfree(&matches);
+    return ok;
+}
+
+// Add every supported disk that sysfs knows about
+static bool device_list_scan(struct device_list* list, const struct request* request) {
+    struct scan_list scan;
+    if (!discover_scan(&scan)) {
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < scan.count; i++) {
+        ok = device_list_add(list, discover_scan_path(&scan.devices[i]), request);
+    }
+    discover_scan_free(&scan);
+    return ok;
+}
+
+// List every supported disk, without sending any of them a command
+static int scan(void) {
+    struct scan_list scan;
+    if (!discover_scan(&scan)) {
+        eprintf("ERROR: Failed to scan %s and %s\n", SYSFS_BLOCK_DIR, SYSFS_SG_DIR);
         return 1;
     }
+    for (size_t i = 0; i < scan.count; i++) {
+        const struct scanned* const scanned = &scan.devices[i];
+        const struct identity* const identity = &scanned->identity;
+        printf("%s: %s %s (rev %s) [%s", discover_scan_path(scanned), identity->vendor, identity->product,
+               identity->revision, strrchr(scanned->dir, '/') + 1);
+        if (scanned->node[0] && scanned->sg[0]) {
+            printf(" %s", scanned->sg);
+        }
+        printf("]\n");
+    }
+    const size_t count = scan.count;
+    discover_scan_free(&scan);
+    return count ? 0 : 1;
+}
 
-    // Process argument
-    bool force = false;
-    bool save = false;
-    int new = -1;
-    if (argc > 2) {
-        const char* arg = argv[2];
-        if (!strcmp(arg, "FORCEGET")) {
-            // Get value, with no vendor/product checks
-            force = true;
-        } else {
-            const char* const force_str = "FORCESET:";
-            if (!strncmp(arg, force_str, strlen(force_str))) {
-                // Set value, with no vendor/product checks
-                arg += strlen(force_str);
-                force = true;
-            }
-            const char* const save_str = "save:";
-            if (!strncasecmp(arg, save_str, strlen(save_str))) {
-                // Set value, and save
-                arg += strlen(save_str);
-                save = true;
-            }
-            if (!strcmp(arg, "off")) {
-                new = 0;
-            } else if (!strcmp(arg, "on")) {
-                new = 255;
-            } else {
-                char* endptr;
-                new = strtol(arg, &endptr, 0);
-                if (endptr != (arg + strlen(arg)) || new < 0x00 || new > 0xff) {
-                    eprintf("Unknown value: %s\n", arg);
-                    return 1;
+// Number of devices that had a new LED mode written (rather than already having it)
+static atomic_size_t written;
+
+// Number of devices left alone because they were asleep (with --no-wake)
+static atomic_size_t asleep;
+
+// Number of devices skipped because they're quarantined (with --quarantine skip)
+static size_t quarantined;
+
+// Number of devices skipped because the journal being resumed has them as done
+static size_t resumed;
+
+// Check whether a device was quietly skipped for being unsupported (with --all or a policy)
+static bool skipped(const struct request* request, const struct result* result) {
+    return result->identified && result->support != DEVICE_OK && !request->force && request->skip_unsupported;
+}
+
+// Check whether a device was left alone because it was asleep (rather than answered from the cache)
+static bool left_asleep(const struct request* request, const struct result* result) {
+    return result->asleep && (request->new >= 0 ? !result->unchanged : !result->pages_valid);
+}
+
+// Count the outcome of a device towards the exit status, returns non-zero if it failed
+static int tally(const struct request* request, const struct result* result) {
+    if (skipped(request, result)) {
+        return 0;
+    }
+    if (left_asleep(request, result)) {
+        asleep++;
+        return 0;
+    }
+    if (result->err == DEVICE_OK) {
+        if (request->new >= 0 && !result->unchanged) {
+            written++;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Name what happened to a device, for --json and the journal
+static const char* action_name(const struct request* request, const struct result* result) {
+    if (skipped(request, result)) {
+        return "skipped";
+    } else if (left_asleep(request, result)) {
+        return "asleep";
+    } else if (result->err != DEVICE_OK) {
+        return "error";
+    } else if (request->new < 0) {
+        return "read";
+    } else if (result->unchanged) {
+        return "unchanged";
+    }
+    return result->nv_write ? "saved" : "set";
+}
+
+// Check whether a device needs nothing more doing to it, so a resumed sweep can skip it
+static bool finished(const struct request* request, const struct result* result) {
+    return skipped(request, result)
+           || (result->err == DEVICE_OK && !left_asleep(request, result) && !result->save_deferred);
+}
+
+// Print the outcome of a device as one JSON record, as soon as it's known
+static int report_json(const char* device, const struct request* request, const struct result* result) {
+    char record[PATH_MAX * 2 + 1024];
+    device_format_json(device, action_name(request, result), result, record, sizeof(record));
+    printf("%s\n", record);
+    fflush(stdout);
+    return tally(request, result);
+}
+
+// Print the outcome of operating on a device, returns non-zero if it failed
+static int report(const char* device, const struct request* request, const struct result* result) {
+    // Journal it first, so anything reported as done is already on disk
+    if (request->journal) {
+        journal_record(device, request, action_name(request, result), finished(request, result));
+    }
+    if (request->json) {
+        return report_json(device, request, result);
+    }
+    if (request->timing) {
+        char timing[256];
+        device_format_timing(result, timing, sizeof(timing));
+        eprintf("%s: timing %s\n", device, timing);
+    }
+    if (result->identified) {
+        const struct identity* const identity = &result->identity;
+        eprintf("%s: %s %s (rev %s)\n", device, identity->vendor, identity->product, identity->revision);
+        if (result->support != DEVICE_OK) {
+            if (request->force) {
+                if (result->support == DEVICE_ERR_VENDOR) {
+                    eprintf("MANUALLY SKIPPED UNSUPPORTED VENDOR CHECK!\n");
+                } else {
+                    eprintf("MANUALLY SKIPPED UNSUPPORTED DEVICE CHECK!\n");
                 }
+            } else if (request->skip_unsupported) {
+                eprintf("%s: Skipping unsupported device\n", device);
+                return tally(request, result);
             }
         }
     }
-    if (force) {
-        eprintf("WARNING: Skipping supported vendor/product checks!\n");
+
+    if (result->pages_valid) {
+        // Print the LED values!
+        const char* const prefix = request->prefix ? device : "";
+        const char* const separator = request->prefix ? ": " : "";
+        if (request->quiet) {
+            printf("%s%s%d\n", prefix, separator, result->current.wd21.led);
+        } else {
+            char values[64];
+            device_format_values(result, values, sizeof(values));
+            printf("%s%sLED: %s%s%s\n", prefix, separator, values,
+                   result->unchanged ? " unchanged" : "", result->cached ? " cached" : "");
+        }
     }
 
-    const char* const device = argv[1];
-    const bool read_only = new < 0;
-    const int verbose = 0;
-    const bool noisy = true;
+    if (result->save_deferred) {
+        eprintf("%s: Non-volatile write budget used up, LED mode set but not saved\n", device);
+    }
+    if (left_asleep(request, result)) {
+        eprintf("%s: Disk is asleep, %s\n", device, request->new >= 0 ? "not changing the LED mode" : "and its LED mode isn't cached");
+    } else if (result->err != DEVICE_OK) {
+        char message[128];
+        device_strerror(result, message, sizeof(message));
+        eprintf("%s: ERROR: %s\n", device, message);
+    }
+    return tally(request, result);
+}
 
-    int fd = sg_cmds_open_device(device, read_only, verbose);
-    if(fd < 0) {
-        eprintf("%s: ERROR: Failed to open (%s)\n", device, safe_strerror(-fd));
-        return 1;
+// Report a device that's being skipped before anything is done to it
+static void report_held(const char* device, const struct request* request, const char* action, const char* message) {
+    if (request->json) {
+        const struct result result = {};
+        char record[PATH_MAX * 2 + 1024];
+        device_format_json(device, action, &result, record, sizeof(record));
+        printf("%s\n", record);
+        fflush(stdout);
+    } else {
+        eprintf("%s: %s, skipped\n", device, message);
     }
+}
 
-    // Verify that we know about the disk model
+static int wdled_device(const char* device, const struct request* request) {
+    const bool read_only = request->new < 0;
+    struct plan plan = device_plan(request);
+    struct result result = {};
+    struct cache_key key;
+    struct budget_key budget;
+    struct health_key health;
+    const uint64_t started = trace_now_us();
+    TRACE_DEVICE_START(device);
+    transport_start(request, &plan);
+    cache_prepare(device, request, &plan, &result, &key);
+    budget_prepare(device, request, &plan, &budget);
+    health_prepare(device, request, &plan, &health);
 
-    struct sg_simple_inquiry_resp inquiry;
-    int result = sg_simple_inquiry(fd, &inquiry, noisy, verbose);
-    if(result != 0) {
-        eprintf("%s: ERROR: Inquiry failed (%s)\n", device, safe_strerror(result));
-        return 1;
+    if (cache_answer(&key, request, &plan, &result)) {
+        // Answered without touching the disk
+    } else if (plan.power_check && sysfs_runtime_suspended(device)) {
+        // Opening a runtime suspended disk would resume it
+        result.asleep = true;
+    } else {
+        const struct transport* const transport = transport_for(device);
+        uint64_t start = trace_now_us();
+        int fd = transport->open(device, read_only);
+        device_time_phase(&result, PHASE_OPEN, trace_now_us() - start);
+        if(fd < 0) {
+            result.err = DEVICE_ERR_OPEN;
+            result.detail = fd;
+        } else {
+            transport_run(transport, fd, request, &plan, &result);
+            start = trace_now_us();
+            transport->close(fd);
+            device_time_phase(&result, PHASE_CLOSE, trace_now_us() - start);
+        }
     }
-    eprintf("%s: %s %s (rev %s)\n", device, inquiry.vendor, inquiry.product, inquiry.revision);
-    size_t vid = 0, pid = 0;
-    for (vid=0; supported[vid].vendor; vid++) {
-        if (!strcmp(supported[vid].vendor, inquiry.vendor)) {
-            for (pid=0; supported[vid].products[pid]; pid++) {
-                if (!strcmp(supported[vid].products[pid], inquiry.product)) {
-                    break;
-                }
+    result.elapsed_us = trace_now_us() - started;
+    TRACE_DEVICE_DONE(device, result.err, result.elapsed_us);
+    if (result.asleep) {
+        cache_recall(&key, request, &plan, &result);
+    }
+    cache_update(&key, request, &result);
+    budget_update(&budget, &result);
+    health_update(&health, &result);
+    return report(device, request, &result);
+}
+
+// Forward a request for a single device to wdledd, returns -1 if the daemon isn't running
+static int wdled_daemon(const char* device, const struct request* request) {
+    // Let the direct path report any problems with the device path itself
+    char canonical[PATH_MAX];
+    if (!realpath(device, canonical)) {
+        return -1;
+    }
+    const int fd = proto_connect(DAEMON_SOCKET);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char line[PROTO_LINE_MAX], response[PROTO_LINE_MAX];
+    int result;
+    if (request->new < 0 && request->cached_s) {
+        result = snprintf(line, sizeof(line), "GET %s %u", canonical, request->cached_s);
+    } else if (request->new < 0) {
+        result = snprintf(line, sizeof(line), "GET %s", canonical);
+    } else {
+        result = snprintf(line, sizeof(line), "SET %s %s%d", canonical, request->save ? "save:" : "", request->new);
+    }
+    if (result < 0 || (size_t)result >= sizeof(line)) {
+        close(fd);
+        return -1;
+    }
+    result = proto_transact(fd, line, response, sizeof(response));
+    close(fd);
+    if (result != 0) {
+        return -1;
+    }
+
+    if (!strncmp(response, "OK ", 3)) {
+        const char* const current = strstr(response, "current=");
+        if (request->quiet && current) {
+            printf("%d\n", atoi(current + strlen("current=")));
+        } else {
+            printf("LED: %s\n", response + 3);
+        }
+        if (request->new >= 0 && !strstr(response, " unchanged")) {
+            written++;
+        }
+        return 0;
+    }
+    eprintf("%s: ERROR: %s\n", device, !strncmp(response, "ERR ", 4) ? response + 4 : response);
+    return 1;
+}
+
+static int wdled_batch_device(void* ctx, size_t index) {
+    const struct device_list* const devices = ctx;
+    return wdled_device(devices->paths[index], &devices->requests[index]);
+}
+
+static int wdled_async_done(void* ctx, size_t index, const struct result* result) {
+    const struct device_list* const devices = ctx;
+    return report(devices->paths[index], &devices->requests[index], result);
+}
+
+static bool quarantine_held(const char* device, const struct request* request) {
+    (void)request;
+    return health_quarantined(device);
+}
+
+// Move the devices that hold() picks out of a list and into held, keeping their order
+static bool device_list_hold(struct device_list* list, struct device_list* held,
+                             bool (*hold)(const char* device, const struct request* request)) {
+    size_t count = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (!hold(list->paths[i], &list->requests[i])) {
+            list->paths[count] = list->paths[i];
+            list->requests[count] = list->requests[i];
+            count++;
+        } else if (device_list_add(held, list->paths[i], &list->requests[i])) {
+            free(list->paths[i]);
+        } else {
+            return false;
+        }
+    }
+    list->count = count;
+    return true;
+}
+
+// Replace the list of devices with the devices the policy has a rule for (every disk, if the list is empty)
+static bool apply_policy(struct device_list* devices, const char* policy_path, const struct request* request) {
+    char error[256];
+    struct policy* const policy = policy_load(policy_path, error, sizeof(error));
+    if (!policy) {
+        eprintf("%s: ERROR: %s\n", policy_path, error);
+        return false;
+    }
+    struct disk_list disks;
+    if (!discover_by_id(&disks)) {
+        eprintf("ERROR: Failed to read %s\n", BY_ID_DIR);
+        policy_free(policy);
+        return false;
+    }
+
+    struct device_list targets = {};
+    bool ok = true;
+    if (devices->count == 0) {
+        // Reconcile every supported disk, quietly skipping any the INQUIRY disagrees with
+        struct scan_list scan;
+        ok = discover_scan(&scan);
+        for (size_t i = 0; ok && i < scan.count; i++) {
+            const char* const path = discover_scan_path(&scan.devices[i]);
+            const struct disk* const disk = discover_find(&disks, path);
+            const struct policy_rule* const rule = policy_lookup_node(policy, path,
+                disk ? (const char* const*)disk->ids : NULL, disk ? disk->nids : 0);
+            if (rule) {
+                struct request target = *request;
+                target.new = rule->request.new;
+                target.save = rule->request.save;
+                target.skip_unsupported = true;
+                ok = device_list_add(&targets, path, &target);
             }
-            break;
         }
+        discover_scan_free(&scan);
     }
-    if (!supported[vid].vendor) {
-        if (!force) {
-            eprintf("%s: ERROR: Unknown or unsupported vendor!\n", device);
-            return 1;
+    for (size_t i = 0; ok && i < devices->count; i++) {
+        char node[PATH_MAX];
+        const struct disk* const disk = realpath(devices->paths[i], node) ? discover_find(&disks, node) : NULL;
+        const struct policy_rule* const rule = policy_lookup_node(policy, devices->paths[i],
+            disk ? (const char* const*)disk->ids : NULL, disk ? disk->nids : 0);
+        if (!rule) {
+            eprintf("%s: No matching policy rule\n", devices->paths[i]);
+            continue;
+        }
+        struct request target = devices->requests[i];
+        target.new = rule->request.new;
+        target.save = rule->request.save;
+        ok = device_list_add(&targets, devices->paths[i], &target);
+    }
+    discover_free(&disks);
+    policy_free(policy);
+    if (!ok) {
+        eprintf("ERROR: Failed to build device list\n");
+        return false;
+    }
+
+    *devices = targets;
+    return true;
+}
+
+// What to operate on, from the command line
+struct targets {
+    bool all;
+    const char* const* args;
+    int nargs;
+    const char* policy_path;
+};
+
+// Gather up the list of devices, and what to do with each of them. Reports why if it fails
+static bool gather_devices(struct device_list* devices, const struct targets* targets, struct request* request) {
+    bool ok = true;
+    if (targets->all) {
+        request->skip_unsupported = true;
+        request->prefix = true;
+        ok = device_list_scan(devices, request);
+    }
+    for (int i = 0; ok && i < targets->nargs; i++) {
+        const char* const arg = targets->args[i];
+        if (strpbrk(arg, "*?[")) {
+            const size_t count = devices->count;
+            request->prefix = true;
+            ok = device_list_glob(devices, arg, request);
+            if (ok && devices->count == count) {
+                eprintf("%s: ERROR: No matching devices\n", arg);
+                return false;
+            }
         } else {
-            eprintf("MANUALLY SKIPPED UNSUPPORTED VENDOR CHECK!\n");
+            ok = device_list_add(devices, arg, request);
+        }
+    }
+    if (!ok) {
+        eprintf("ERROR: Failed to build device list\n");
+        return false;
+    }
+    if (targets->policy_path) {
+        request->prefix = true;
+        if (!apply_policy(devices, targets->policy_path, request)) {
+            return false;
+        }
+    }
+    return devices->count <= 1 || device_list_dedupe(devices);
+}
+
+// Poll the devices forever, reporting changes, and gathering them up again whenever a disk is hotplugged
+static int wdled_watch(const struct targets* targets, const struct request* request, bool correct) {
+    struct watch* const watch = watch_new(correct);
+    if (!watch) {
+        eprintf("ERROR: Out of memory\n");
+        return 1;
+    }
+    bool ok = true;
+    while (ok) {
+        struct device_list devices = {};
+        struct request gathered = *request;
+        ok = gather_devices(&devices, targets, &gathered);
+        if (ok && !watch_set(watch, (const char* const*)devices.paths, devices.requests, devices.count)) {
+            eprintf("ERROR: Out of memory\n");
+            ok = false;
+        }
+        device_list_free(&devices);
+        if (ok && !watch_wait(watch)) {
+            eprintf("ERROR: Failed to wait for devices (%s)\n", strerror(errno));
+            ok = false;
         }
+    }
+    watch_free(watch);
+    return 1;
+}
+
+// What to do with quarantined devices
+enum quarantine { QUARANTINE_OFF, QUARANTINE_SKIP, QUARANTINE_LAST };
+
+// How to operate on a list of devices
+struct engine_options {
+    bool async;
+    bool use_daemon;
+    long jobs;
+    long per_hub;
+    long per_bus;
+};
+
+// Operate on every device in a list with the chosen engine, returns the number that failed
+static size_t run_devices(struct device_list* devices, const struct request* request,
+                          const struct engine_options* engine) {
+    if (devices->count == 0) {
+        return 0;
+    }
+    struct sched* sched = NULL;
+    if (devices->count > 1
+            && !(sched = sched_new((const char* const*)devices->paths, devices->count, engine->per_hub, engine->per_bus))) {
+        eprintf("ERROR: Out of memory\n");
+        return devices->count;
+    }
+    size_t failed;
+    if (engine->async) {
+        // Operate on all the devices from this thread
+        failed = async_run((const char* const*)devices->paths, devices->requests, devices->count, engine->jobs, sched,
+                           wdled_async_done, devices);
+        if (failed && request->prefix) {
+            eprintf("ERROR: %zu of %zu devices failed\n", failed, devices->count);
+        }
+    } else if (devices->count == 1 && !request->prefix) {
+        // Let wdledd do the work if it's running, it already has the device open and validated.
+        // The protocol has no way to pass on a timeout or deadline, so those need the disk to ourselves
+        int result = -1;
+        if (engine->use_daemon && !request->force && !request->full && !request->no_cache && !request->no_wake
+                && !request->timing && !request->save_budget && !request->json && !request->health
+                && !request->journal && !request->timeout_ms && !request->deadline_ms) {
+            result = wdled_daemon(devices->paths[0], request);
+        }
+        failed = result >= 0 ? (size_t)result : (size_t)wdled_device(devices->paths[0], request);
     } else {
-        if (!supported[vid].products[pid]) {
-            if (!force) {
-                eprintf("%s: ERROR: Unknown or unsupported product!\n", device);
-                return 1;
+        // Operate on all the devices in parallel
+        failed = batch_run(devices->count, engine->jobs, sched, wdled_batch_device, devices);
+        if (failed) {
+            eprintf("ERROR: %zu of %zu devices failed\n", failed, devices->count);
+        }
+    }
+    if (sched) {
+        sched_free(sched);
+    }
+    return failed;
+}
+
+// 1 if any device failed, 3 if any were left alone because they were asleep or quarantined,
+// 2 if there were values to set but every device already had them
+static int exit_status(size_t failed, const struct device_list* devices) {
+    if (failed) {
+        return 1;
+    }
+    if (asleep || quarantined) {
+        return 3;
+    }
+    for (size_t i = 0; i < devices->count; i++) {
+        if (devices->requests[i].new >= 0) {
+            return written ? 0 : 2;
+        }
+    }
+    return 0;
+}
+
+int main(const int argc, const char* const argv[]) {
+    const uint64_t started = trace_now_us();
+    // Split options from positional arguments
+    struct request request = { .new = -1 };
+    const char* args[argc];
+    int nargs = 0;
+    bool all = false;
+    bool scan_only = false;
+    bool watch = false;
+    bool correct = false;
+    struct engine_options engine = {
+        .use_daemon = true,
+        .jobs = BATCH_DEFAULT_JOBS,
+        .per_hub = SCHED_DEFAULT_PER_HUB,
+        .per_bus = SCHED_DEFAULT_PER_BUS,
+    };
+    enum quarantine quarantine = QUARANTINE_OFF;
+    const char* policy_path = NULL;
+    const char* metrics_path = NULL;
+    const char* journal_path = NULL;
+    bool resume = false;
+    bool options_done = false;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (options_done || arg[0] != '-') {
+            args[nargs++] = arg;
+        } else if (!strcmp(arg, "--")) {
+            options_done = true;
+        } else if (!strcmp(arg, "--help") || !strcmp(arg, "-help") || !strcmp(arg, "-h")) {
+            usage(argv[0]);
+            return 1;
+        } else if (!strcmp(arg, "--all")) {
+            all = true;
+        } else if (!strcmp(arg, "--scan")) {
+            scan_only = true;
+        } else if (!strcmp(arg, "--watch")) {
+            watch = true;
+        } else if (!strcmp(arg, "--correct")) {
+            correct = true;
+        } else if (!strcmp(arg, "--async")) {
+            engine.async = true;
+        } else if (!strcmp(arg, "--quiet-get")) {
+            request.quiet = true;
+        } else if (!strcmp(arg, "--full")) {
+            request.full = true;
+        } else if (!strcmp(arg, "--no-cache")) {
+            request.no_cache = true;
+        } else if (!strcmp(arg, "--json")) {
+            request.json = true;
+        } else if (!strcmp(arg, "--timing")) {
+            request.timing = true;
+        } else if (!strcmp(arg, "--no-wake")) {
+            request.no_wake = true;
+        } else if (!strcmp(arg, "--no-daemon")) {
+            engine.use_daemon = false;
+#ifdef HAVE_SGUTILS
+        } else if (!strcmp(arg, "--sgutils")) {
+            transport_default = &sgutils_transport;
+            engine.use_daemon = false;
+#endif
+        } else if (!strcmp(arg, "--adaptive-timeout")) {
+            request.health = true;
+            request.adaptive_timeout = true;
+        } else if (!strcmp(arg, "--quarantine")) {
+            const char* const mode = i + 1 < argc ? argv[++i] : "";
+            if (!strcmp(mode, "skip")) {
+                quarantine = QUARANTINE_SKIP;
+            } else if (!strcmp(mode, "last")) {
+                quarantine = QUARANTINE_LAST;
             } else {
-                eprintf("MANUALLY SKIPPED UNSUPPORTED DEVICE CHECK!\n");
+                eprintf("Unknown quarantine mode: %s\n", mode);
+                return 1;
             }
+            request.health = true;
+        } else if (!strcmp(arg, "--cached")) {
+            request.cached_s = CACHE_TTL_S;
+        } else if (!strncmp(arg, "--cached=", strlen("--cached="))) {
+            if (!parse_unsigned(arg + strlen("--cached="), &request.cached_s)) {
+                return 1;
+            }
+        } else if (!strcmp(arg, "--journal") || !strcmp(arg, "--resume")) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            resume = !strcmp(arg, "--resume");
+            journal_path = argv[++i];
+            request.journal = true;
+        } else if (!strcmp(arg, "--metrics")) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            metrics_path = argv[++i];
+        } else if (!strcmp(arg, "--apply-policy")) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            policy_path = argv[++i];
+        } else if (!strcmp(arg, "--timeout") || !strcmp(arg, "--deadline")) {
+            if (!parse_unsigned(i + 1 < argc ? argv[i + 1] : "", !strcmp(arg, "--timeout") ? &request.timeout_ms : &request.deadline_ms)) {
+                return 1;
+            }
+            i++;
+        } else if (!strcmp(arg, "--save-budget")) {
+            if (!parse_unsigned(i + 1 < argc ? argv[++i] : "", &request.save_budget)) {
+                return 1;
+            }
+        } else if (!strcmp(arg, "--per-hub") || !strcmp(arg, "--per-bus")) {
+            if (!parse_count(i + 1 < argc ? argv[i + 1] : "", !strcmp(arg, "--per-hub") ? &engine.per_hub : &engine.per_bus)) {
+                return 1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) {
+            if (!parse_count(i + 1 < argc ? argv[++i] : "", &engine.jobs)) {
+                return 1;
+            }
+        } else if (!strncmp(arg, "--jobs=", strlen("--jobs="))) {
+            if (!parse_count(arg + strlen("--jobs="), &engine.jobs)) {
+                return 1;
+            }
+        } else {
+            eprintf("Unknown option: %s\n", arg);
+            usage(argv[0]);
+            return 1;
         }
     }
-
-    // Read the mode page we're interested in
-    int page_len = sizeof(struct page);
-    struct page current = {}, changeable = {}, original = {}, saved = {};
-    void *arr[4] = { &current, &changeable, &original, &saved };
-    result = sg_get_mode_page_controls(fd, false, PAGE_CODE, 0, true, false, page_len, NULL, arr, &page_len, verbose);
-    if(result != 0) {
-        eprintf("%s: ERROR: Get mode page failed (%s)\n", device, safe_strerror(result));
+    if (scan_only) {
+        if (nargs > 0 || all || policy_path || request.json) {
+            eprintf("Can't specify devices, values or --json with --scan\n");
+            return 1;
+        }
+        return scan();
+    }
+    if (nargs == 0 && !all && !policy_path) {
+        usage(argv[0]);
         return 1;
     }
 
-    // Verify details about the modepage
-    const uint8_t code = PAGE_CODE | PS_BIT;
-    if (current.code != code || changeable.code != code || original.code != code || saved.code != code) {
-        eprintf("%s: ERROR: Unexpected mode page id (0x%02x)\n", device, current.code);
+    // The last argument is a VALUE rather than a DEVICE, if there's more than one,
+    // or if --all was given, and it doesn't look like a device
+    if (!policy_path && (nargs > 1 || (all && nargs == 1)) && !transport_is_device(args[nargs - 1])) {
+        const char* const value = args[--nargs];
+        if (!device_parse_value(value, &request)) {
+            eprintf("Unknown value: %s\n", value);
+            return 1;
+        }
+    }
+    if (nargs > 0 && all) {
+        eprintf("Can't specify devices with --all\n");
+        return 1;
+    }
+    if (policy_path && (all || request.quiet)) {
+        eprintf("Can't use --all or --quiet-get with --apply-policy\n");
         return 1;
     }
-    const uint8_t wd21_len = sizeof(current.wd21);
-    if (current.len != wd21_len || changeable.len != wd21_len || original.len != wd21_len || saved.len != wd21_len) {
-        eprintf("%s: ERROR: Unexpected mode page length (0x%02x)\n", device, current.len);
+    if (request.quiet && request.new >= 0) {
+        eprintf("Can't set a value with --quiet-get\n");
         return 1;
     }
-    if (current.wd21.magic != PAGE_MAGIC) {
-        eprintf("%s: ERROR: Unexpected mode page magic (0x%02x)\n", device, current.wd21.magic);
+    if (request.cached_s && (request.new >= 0 || request.no_cache || watch)) {
+        eprintf("Can't use --cached with a VALUE, --no-cache or --watch\n");
         return 1;
     }
-    if (changeable.wd21.led != 0xff) {
-        eprintf("%s: ERROR: LED bits don't appear changeable (0x%02x)\n", device, changeable.wd21.led);
+    if (watch && (engine.async || request.quiet || request.json)) {
+        eprintf("Can't use --async, --quiet-get or --json with --watch\n");
         return 1;
     }
+    if (watch && (quarantine != QUARANTINE_OFF || journal_path)) {
+        eprintf("Can't use --quarantine, --journal or --resume with --watch\n");
+        return 1;
+    }
+    if (metrics_path && !watch) {
+        eprintf("--metrics needs --watch\n");
+        return 1;
+    }
+    if (correct && (!watch || (request.new < 0 && !policy_path))) {
+        eprintf("--correct needs --watch, and a VALUE or --apply-policy to correct to\n");
+        return 1;
+    }
+    const struct targets targets = { all, args, nargs, policy_path };
+    if (request.force) {
+        eprintf("WARNING: Skipping supported vendor/product checks!\n");
+    }
 
-    // Print the LED values!
-    printf("LED: current=%d original=%d saved=%d\n", current.wd21.led, original.wd21.led, saved.wd21.led);
+    if (watch) {
+        if (metrics_path) {
+            metrics_open(metrics_path);
+        }
+        return wdled_watch(&targets, &request, correct);
+    }
 
-    if (new >= 0) {
-        // Build a mode select parameter list payload
-        struct { struct mode_parameter_header header; struct page page; } packet;
-        memset(&packet, 0, sizeof(packet));
-        memcpy(&packet.page, &current, sizeof(current));
-        packet.page.code &= current.code & 0x7f; // Clear PS bit
+    struct device_list devices = {};
+    if (!gather_devices(&devices, &targets, &request)) {
+        return 1;
+    }
+    if (devices.count == 0) {
+        eprintf("ERROR: No devices found\n");
+        return 1;
+    }
 
-        // Set the new LED mode value
-        packet.page.wd21.led = new;
+    if (devices.count > 1 || request.prefix) {
+        request.prefix = true;
+        for (size_t i = 0; i < devices.count; i++) {
+            devices.requests[i].prefix = true;
+        }
+    }
+    const uint64_t gathered = trace_now_us();
 
-        // Send the mode select packet!
-        const size_t packet_size = sizeof(packet.header) + 2 + sizeof(packet.page.wd21);
-        const bool page_format = true;
-        result = sg_ll_mode_select10(fd, page_format, save, &packet, packet_size, noisy, verbose);
-        if(result != 0) {
-            eprintf("%s: ERROR: Set mode page failed (%s)\n", device, safe_strerror(result));
+    if (journal_path) {
+        char error[256];
+        if (!journal_open(journal_path, resume, error, sizeof(error))) {
+            eprintf("%s: ERROR: %s\n", journal_path, error);
             return 1;
         }
     }
 
-    return 0;
+    // Skip devices the journal being resumed has as done
+    struct device_list done = {};
+    if (resume && !device_list_hold(&devices, &done, journal_done)) {
+        eprintf("ERROR: Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < done.count; i++) {
+        report_held(done.paths[i], &done.requests[i], "resumed", "Already done (journal)");
+    }
+    resumed = done.count;
+    device_list_free(&done);
+
+    // Set quarantined devices aside, to be skipped or left until everything else has finished
+    struct device_list held = {};
+    if (quarantine != QUARANTINE_OFF && !device_list_hold(&devices, &held, quarantine_held)) {
+        eprintf("ERROR: Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; quarantine == QUARANTINE_SKIP && i < held.count; i++) {
+        report_held(held.paths[i], &held.requests[i], "quarantined", "Quarantined (slow or failing)");
+    }
+    quarantined = quarantine == QUARANTINE_SKIP ? held.count : 0;
+    size_t failed = run_devices(&devices, &request, &engine);
+    if (quarantine == QUARANTINE_LAST && held.count) {
+        eprintf("Running %zu quarantined device%s\n", held.count, held.count == 1 ? "" : "s");
+        failed += run_devices(&held, &request, &engine);
+    }
+    if (resumed) {
+        eprintf("%zu device%s already done\n", resumed, resumed == 1 ? " was" : "s were");
+    }
+    if (quarantined) {
+        eprintf("%zu quarantined device%s skipped\n", quarantined, quarantined == 1 ? " was" : "s were");
+    }
+    if (request.timing) {
+        const uint64_t finished = trace_now_us();
+        eprintf("timing: gather=%" PRIu64 "us devices=%" PRIu64 "us total=%" PRIu64 "us\n",
+                gathered - started, finished - gathered, finished - started);
+    }
+    const int status = exit_status(failed, &devices);
+    device_list_free(&held);
+    return status;
 }
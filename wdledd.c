@@ -0,0 +1,870 @@
+/*
+ * wdledd - Daemon to control the LED mode of WD My Passport Disks
+ *
+ * Copyright 2020 James Lee (jbit@jbit.net)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "budget.h"
+#include "cache.h"
+#include "device.h"
+#include "metrics.h"
+#include "policy.h"
+#include "proto.h"
+#include "scsi.h"
+#include "sysfs.h"
+#include "transport.h"
+#include "uevent.h"
+
+#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+#define DAEMON_NAME "wdledd"
+#define MAX_CLIENTS 64
+#define SD_LISTEN_FDS_START 3
+
+// Drives often report NOT READY for a moment after they appear, so retry with backoff
+#define HOTPLUG_ATTEMPTS     10
+#define HOTPLUG_RETRY_MS     50
+#define HOTPLUG_RETRY_MAX_MS 1000
+
+// udev answers a block device being closed after it was opened for writing with a change event, so for
+// this long after applying a value through a block node, change events for that drive are our own
+#define HOTPLUG_ECHO_MS      2000
+
+// A hung disk holds up every other client, so commands are given much less time than wdled gives them
+#define DAEMON_TIMEOUT_MS    10000
+
+// How often to check whether a sleeping drive with a deferred change has woken up (with --no-wake)
+#define ASLEEP_RETRY_MS      30000
+
+// A device kept open and validated between requests
+struct managed {
+    char path[PATH_MAX]; // Canonical path, empty if the slot is free
+    char dir[PATH_MAX];  // sysfs SCSI device directory, which identifies the drive whichever node it was opened through
+    int fd;
+    struct result state; // Identity and page controls as last read (or written) by us
+    uint64_t confirmed;  // When state's LED values were last read or written, 0 if they may be out of date
+};
+
+struct client {
+    int fd; // -1 if the slot is free
+    size_t len;
+    char buf[PROTO_LINE_MAX];
+};
+
+// A drive that appeared (or was asleep), waiting to have the hotplug value (or a deferred SET) applied
+struct pending {
+    char devname[32];
+    char dir[PATH_MAX]; // sysfs SCSI device directory, which identifies the drive
+    struct request request; // A deferred SET, or new < 0 to use the hotplug value or policy
+    int attempts;
+    bool asleep;        // The drive was asleep, check again later
+    bool applied;       // Done, kept until due to recognise the change event our own close causes
+    uint64_t due;       // When to (re)try, in CLOCK_MONOTONIC milliseconds
+};
+
+struct daemon {
+    int listen_fd;
+    int uevent_fd;                // -1 if uevents aren't available
+    const char* hotplug_subsystem;
+    struct request hotplug;       // What to apply to drives as they appear
+    struct policy* policy;        // Or how to decide what to apply, if --policy was given
+    bool no_wake;                 // Don't wake sleeping drives, answer from cache and defer changes
+    unsigned save_budget;         // Saves allowed per drive per day, 0 for no limit
+    unsigned timeout_ms;          // Timeout for each command
+    unsigned deadline_ms;         // Give up on a disk that hasn't finished in this long, 0 for no deadline
+    struct pending* pending;
+    size_t npending;
+    const char* socket_path; // Set if we created the socket (rather than systemd)
+    struct managed* devices;
+    size_t ndevices;
+    struct client clients[MAX_CLIENTS];
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int signal) {
+    (void)signal;
+    quit = 1;
+}
+
+static void usage(const char* argv0) {
+    eprintf("%s %s (%s) - Daemon to control the LED mode of WD My Passport Disks\n", DAEMON_NAME, CMD_VER, CMD_URL);
+    eprintf("Usage: %s [OPTIONS]\n", argv0);
+    eprintf("  -s, --socket PATH    Listen on PATH (default %s)\n", DAEMON_SOCKET);
+    eprintf("  --hotplug VALUE      Set the LED mode of supported disks to VALUE as soon as they appear\n");
+    eprintf("  --policy FILE        Set the LED mode of disks as they appear using the first matching rule in FILE\n");
+    eprintf("                       (falling back to the --hotplug VALUE, if any)\n");
+    eprintf("  --no-wake            Don't wake sleeping disks: answer GETs from the cache, and defer SETs until they wake\n");
+    eprintf("  --metrics FILE       Keep FILE up to date with metrics for node_exporter's textfile collector\n");
+    eprintf("  --save-budget N      Save the LED mode of each disk at most N times a day, just setting it once that's used up\n");
+    eprintf("  --timeout MS         Abort any SCSI command that takes longer than MS milliseconds (default %d)\n", DAEMON_TIMEOUT_MS);
+    eprintf("  --deadline MS        Give up on a disk that hasn't finished a request within MS milliseconds\n");
+    eprintf("\n");
+    eprintf("Supports systemd socket activation, in which case --socket is ignored.\n");
+}
+
+// Use a socket passed in by systemd, or create our own
+static int listen_socket(struct daemon* daemon, const char* path) {
+    const char* const listen_pid = getenv("LISTEN_PID");
+    const char* const listen_fds = getenv("LISTEN_FDS");
+    if (listen_pid && listen_fds && atol(listen_pid) == getpid() && atoi(listen_fds) >= 1) {
+        const int fd = SD_LISTEN_FDS_START;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        return fd;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Make sure the directory exists, and clear out any stale socket
+    char dir[sizeof(addr.sun_path)];
+    strcpy(dir, path);
+    char* const slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+    }
+    unlink(path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    const mode_t mask = umask(0117);
+    const int result = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (result != 0 || listen(fd, MAX_CLIENTS) != 0) {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+    daemon->socket_path = path;
+    return fd;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void managed_close(struct managed* device) {
+    transport_default->close(device->fd);
+    device->fd = -1;
+    device->path[0] = '\0';
+    device->dir[0] = '\0';
+}
+
+// Forget about a device after a failure, so the next request starts from scratch
+static void managed_fail(struct managed* device, const struct result* result, char* response, size_t len) {
+    char message[128];
+    device_strerror(result, message, sizeof(message));
+    eprintf("%s: ERROR: %s\n", device->path, message);
+    metrics_error(device->path, result->err);
+    snprintf(response, len, "ERR %s", message);
+    managed_close(device);
+}
+
+// Find an open device, or open and validate it. Sets *fresh if the device was just validated
+static struct managed* managed_get(struct daemon* daemon, const char* path, bool* fresh, char* response, size_t len) {
+    char canonical[PATH_MAX];
+    if (path[0] != '/' || !realpath(path, canonical)) {
+        snprintf(response, len, "ERR Invalid device path");
+        return NULL;
+    }
+
+    struct managed* free_slot = NULL;
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        struct managed* const device = &daemon->devices[i];
+        if (!strcmp(device->path, canonical)) {
+            *fresh = false;
+            return device;
+        }
+        if (!device->path[0] && !free_slot) {
+            free_slot = device;
+        }
+    }
+    if (!free_slot) {
+        struct managed* const devices = realloc(daemon->devices, (daemon->ndevices + 1) * sizeof(*devices));
+        if (!devices) {
+            snprintf(response, len, "ERR Out of memory");
+            return NULL;
+        }
+        daemon->devices = devices;
+        free_slot = &devices[daemon->ndevices++];
+    }
+
+    // Run every check once, and keep all the page controls for later requests
+    struct managed* const device = free_slot;
+    memset(device, 0, sizeof(*device));
+    snprintf(device->path, sizeof(device->path), "%s", canonical);
+    if (sysfs_device_dir(canonical, device->dir, sizeof(device->dir)) != 0) {
+        device->dir[0] = '\0';
+    }
+    const struct request request = {
+        .full = true, .new = -1, .timeout_ms = daemon->timeout_ms, .deadline_ms = daemon->deadline_ms,
+    };
+    struct plan plan = device_plan(&request);
+    transport_start(&request, &plan);
+    device->fd = transport_default->open(canonical, false);
+    if (device->fd < 0) {
+        device->state.err = DEVICE_ERR_OPEN;
+        device->state.detail = device->fd;
+    } else {
+        transport_run(transport_default, device->fd, &request, &plan, &device->state);
+    }
+    if (device->state.err != DEVICE_OK) {
+        managed_fail(device, &device->state, response, len);
+        return NULL;
+    }
+    const struct identity* const identity = &device->state.identity;
+    eprintf("%s: %s %s (rev %s)\n", canonical, identity->vendor, identity->product, identity->revision);
+    device->confirmed = now_ms();
+    *fresh = true;
+    return device;
+}
+
+// With --no-wake, check whether a disk is asleep without waking it
+static bool daemon_asleep(struct daemon* daemon, const char* path) {
+    char canonical[PATH_MAX];
+    if (!daemon->no_wake || path[0] != '/' || !realpath(path, canonical)) {
+        return false;
+    }
+    if (sysfs_runtime_suspended(canonical)) {
+        return true;
+    }
+    const struct request request = { .new = -1, .timeout_ms = daemon->timeout_ms, .deadline_ms = daemon->deadline_ms };
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        if (!strcmp(daemon->devices[i].path, canonical)) {
+            return transport_asleep(transport_default, daemon->devices[i].fd, &request);
+        }
+    }
+    const int fd = transport_default->open(canonical, true);
+    if (fd < 0) {
+        return false;
+    }
+    const bool asleep = transport_asleep(transport_default, fd, &request);
+    transport_default->close(fd);
+    return asleep;
+}
+
+// The LED values last seen on a sleeping disk: our own if we're managing it, otherwise the cache's
+static bool daemon_recall(struct daemon* daemon, const char* path, const struct request* request, struct result* result) {
+    char canonical[PATH_MAX];
+    if (!realpath(path, canonical)) {
+        return false;
+    }
+    struct plan plan = device_plan(request);
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        if (!strcmp(daemon->devices[i].path, canonical)) {
+            *result = daemon->devices[i].state;
+            result->cached = true;
+            result->unchanged = request->new >= 0 && device_unchanged(request, &plan, result);
+            return true;
+        }
+    }
+    plan.page_controls |= PC_MASK(PC_DEFAULT) | PC_MASK(PC_SAVED);
+    struct cache_key key;
+    memset(result, 0, sizeof(*result));
+    cache_prepare(canonical, request, &plan, result, &key);
+    return cache_recall(&key, request, &plan, result);
+}
+
+static void pending_add(struct daemon* daemon, const char* devname, const char* dir, const struct request* request);
+
+// Queue a SET for a sleeping disk, to be applied once it wakes up
+static bool daemon_defer(struct daemon* daemon, const char* path, const struct request* request) {
+    char canonical[PATH_MAX], dir[PATH_MAX];
+    if (!realpath(path, canonical) || sysfs_device_dir(canonical, dir, sizeof(dir)) != 0) {
+        return false;
+    }
+    const char* const devname = strrchr(canonical, '/') + 1;
+    if (strlen(devname) >= sizeof(daemon->pending->devname)) {
+        return false;
+    }
+    pending_add(daemon, devname, dir, request);
+    return true;
+}
+
+// The LED mode a drive should have from the policy or hotplug value, or -1 if there's none
+static int daemon_expected(const struct daemon* daemon, const char* path) {
+    const struct policy_rule* const rule = daemon->policy ? policy_lookup_node(daemon->policy, path, NULL, 0) : NULL;
+    return rule ? rule->request.new : daemon->hotplug.new;
+}
+
+// max_age_s is how old the LED values can be to answer from our copy without asking the disk, 0 to always ask it
+static void handle_get(struct daemon* daemon, const char* path, unsigned max_age_s, char* response, size_t len) {
+    if (daemon_asleep(daemon, path)) {
+        const struct request request = { .new = -1 };
+        struct result result;
+        char values[64];
+        if (!daemon_recall(daemon, path, &request, &result)) {
+            snprintf(response, len, "ERR Disk is asleep, and its LED mode isn't cached");
+            return;
+        }
+        device_format_values(&result, values, sizeof(values));
+        snprintf(response, len, "OK %s cached", values);
+        return;
+    }
+
+    bool fresh;
+    struct managed* const device = managed_get(daemon, path, &fresh, response, len);
+    if (!device) {
+        return;
+    }
+
+    // The default value never changes, and the saved value only changes when we save it,
+    // so only the current value needs to be read again
+    // Without uevents a reset or replug would go unnoticed, so there's no trusting our copy
+    const bool cached = !fresh && daemon->uevent_fd >= 0 && device->confirmed
+                        && now_ms() - device->confirmed < max_age_s * 1000ull;
+    if (!fresh && !cached) {
+        const struct request request = { .new = -1, .timeout_ms = daemon->timeout_ms, .deadline_ms = daemon->deadline_ms };
+        struct plan plan = { .page_controls = PC_MASK(PC_CURRENT) };
+        transport_start(&request, &plan);
+        struct result result = device->state;
+        transport_run(transport_default, device->fd, &request, &plan, &result);
+        if (result.err != DEVICE_OK) {
+            managed_fail(device, &result, response, len);
+            return;
+        }
+        device->state.current = result.current;
+        device->confirmed = now_ms();
+    }
+    metrics_led(device->path, device->state.current.wd21.led, daemon_expected(daemon, device->path));
+
+    char values[64];
+    device_format_values(&device->state, values, sizeof(values));
+    snprintf(response, len, "OK %s%s", values, cached ? " cached" : "");
+}
+
+static void handle_set(struct daemon* daemon, const char* path, const char* value, char* response, size_t len) {
+    struct request request = { .new = -1 };
+    if (!device_parse_value(value, &request) || request.new < 0) {
+        snprintf(response, len, "ERR Unknown value: %s", value);
+        return;
+    }
+    if (request.force) {
+        snprintf(response, len, "ERR Forced values can't be used with %s", DAEMON_NAME);
+        return;
+    }
+    request.save_budget = daemon->save_budget;
+    request.timeout_ms = daemon->timeout_ms;
+    request.deadline_ms = daemon->deadline_ms;
+
+    if (daemon_asleep(daemon, path)) {
+        struct result result;
+        char values[64];
+        if (daemon_recall(daemon, path, &request, &result) && result.unchanged) {
+            device_format_values(&result, values, sizeof(values));
+            snprintf(response, len, "OK %s unchanged cached", values);
+        } else if (daemon_defer(daemon, path, &request)) {
+            snprintf(response, len, "OK deferred");
+        } else {
+            snprintf(response, len, "ERR Disk is asleep");
+        }
+        return;
+    }
+
+    bool fresh;
+    struct managed* const device = managed_get(daemon, path, &fresh, response, len);
+    if (!device) {
+        return;
+    }
+
+    // A fresh current page is all that's needed to tell whether the MODE SELECT can be skipped, but a save
+    // needs the saved page as it is now, as anything else with the disk open may have saved since we read it
+    struct plan plan = { .page_controls = fresh ? 0 : PC_MASK(PC_CURRENT), .select = true };
+    if (request.save) {
+        plan.page_controls |= PC_MASK(PC_SAVED);
+    }
+    transport_start(&request, &plan);
+    struct budget_key budget;
+    budget_prepare(device->path, &request, &plan, &budget);
+    struct result result = device->state;
+    transport_run(transport_default, device->fd, &request, &plan, &result);
+    budget_update(&budget, &result);
+    if (result.err != DEVICE_OK) {
+        managed_fail(device, &result, response, len);
+        return;
+    }
+    device->state.current = result.current;
+    device->state.saved = result.saved;
+
+    char values[64];
+    device_format_values(&device->state, values, sizeof(values));
+    snprintf(response, len, "OK %s%s%s", values, result.unchanged ? " unchanged" : "", result.save_deferred ? " unsaved" : "");
+
+    device->state.current.wd21.led = request.new;
+    device->confirmed = now_ms();
+    metrics_led(device->path, request.new, daemon_expected(daemon, device->path));
+    if (result.nv_write) {
+        device->state.saved.wd21.led = request.new;
+    }
+
+    // The cache's idea of the LED values is out of date now
+    char dir[PATH_MAX];
+    if (!result.unchanged && sysfs_device_dir(device->path, dir, sizeof(dir)) == 0) {
+        cache_expire(dir);
+    }
+}
+
+// Failures that are expected while a drive is still coming up
+static bool transient_failure(const struct result* result) {
+    switch (result->err) {
+    case DEVICE_ERR_OPEN:
+        return result->detail == -ENOENT || result->detail == -ENXIO || result->detail == -EBUSY;
+    case DEVICE_ERR_INQUIRY:
+    case DEVICE_ERR_MODE_SENSE:
+    case DEVICE_ERR_MODE_SELECT:
+        return result->detail == SCSI_CAT_NOT_READY || result->detail == SCSI_CAT_UNIT_ATTENTION;
+    default:
+        return false;
+    }
+}
+
+// Keep our copy of a managed device's state in step with a change made behind its back
+// dir is the drive's sysfs SCSI device directory, as the node it was changed through may not be the one we have open
+static void managed_applied(struct daemon* daemon, const char* dir, const struct request* request, const struct result* result) {
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        struct managed* const device = &daemon->devices[i];
+        if (device->path[0] && !strcmp(device->dir, dir)) {
+            device->state.current.wd21.led = request->new;
+            device->confirmed = now_ms();
+            if (result->nv_write) {
+                device->state.saved.wd21.led = request->new;
+            }
+        }
+    }
+}
+
+// Apply the hotplug value (or a deferred SET) to a drive, returns false if it should be retried
+static bool hotplug_apply(struct daemon* daemon, struct pending* pending) {
+    // Only touch drives the kernel has already identified as supported
+    struct identity identity;
+    if (!sysfs_identity(pending->dir, &identity) || device_check_identity(&identity) != DEVICE_OK) {
+        return true;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/%s", pending->devname);
+    const struct request* request = &daemon->hotplug;
+    if (pending->request.new >= 0) {
+        request = &pending->request;
+    } else if (daemon->policy) {
+        // The /dev/disk/by-id links may not exist yet, so id: rules can't match here
+        const struct policy_rule* const rule = policy_lookup_node(daemon->policy, path, NULL, 0);
+        if (rule) {
+            request = &rule->request;
+        }
+    }
+    if (request->new < 0) {
+        return true;
+    }
+    struct request target = *request;
+    target.save_budget = daemon->save_budget;
+    target.timeout_ms = daemon->timeout_ms;
+    target.deadline_ms = daemon->deadline_ms;
+    request = &target;
+    struct plan plan = device_plan(request);
+    transport_start(request, &plan);
+    struct result result = {};
+    struct cache_key key;
+    struct budget_key budget;
+    cache_prepare(path, request, &plan, &result, &key);
+    budget_prepare(path, request, &plan, &budget);
+    // The cached mode page may be out of date (other bytes of the page can change while the drive is away),
+    // so the current page is always read before it's written back: on a cache hit that's one MODE SENSE
+    // and (unless the value is already set) one MODE SELECT
+
+    plan.power_check = daemon->no_wake;
+    if (plan.power_check && sysfs_runtime_suspended(path)) {
+        result.asleep = true;
+    } else {
+        const int fd = transport_default->open(path, false);
+        if (fd < 0) {
+            result.err = DEVICE_ERR_OPEN;
+            result.detail = fd;
+        } else {
+            transport_run(transport_default, fd, request, &plan, &result);
+            transport_default->close(fd);
+        }
+    }
+    if (result.asleep) {
+        pending->asleep = true;
+        return false;
+    }
+    cache_update(&key, request, &result);
+    budget_update(&budget, &result);
+
+    if (result.err == DEVICE_OK) {
+        managed_applied(daemon, pending->dir, request, &result);
+        metrics_led(path, request->new, daemon_expected(daemon, path));
+        eprintf("%s: %s %s (rev %s): LED %s %d%s\n", path, result.identity.vendor, result.identity.product,
+                result.identity.revision, result.unchanged ? "already" : "set to", request->new,
+                request->save ? (result.save_deferred ? " (not saved, write budget used up)" : " (saved)") : "");
+        return true;
+    }
+    if (transient_failure(&result) && pending->attempts + 1 < HOTPLUG_ATTEMPTS) {
+        return false;
+    }
+    char message[128];
+    device_strerror(&result, message, sizeof(message));
+    eprintf("%s: ERROR: %s\n", path, message);
+    metrics_error(path, result.err);
+    return true;
+}
+
+// Queue a drive to have a request (or the hotplug value, if request is NULL) applied
+static void pending_add(struct daemon* daemon, const char* devname, const char* dir, const struct request* request) {
+    for (size_t i = 0; i < daemon->npending; i++) {
+        if (daemon->pending[i].applied && !strcmp(daemon->pending[i].dir, dir)) {
+            daemon->pending[i--] = daemon->pending[--daemon->npending];
+        } else if (!strcmp(daemon->pending[i].dir, dir)) {
+            // A later SET replaces any earlier one
+            if (request) {
+                daemon->pending[i].request = *request;
+            }
+            return;
+        }
+    }
+    struct pending* const pending = realloc(daemon->pending, (daemon->npending + 1) * sizeof(*pending));
+    if (!pending) {
+        return;
+    }
+    daemon->pending = pending;
+    struct pending* const entry = &pending[daemon->npending++];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->devname, devname);
+    strcpy(entry->dir, dir);
+    entry->request = request ? *request : (struct request){ .new = -1 };
+    entry->due = now_ms();
+}
+
+// Queue a drive to have the hotplug value applied, if there is one.
+// It may have been reset, so nothing we (or the cache) remember about its LED values can be trusted
+static void hotplug_add(struct daemon* daemon, const struct uevent* event) {
+    char dir[PATH_MAX];
+    if (!uevent_device_dir(event, dir, sizeof(dir)) || strlen(event->devname) >= sizeof(daemon->pending->devname)) {
+        return;
+    }
+    for (size_t i = 0; !strcmp(event->action, "change") && i < daemon->npending; i++) {
+        if (daemon->pending[i].applied && !strcmp(daemon->pending[i].dir, dir)) {
+            return;
+        }
+    }
+    cache_expire(dir);
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        if (daemon->devices[i].path[0] && !strcmp(daemon->devices[i].dir, dir)) {
+            daemon->devices[i].confirmed = 0;
+        }
+    }
+    if (daemon->hotplug.new >= 0 || daemon->policy) {
+        pending_add(daemon, event->devname, dir, NULL);
+    }
+}
+
+static void hotplug_remove(struct daemon* daemon, const struct uevent* event) {
+    for (size_t i = 0; i < daemon->npending; i++) {
+        if (!strcmp(daemon->pending[i].devname, event->devname)) {
+            daemon->pending[i--] = daemon->pending[--daemon->npending];
+        }
+    }
+
+    // Don't hang on to devices that have gone away, whichever of their nodes they were opened through
+    char path[64], dir[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/%s", event->devname);
+    metrics_forget(path);
+    if (!uevent_device_dir(event, dir, sizeof(dir))) {
+        return;
+    }
+    for (size_t i = 0; i < daemon->ndevices; i++) {
+        struct managed* const device = &daemon->devices[i];
+        if (device->path[0] && !strcmp(device->dir, dir)) {
+            metrics_forget(device->path);
+            managed_close(device);
+        }
+    }
+}
+
+static void hotplug_read(struct daemon* daemon) {
+    char buf[UEVENT_BUFFER_SIZE];
+    struct uevent event;
+    while (uevent_read(daemon->uevent_fd, buf, sizeof(buf), &event)) {
+        if (!uevent_is_scsi_disk(&event) || strcmp(event.subsystem, daemon->hotplug_subsystem)) {
+            continue;
+        }
+        // A change event can mean the drive was reset, which drops volatile settings
+        if (!strcmp(event.action, "add") || !strcmp(event.action, "change")) {
+            hotplug_add(daemon, &event);
+        } else if (!strcmp(event.action, "remove")) {
+            hotplug_remove(daemon, &event);
+        }
+    }
+}
+
+// Process pending drives that are due, returns the poll() timeout until the next one
+static int hotplug_run(struct daemon* daemon) {
+    uint64_t now = now_ms();
+    for (size_t i = 0; i < daemon->npending; i++) {
+        struct pending* const pending = &daemon->pending[i];
+        if (pending->due > now) {
+            continue;
+        }
+        if (pending->applied) {
+            daemon->pending[i--] = daemon->pending[--daemon->npending];
+        } else if (hotplug_apply(daemon, pending)) {
+            if (strcmp(daemon->hotplug_subsystem, "block")) {
+                daemon->pending[i--] = daemon->pending[--daemon->npending];
+            } else {
+                pending->applied = true;
+                pending->due = now_ms() + HOTPLUG_ECHO_MS;
+            }
+        } else if (pending->asleep) {
+            // Not a failure, so it doesn't use up an attempt
+            pending->asleep = false;
+            pending->due = now + ASLEEP_RETRY_MS;
+        } else {
+            uint64_t delay = (uint64_t)HOTPLUG_RETRY_MS << pending->attempts;
+            pending->attempts++;
+            pending->due = now + (delay < HOTPLUG_RETRY_MAX_MS ? delay : HOTPLUG_RETRY_MAX_MS);
+        }
+        now = now_ms();
+    }
+
+    int timeout = -1;
+    for (size_t i = 0; i < daemon->npending; i++) {
+        const uint64_t wait = daemon->pending[i].due > now ? daemon->pending[i].due - now : 0;
+        if (timeout < 0 || wait < (uint64_t)timeout) {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+static void handle_line(struct daemon* daemon, char* line, char* response, size_t len) {
+    char* saveptr;
+    const char* const command = strtok_r(line, " \t\r", &saveptr);
+    const char* const path = strtok_r(NULL, " \t\r", &saveptr);
+    const char* const value = strtok_r(NULL, " \t\r", &saveptr);
+
+    if (!command) {
+        snprintf(response, len, "ERR Empty request");
+    } else if (!strcmp(command, "PING")) {
+        snprintf(response, len, "OK %s %s", DAEMON_NAME, CMD_VER);
+    } else if (!strcmp(command, "GET") && path) {
+        char* endptr = NULL;
+        const unsigned long max_age_s = value ? strtoul(value, &endptr, 10) : 0;
+        if (value && (*endptr || endptr == value || max_age_s > UINT_MAX)) {
+            snprintf(response, len, "ERR Invalid max age: %s", value);
+        } else {
+            handle_get(daemon, path, max_age_s, response, len);
+        }
+    } else if (!strcmp(command, "SET") && path && value) {
+        handle_set(daemon, path, value, response, len);
+    } else {
+        snprintf(response, len, "ERR Invalid request");
+    }
+}
+
+static void client_close(struct client* client) {
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+// Read from a client, and answer every complete request line
+static void client_read(struct daemon* daemon, struct client* client) {
+    const ssize_t result = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+    if (result < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (result <= 0) {
+        client_close(client);
+        return;
+    }
+    client->len += result;
+
+    char* line = client->buf;
+    for (char* newline; (newline = memchr(line, '\n', client->buf + client->len - line));) {
+        *newline = '\0';
+        char response[PROTO_LINE_MAX];
+        handle_line(daemon, line, response, sizeof(response) - 1);
+        strcat(response, "\n");
+        if (send(client->fd, response, strlen(response), MSG_NOSIGNAL) < 0) {
+            client_close(client);
+            return;
+        }
+        line = newline + 1;
+    }
+
+    // Keep any partial line for next time, but drop clients sending lines that are far too long
+    client->len -= line - client->buf;
+    memmove(client->buf, line, client->len);
+    if (client->len == sizeof(client->buf)) {
+        client_close(client);
+    }
+}
+
+static void accept_clients(struct daemon* daemon) {
+    for (;;) {
+        const int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct client* client = NULL;
+        for (size_t i = 0; i < MAX_CLIENTS && !client; i++) {
+            if (daemon->clients[i].fd < 0) {
+                client = &daemon->clients[i];
+            }
+        }
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->len = 0;
+    }
+}
+
+int main(const int argc, const char* const argv[]) {
+    const char* socket_path = DAEMON_SOCKET;
+    struct daemon daemon = { .uevent_fd = -1, .hotplug = { .new = -1 }, .timeout_ms = DAEMON_TIMEOUT_MS };
+    for (int i = 1; i < argc; i++) {
+        const char* const arg = argv[i];
+        if ((!strcmp(arg, "-s") || !strcmp(arg, "--socket")) && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (!strcmp(arg, "--hotplug") && i + 1 < argc) {
+            const char* const value = argv[++i];
+            if (!device_parse_value(value, &daemon.hotplug) || daemon.hotplug.new < 0 || daemon.hotplug.force) {
+                eprintf("Unknown value: %s\n", value);
+                return 1;
+            }
+        } else if (!strcmp(arg, "--no-wake")) {
+            daemon.no_wake = true;
+        } else if (!strcmp(arg, "--metrics") && i + 1 < argc) {
+            metrics_open(argv[++i]);
+        } else if (!strcmp(arg, "--save-budget") && i + 1 < argc) {
+            char* endptr;
+            const char* const count = argv[++i];
+            const unsigned long value = strtoul(count, &endptr, 10);
+            if (!*count || *endptr || !value || value > UINT_MAX) {
+                eprintf("Invalid count: %s\n", count);
+                return 1;
+            }
+            daemon.save_budget = value;
+        } else if ((!strcmp(arg, "--timeout") || !strcmp(arg, "--deadline")) && i + 1 < argc) {
+            char* endptr;
+            const char* const ms = argv[++i];
+            const unsigned long value = strtoul(ms, &endptr, 10);
+            if (!*ms || *endptr || !value || value > UINT_MAX) {
+                eprintf("Invalid count: %s\n", ms);
+                return 1;
+            }
+            *(!strcmp(arg, "--timeout") ? &daemon.timeout_ms : &daemon.deadline_ms) = value;
+        } else if (!strcmp(arg, "--policy") && i + 1 < argc) {
+            const char* const path = argv[++i];
+            char error[256];
+            policy_free(daemon.policy);
+            if (!(daemon.policy = policy_load(path, error, sizeof(error)))) {
+                eprintf("%s: ERROR: %s\n", path, error);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+        daemon.clients[i].fd = -1;
+    }
+    daemon.listen_fd = listen_socket(&daemon, socket_path);
+    if (daemon.listen_fd < 0) {
+        eprintf("%s: ERROR: Failed to listen (%s)\n", socket_path, strerror(-daemon.listen_fd));
+        return 1;
+    }
+
+    // Uevents are needed for hotplug, and to notice drives being reset or replugged behind our copy of their state
+    daemon.uevent_fd = uevent_open();
+    if (daemon.uevent_fd < 0) {
+        if (daemon.hotplug.new >= 0 || daemon.policy) {
+            eprintf("ERROR: Failed to listen for uevents (%s)\n", strerror(-daemon.uevent_fd));
+            return 1;
+        }
+        eprintf("WARNING: Failed to listen for uevents (%s), GET will always read the disk\n", strerror(-daemon.uevent_fd));
+    }
+    // Every drive has both an sg and a disk node, only handle one of them
+    daemon.hotplug_subsystem = access("/sys/class/scsi_generic", F_OK) == 0 ? "scsi_generic" : "block";
+
+    struct sigaction action = { .sa_handler = handle_signal };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    eprintf("%s %s: Ready\n", DAEMON_NAME, CMD_VER);
+    struct pollfd pfds[2 + MAX_CLIENTS];
+    while (!quit) {
+        const int timeout = hotplug_run(&daemon);
+        metrics_flush();
+        pfds[0].fd = daemon.listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = daemon.uevent_fd;
+        pfds[1].events = POLLIN;
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            pfds[2 + i].fd = daemon.clients[i].fd;
+            pfds[2 + i].events = POLLIN;
+        }
+        if (poll(pfds, 2 + MAX_CLIENTS, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            eprintf("ERROR: poll failed (%s)\n", strerror(errno));
+            break;
+        }
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            if (daemon.clients[i].fd >= 0 && pfds[2 + i].revents) {
+                client_read(&daemon, &daemon.clients[i]);
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            accept_clients(&daemon);
+        }
+        if (pfds[1].revents & POLLIN) {
+            hotplug_read(&daemon);
+        }
+    }
+
+    for (size_t i = 0; i < daemon.ndevices; i++) {
+        if (daemon.devices[i].path[0]) {
+            managed_close(&daemon.devices[i]);
+        }
+    }
+    if (daemon.socket_path) {
+        unlink(daemon.socket_path);
+    }
+    policy_free(daemon.policy);
+    return 0;
+}